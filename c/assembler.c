@@ -0,0 +1,137 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "assembler.h"
+#include "memory.h"
+
+#ifdef JIT
+
+void emitByte(Assembler* as, uint8_t byte) {
+    if (as->capacity < as->count + 1) {
+        as->capacity = GROW_CAPACITY(as->capacity);
+        as->code = realloc(as->code, as->capacity);
+        if (as->code == NULL) exit(1);
+    }
+    as->code[as->count++] = byte;
+}
+
+void emitBytes(Assembler* as, int count, const uint8_t* bytes) {
+    for (int i = 0; i < count; i++) emitByte(as, bytes[i]);
+}
+
+void emit32(Assembler* as, uint32_t value) {
+    for (int i = 0; i < 4; i++) emitByte(as, (value >> (8 * i)) & 0xff);
+}
+
+void emit64(Assembler* as, uint64_t value) {
+    for (int i = 0; i < 8; i++) emitByte(as, (value >> (8 * i)) & 0xff);
+}
+
+static void patch32(Assembler* as, int offset, uint32_t value) {
+    for (int i = 0; i < 4; i++) as->code[offset + i] = (value >> (8 * i)) & 0xff;
+}
+
+static uint8_t rex(int reg, int rm) {
+    return 0x48 | (reg >= 8 ? 4 : 0) | (rm >= 8 ? 1 : 0);
+}
+
+void emitMoveImmediate(Assembler* as, int reg, uint64_t value) {
+    emitByte(as, rex(0, reg));
+    emitByte(as, 0xB8 + (reg & 7));
+    emit64(as, value);
+}
+
+void emitRegisters(Assembler* as, uint8_t op, int rm, int reg) {
+    emitByte(as, rex(reg, rm));
+    emitByte(as, op);
+    emitByte(as, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+void emitMemory(Assembler* as, uint8_t op, int reg, int base, int32_t disp) {
+    emitByte(as, rex(reg, base));
+    emitByte(as, op);
+    emitByte(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP) emitByte(as, 0x24); // rsp and r12 need a SIB byte.
+    emit32(as, (uint32_t)disp);
+}
+
+// The xmm register goes in the reg field, so xmm8-xmm15 need REX.R.
+void emitToXmm(Assembler* as, int xmm, int reg) {
+    emitByte(as, 0x66);
+    emitByte(as, rex(xmm, reg));
+    emitBytes(as, 2, (uint8_t[]){0x0F, 0x6E});
+    emitByte(as, 0xC0 | ((xmm & 7) << 3) | (reg & 7));
+}
+
+void emitFromXmm(Assembler* as, int reg, int xmm) {
+    emitByte(as, 0x66);
+    emitByte(as, rex(xmm, reg));
+    emitBytes(as, 2, (uint8_t[]){0x0F, 0x7E});
+    emitByte(as, 0xC0 | ((xmm & 7) << 3) | (reg & 7));
+}
+
+void emitSse(Assembler* as, uint8_t op) {
+    emitBytes(as, 4, (uint8_t[]){0xF2, 0x0F, op, 0xC1});
+}
+
+void emitSseRegisters(Assembler* as, uint8_t prefix, uint8_t op, int dst, int src) {
+    emitByte(as, prefix);
+    if (dst >= 8 || src >= 8) {
+        emitByte(as, 0x40 | (dst >= 8 ? 4 : 0) | (src >= 8 ? 1 : 0));
+    }
+    emitBytes(as, 2, (uint8_t[]){0x0F, op});
+    emitByte(as, 0xC0 | ((dst & 7) << 3) | (src & 7));
+}
+
+int emitJump(Assembler* as, uint8_t cc) {
+    if (cc == 0) {
+        emitByte(as, 0xE9);
+    } else {
+        emitByte(as, 0x0F);
+        emitByte(as, cc);
+    }
+    emit32(as, 0);
+    return as->count - 4;
+}
+
+void patchJump(Assembler* as, int offset, int target) {
+    patch32(as, offset, (uint32_t)(target - (offset + 4)));
+}
+
+void emitJumpTo(Assembler* as, uint8_t cc, int label) {
+    int offset = emitJump(as, cc);
+    if (as->patchCapacity < as->patchCount + 1) {
+        as->patchCapacity = GROW_CAPACITY(as->patchCapacity);
+        as->patchOffsets = realloc(as->patchOffsets, sizeof(int) * as->patchCapacity);
+        as->patchTargets = realloc(as->patchTargets, sizeof(int) * as->patchCapacity);
+        if (as->patchOffsets == NULL || as->patchTargets == NULL) exit(1);
+    }
+    as->patchOffsets[as->patchCount] = offset;
+    as->patchTargets[as->patchCount] = label;
+    as->patchCount++;
+}
+
+void patchLabels(Assembler* as, const uint32_t* labels) {
+    for (int i = 0; i < as->patchCount; i++) {
+        patchJump(as, as->patchOffsets[i], labels[as->patchTargets[i]]);
+    }
+}
+
+uint8_t* finishAssembler(Assembler* as, size_t* size) {
+    uint8_t* code = mmap(NULL, as->count, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) return NULL;
+    memcpy(code, as->code, as->count);
+    mprotect(code, as->count, PROT_READ | PROT_EXEC);
+    *size = as->count;
+    return code;
+}
+
+void freeAssembler(Assembler* as) {
+    free(as->code);
+    free(as->patchOffsets);
+    free(as->patchTargets);
+}
+
+#endif
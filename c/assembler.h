@@ -0,0 +1,92 @@
+#ifndef clox_assembler_h
+#define clox_assembler_h
+
+#include "common.h"
+
+#ifdef JIT
+
+// A tiny x86-64 encoder shared by the baseline JIT and the trace compiler.
+// It only knows the handful of instruction forms the two of them emit.
+
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RSP 4
+#define RBP 5
+#define RSI 6
+#define RDI 7
+#define R12 12
+
+// Opcodes of the instructions used by the compilers.
+#define X86_ADD 0x01 // add r/m64, r64
+#define X86_AND 0x21 // and r/m64, r64
+#define X86_CMP 0x39 // cmp r/m64, r64
+#define X86_SUB 0x29 // sub r/m64, r64
+#define X86_STORE 0x89 // mov r/m64, r64
+#define X86_LOAD 0x8B // mov r64, r/m64
+#define X86_LEA 0x8D // lea r64, m
+#define X86_TEST 0x85 // test r/m64, r64
+#define X86_JA 0x87
+#define X86_JB 0x82
+#define X86_JAE 0x83
+#define X86_JBE 0x86
+#define X86_JE 0x84
+#define X86_JNE 0x85
+#define X86_JP 0x8A
+#define SSE_ADD 0x58
+#define SSE_MUL 0x59
+#define SSE_SUB 0x5C
+#define SSE_DIV 0x5E
+
+typedef struct {
+    uint8_t* code;
+    int count;
+    int capacity;
+    int exit; // Offset of the stub that returns to the caller.
+    // rel32 fields of jumps to labels that are only known at the end, see
+    // emitJumpTo() and patchLabels().
+    int* patchOffsets;
+    int* patchTargets;
+    int patchCount;
+    int patchCapacity;
+} Assembler;
+
+void emitByte(Assembler* as, uint8_t byte);
+void emitBytes(Assembler* as, int count, const uint8_t* bytes);
+void emit32(Assembler* as, uint32_t value);
+void emit64(Assembler* as, uint64_t value);
+// mov reg, imm64
+void emitMoveImmediate(Assembler* as, int reg, uint64_t value);
+// op rm, reg for the register forms of add, and, cmp, mov and test.
+void emitRegisters(Assembler* as, uint8_t op, int rm, int reg);
+// op reg, [base + disp] or op [base + disp], reg, depending on op. Also
+// lea reg, [base + disp].
+void emitMemory(Assembler* as, uint8_t op, int reg, int base, int32_t disp);
+// movq xmm, reg
+void emitToXmm(Assembler* as, int xmm, int reg);
+// movq reg, xmm
+void emitFromXmm(Assembler* as, int reg, int xmm);
+// Scalar double op xmm0, xmm1.
+void emitSse(Assembler* as, uint8_t op);
+// Scalar double op dst, src on any two of xmm0-xmm15. op 0x10 is movsd,
+// 0x2E with prefix 0x66 is ucomisd.
+void emitSseRegisters(Assembler* as, uint8_t prefix, uint8_t op, int dst, int src);
+// Emits a jmp (cc 0) or jcc with a rel32 operand and returns the operand's
+// offset for patching.
+int emitJump(Assembler* as, uint8_t cc);
+// Points the jump at 'offset' to native offset 'target'.
+void patchJump(Assembler* as, int offset, int target);
+// A jump to a label, resolved by patchLabels(). What labels mean is up to
+// the compiler, the JIT uses bytecode offsets.
+void emitJumpTo(Assembler* as, uint8_t cc, int label);
+// Points every emitJumpTo() jump at native offset labels[label].
+void patchLabels(Assembler* as, const uint32_t* labels);
+// Copies the code into a fresh executable mapping of 'size' bytes. Returns
+// NULL if the mapping failed.
+uint8_t* finishAssembler(Assembler* as, size_t* size);
+void freeAssembler(Assembler* as);
+
+#endif
+
+#endif
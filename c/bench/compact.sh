@@ -0,0 +1,19 @@
+#!/bin/sh
+# Compactions, heap fragmentation and time without and with the compacting
+# collector.
+set -e
+CC=${CC:-cc}
+OUT=${TMPDIR:-/tmp}
+
+$CC -O2 -o "$OUT/clox_a" *.c -lm
+$CC -O2 -DCOMPACTING_GC -o "$OUT/clox_b" *.c -lm
+
+printf "%-43s%s\n" "" "compactions, fragmentation, seconds"
+for script in bench/fragment.lox; do
+    for build in a b; do
+        if [ $build = a ]; then name="(default)"; else name="-DCOMPACTING_GC"; fi
+        printf "%-24s %-18s" "$script" "$name"
+        "$OUT/clox_$build" "$script" | tail -n 3 | tr '\n' ' '
+        printf "\n"
+    done
+done
@@ -0,0 +1,30 @@
+#!/bin/sh
+# Builds clox twice with different compiler flags and times benchmarks on both.
+# Usage: bench/compare.sh "<flags A>" "<flags B>" script.lox...
+# Run from the c/ directory. Set RUNS to change the number of runs per script.
+set -e
+
+FLAGS_A=$1
+FLAGS_B=$2
+shift 2
+
+RUNS=${RUNS:-3}
+CC=${CC:-cc}
+OUT=${TMPDIR:-/tmp}
+
+$CC -O2 $FLAGS_A -o "$OUT/clox_a" *.c
+$CC -O2 $FLAGS_B -o "$OUT/clox_b" *.c
+
+for script in "$@"; do
+    for build in a b; do
+        if [ $build = a ]; then flags=$FLAGS_A; else flags=$FLAGS_B; fi
+        printf "%-24s %-20s" "$script" "${flags:-(default)}"
+        i=0
+        while [ $i -lt "$RUNS" ]; do
+            # The last line a benchmark prints is its elapsed time in seconds.
+            printf " %s" "$("$OUT/clox_$build" "$script" | tail -n 1)"
+            i=$((i + 1))
+        done
+        printf "\n"
+    done
+done
@@ -0,0 +1,19 @@
+#!/bin/sh
+# Longest pause, mutator utilization and time with the background marker off
+# and on.
+set -e
+CC=${CC:-cc}
+OUT=${TMPDIR:-/tmp}
+
+$CC -O2 -o "$OUT/clox_a" *.c -lm
+$CC -O2 -DCONCURRENT_GC -pthread -o "$OUT/clox_b" *.c -lm
+
+printf "%-43s%s\n" "" "max pause, mutator utilization, seconds"
+for script in bench/gc_pause.lox bench/binary_trees.lox; do
+    for build in a b; do
+        if [ $build = a ]; then name="(default)"; else name="-DCONCURRENT_GC"; fi
+        printf "%-24s %-18s" "$script" "$name"
+        "$OUT/clox_$build" "$script" | tail -n 3 | tr '\n' ' '
+        printf "\n"
+    done
+done
@@ -0,0 +1,4 @@
+#!/bin/sh
+# Compares computed-goto dispatch against the plain switch in run().
+exec sh bench/compare.sh "" "-DNO_COMPUTED_GOTO" \
+    bench/fib.lox bench/loop.lox bench/method_call.lox
@@ -0,0 +1,4 @@
+#!/bin/sh
+# Compares incremental full collections against stop-the-world ones.
+exec sh bench/compare.sh "" "-DNO_INCREMENTAL_GC" \
+    bench/gc_pause.lox bench/binary_trees.lox
@@ -0,0 +1,3 @@
+#!/bin/sh
+# Compares hashing long strings in SSE2 registers against a lane at a time.
+exec sh bench/compare.sh "" "-DNO_SIMD_HASH" bench/hashing.lox
@@ -0,0 +1,4 @@
+#!/bin/sh
+# Compares the baseline JIT against the interpreter alone.
+exec sh bench/compare.sh "" "-DNO_JIT" \
+    bench/fib.lox bench/method_call.lox bench/calls.lox
@@ -0,0 +1,19 @@
+#!/bin/sh
+# Longest pause and time of stop-the-world full collections marked by one
+# thread and by one per core.
+set -e
+CC=${CC:-cc}
+OUT=${TMPDIR:-/tmp}
+
+$CC -O2 -DNO_INCREMENTAL_GC -DNO_PARALLEL_MARK -o "$OUT/clox_a" *.c -lm
+$CC -O2 -DNO_INCREMENTAL_GC -pthread -o "$OUT/clox_b" *.c -lm
+
+printf "%-45s%s\n" "" "max pause, mutator utilization, seconds"
+for script in bench/gc_pause.lox bench/binary_trees.lox; do
+    for build in a b; do
+        if [ $build = a ]; then name="-DNO_PARALLEL_MARK"; else name="(default)"; fi
+        printf "%-24s %-20s" "$script" "$name"
+        "$OUT/clox_$build" "$script" | tail -n 3 | tr '\n' ' '
+        printf "\n"
+    done
+done
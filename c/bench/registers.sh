@@ -0,0 +1,4 @@
+#!/bin/sh
+# Compares register instructions for local arithmetic against pure stack code.
+exec sh bench/compare.sh "" "-DNO_REGISTER_OPS" \
+    bench/loop.lox bench/numeric.lox bench/fib.lox
@@ -0,0 +1,3 @@
+#!/bin/sh
+# Compares matching hash table control bytes with SSE2 against eight at a time in plain words.
+exec sh bench/compare.sh "" "-DNO_SIMD_TABLE" bench/tables.lox
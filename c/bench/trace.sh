@@ -0,0 +1,4 @@
+#!/bin/sh
+# Compares traced loops against the interpreter with the baseline JIT only.
+exec sh bench/compare.sh "" "-DNO_TRACE_JIT" \
+    bench/loop.lox bench/numeric.lox bench/globals.lox bench/nested.lox
@@ -0,0 +1,4 @@
+#!/bin/sh
+# Compares the NaN-boxed Value layout against the tagged union one.
+exec sh bench/compare.sh "" "-DNO_NAN_BOXING" \
+    bench/numeric.lox bench/constants.lox bench/globals.lox
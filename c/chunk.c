@@ -14,6 +14,12 @@ void initChunk(Chunk* chunk) {
     chunk->lineCount = 0;
     chunk->lineCapacity = 0;
     chunk->lines = NULL;
+    chunk->cacheCount = 0;
+    chunk->cacheCapacity = 0;
+    chunk->caches = NULL;
+    chunk->loopCount = 0;
+    chunk->loopCapacity = 0;
+    chunk->loops = NULL;
     // same as &(chunk->constants), hence we get the constants array and dereference to get the pointer to the array.
     initValueArray(&chunk->constants);
 }
@@ -22,6 +28,9 @@ void freeChunk(Chunk* chunk) {
     // free memory
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
     FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+    FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
+    FREE_ARRAY(LoopInfo, chunk->loops, chunk->loopCapacity);
+    freeValueArray(&chunk->constants);
     // initialize to 0, sets chunk to well-defined empty state.
     initChunk(chunk);
 }
@@ -62,6 +71,34 @@ int addConstant(Chunk* chunk, Value value) {
     return chunk->constants.count - 1;
 }
 
+int addInlineCache(Chunk* chunk) {
+    if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+        int oldCapacity = chunk->cacheCapacity;
+        chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, oldCapacity, chunk->cacheCapacity);
+    }
+
+    InlineCache* cache = &chunk->caches[chunk->cacheCount];
+    cache->count = 0;
+    cache->megamorphic = false;
+    PUBLISH(chunk->cacheCount, chunk->cacheCount + 1);
+    return chunk->cacheCount - 1;
+}
+
+int addLoop(Chunk* chunk) {
+    if (chunk->loopCapacity < chunk->loopCount + 1) {
+        int oldCapacity = chunk->loopCapacity;
+        chunk->loopCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->loops = GROW_ARRAY(LoopInfo, chunk->loops, oldCapacity, chunk->loopCapacity);
+    }
+
+    LoopInfo* loop = &chunk->loops[chunk->loopCount];
+    loop->hotness = 0;
+    loop->failures = 0;
+    loop->trace = NULL;
+    return chunk->loopCount++;
+}
+
 // int: instruction - index of the instruction
 int getLine(Chunk* chunk, int instruction) {
     int start = 0;
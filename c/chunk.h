@@ -23,25 +23,85 @@ typedef enum {
     OP_PRINT,
     OP_JUMP_IF_FALSE,
     OP_JUMP, // followed by 2 bytes that specify a 16bit increment to IP.
-    OP_LOOP, // followed by 2 bytes that specify a 16bit decrement to IP.
-    OP_DEFINE_GLOBAL,
-    OP_GET_GLOBAL,
-    OP_SET_GLOBAL,
+    OP_LOOP, // 2 byte decrement to IP, then a 2 byte loop index.
+    OP_DEFINE_GLOBAL, // followed by a 2 byte global slot index.
+    OP_GET_GLOBAL, // followed by a 2 byte global slot index.
+    OP_SET_GLOBAL, // followed by a 2 byte global slot index.
     OP_GET_UPVALUE,
     OP_SET_UPVALUE,
-    OP_GET_PROPERTY,
-    OP_SET_PROPERTY,
+    OP_GET_PROPERTY, // 3 operands: name constant, 2 byte inline cache index.
+    OP_SET_PROPERTY, // 3 operands: name constant, 2 byte inline cache index.
     OP_GET_LOCAL,
     OP_SET_LOCAL,
     OP_CALL,
-    OP_INVOKE, // 2 operands: index of property name in const table, number of arguments. combines GET and CALL.
+    OP_INVOKE, // 4 operands: index of property name in const table, number of arguments, 2 byte inline cache index. combines GET and CALL.
     OP_CLOSURE, // For each upvalue, there are 2 1-byte operands,, 1st byte is 'isLocal', 2nd is index 
     OP_CLOSE_UPVALUE,
     OP_RETURN,
     OP_CLASS,
     OP_METHOD,
+    // Superinstructions, emitted by the compiler's peephole for common sequences.
+    OP_GET_LOCAL_GET_LOCAL, // 2 operands: both local slots.
+    OP_ADD_LOCAL_CONST, // 2 operands: local slot, constant index. Pushes local + constant.
+    OP_LESS_JUMP_IF_FALSE, // OP_LESS followed by OP_JUMP_IF_FALSE, 2 byte offset.
+    OP_SET_LOCAL_POP, // 1 operand: local slot. Pops the value into the slot.
+    // Quickened forms. The VM rewrites a generic instruction into one of these
+    // in place once it has seen its operand types, and back on a guard failure.
+    // Operands are the same as the generic instruction's.
+    OP_ADD_NUM,
+    OP_ADD_STR,
+    OP_EQUAL_NUM,
+    OP_EQUAL_STR,
+    OP_GET_PROPERTY_FIELD, // Monomorphic field load through the cache's only entry.
+    OP_CALL_CLOSURE,
+    OP_CALL_NATIVE,
+    OP_CALL_CLASS,
+    // Register instructions. Registers are frame slots, the first operand is
+    // the destination. R operands are slots, K operands constant indices.
+    // The three forms of each arithmetic op must stay in RR, RK, KR order.
+    OP_MOVE, // dst, src
+    OP_LOAD_CONSTANT, // dst, constant
+    OP_ADD_RR,
+    OP_ADD_RK,
+    OP_ADD_KR,
+    OP_SUBTRACT_RR,
+    OP_SUBTRACT_RK,
+    OP_SUBTRACT_KR,
+    OP_MULTIPLY_RR,
+    OP_MULTIPLY_RK,
+    OP_MULTIPLY_KR,
+    OP_DIVIDE_RR,
+    OP_DIVIDE_RK,
+    OP_DIVIDE_KR,
+    OP_COUNT, // Number of opcodes, not an instruction.
 } OpCode;
 
+// How many receiver shapes a property access remembers before it gives up.
+#define INLINE_CACHE_ENTRIES 4
+
+typedef struct {
+    struct ObjShape* shape; // Receiver shape this entry applies to.
+    int slot; // Field slot, or -1 if the name resolved to a method.
+    Value method; // Closure found on the class when slot is -1.
+    struct ObjShape* transition; // Shape after a store that adds the field, NULL otherwise.
+} CacheEntry;
+
+// Per-instruction cache for property gets, sets and invokes.
+// Monomorphic with one entry, polymorphic up to INLINE_CACHE_ENTRIES,
+// megamorphic sites stop caching and always take the slow path.
+typedef struct {
+    int count;
+    bool megamorphic;
+    CacheEntry entries[INLINE_CACHE_ENTRIES];
+} InlineCache;
+
+// Per-loop state for the tracing JIT, indexed by the loop operand of OP_LOOP.
+typedef struct {
+    int hotness; // Back edges taken by the interpreter.
+    int failures; // Recordings that had to be aborted.
+    struct Trace* trace; // Compiled trace, NULL until the loop is traced.
+} LoopInfo;
+
 typedef struct {
     int offset; // byte offset of the first instruction on the line
     int line; // line number
@@ -57,6 +117,12 @@ typedef struct {
     int lineCount;
     int lineCapacity;
     LineStart* lines; 
+    int cacheCount;
+    int cacheCapacity;
+    InlineCache* caches; // Indexed by the cache operand of property instructions.
+    int loopCount;
+    int loopCapacity;
+    LoopInfo* loops; // Indexed by the loop operand of OP_LOOP.
 } Chunk;
 
 void initChunk(Chunk* chunk);
@@ -64,6 +130,8 @@ void freeChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
 int addConstant(Chunk* chunk, Value value);
 int getLine(Chunk* chunk, int instruction);
+int addInlineCache(Chunk* chunk);
+int addLoop(Chunk* chunk);
 // int writeConstant(Chunk* chunk, Value value, int line);
 
 #endif
\ No newline at end of file
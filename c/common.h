@@ -5,12 +5,88 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#define DEBUG_PRINT_CODE
+// Values are NaN-boxed into a single 64-bit word.
+// Build with -DNO_NAN_BOXING to use the 16 byte tagged union instead.
+#ifndef NO_NAN_BOXING
+#define NAN_BOXING
+#endif
+
+// Dispatch with computed gotos where the compiler supports labels as values.
+// Build with -DNO_COMPUTED_GOTO to force the plain switch.
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// The compiler rewrites simple assignments to locals into three-address
+// register instructions over frame slots. Build with -DNO_REGISTER_OPS to
+// emit pure stack code.
+#ifndef NO_REGISTER_OPS
+#define REGISTER_OPS
+#endif
+
+// Hot functions are compiled to x86-64 machine code. The native code moves
+// values around as single words, so it needs NaN boxing.
+// Build with -DNO_JIT to always interpret.
+#if defined(__x86_64__) && defined(__linux__) && defined(NAN_BOXING) && \
+    !defined(NO_JIT)
+#define JIT
+#endif
+
+// Hot loops of interpreted code are recorded as linear traces and compiled
+// with numbers kept in xmm registers. Build with -DNO_TRACE_JIT to only
+// compile whole functions.
+#if defined(JIT) && !defined(NO_TRACE_JIT)
+#define TRACE_JIT
+#endif
+
+// Full collections mark and sweep in slices interleaved with the program
+// instead of stopping it for the whole heap. Build with -DNO_INCREMENTAL_GC
+// to collect in one go.
+#ifndef NO_INCREMENTAL_GC
+#define INCREMENTAL_GC
+#endif
+
+// Full collections are marked by a background thread while the program keeps
+// running. Off by default, build with -DCONCURRENT_GC (and -pthread) to turn
+// it on. The marker reads values as single words, so it needs NaN boxing,
+// and it sweeps with the incremental collector.
+#if defined(CONCURRENT_GC) && \
+    (!defined(NAN_BOXING) || !defined(INCREMENTAL_GC))
+#undef CONCURRENT_GC
+#endif
+
+// Full collections that leave the heap fragmented are followed by moving
+// the objects out of sparsely used pages. Off by default, build with
+// -DCOMPACTING_GC to turn it on.
+
+// Big marks are spread over worker threads that steal gray objects from each
+// other. Needs pthreads, build with -DNO_PARALLEL_MARK to mark on one thread.
+#if defined(__GNUC__) && defined(__linux__) && !defined(NO_PARALLEL_MARK)
+#define PARALLEL_MARK
+#endif
+
+// Hash table probes match a group of control bytes with one SSE2 compare.
+// Build with -DNO_SIMD_TABLE to compare them in 64-bit words instead.
+#if defined(__SSE2__) && !defined(NO_SIMD_TABLE)
+#define SIMD_TABLE
+#endif
+
+// Long strings are hashed in SSE2 registers. Build with -DNO_SIMD_HASH to
+// compute the same hash a lane at a time.
+#if defined(__SSE2__) && !defined(NO_SIMD_HASH)
+#define SIMD_HASH
+#endif
+
+// #define DEBUG_PRINT_CODE
 
 // #define DEBUG_STRESS_GC
 // #define DEBUG_LOG_GC
 
-#define DEBUG_TRACE_EXECUTION
+// #define DEBUG_TRACE_EXECUTION
+
+// Counts executed opcode pairs and triples, printed when the VM shuts down.
+// Used to pick candidates for superinstructions.
+// #define DEBUG_PROFILE_OPCODES
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
@@ -0,0 +1,179 @@
+#include <string.h>
+
+#include "compact.h"
+#include "memory.h"
+#include "vm.h"
+
+#ifdef COMPACTING_GC
+
+static size_t copySize(void* copy) {
+    return objectSize((Obj*)copy);
+}
+
+// Copies the object out of its page. Copies come out marked, everything
+// is old after a compaction.
+static void evacuate(void* object) {
+    size_t size = objectSize(object);
+    void* copy = heapAllocateObject(&vm.heap, size);
+    memcpy(copy, object, size);
+    heapMark(copy, false);
+
+    // Fix the pointers into the object itself.
+    switch ((ObjType)((Obj*)copy)->type) {
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*)copy;
+            if (instance->slots == ((ObjInstance*)object)->inlineSlots) {
+                instance->slots = instance->inlineSlots;
+            }
+            break;
+        }
+        case OBJ_UPVALUE: {
+            ObjUpvalue* upvalue = (ObjUpvalue*)copy;
+            if (upvalue->location == &((ObjUpvalue*)object)->closed) {
+                upvalue->location = &upvalue->closed;
+            }
+            break;
+        }
+        default:
+            break;
+    }
+    heapForward(object, copy);
+}
+
+static Obj* forward(Obj* object) {
+    if (object == NULL) return NULL;
+    Obj* copy = heapForwardee(object);
+    return copy != NULL ? copy : object;
+}
+
+#define FORWARD(field) ((field) = (void*)forward((Obj*)(field)))
+
+static void forwardValue(Value* value) {
+    if (IS_OBJ(*value)) *value = OBJ_VAL(forward(AS_OBJ(*value)));
+}
+
+static void forwardArray(ValueArray* array) {
+    for (int i = 0; i < array->count; i++) {
+        forwardValue(&array->values[i]);
+    }
+}
+
+// Keys hash by the string's contents, so entries stay in their buckets.
+static void forwardTable(Table* table) {
+    for (int i = 0; i < table->capacity; i++) {
+        Entry* entry = &table->entries[i];
+        FORWARD(entry->key);
+        forwardValue(&entry->value);
+    }
+}
+
+// Points the object's references at the copies, everything blackenObject()
+// traces.
+static void forwardFields(void* pointer) {
+    Obj* object = (Obj*)pointer;
+    switch ((ObjType)object->type) {
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod* bound = (ObjBoundMethod*)object;
+            forwardValue(&bound->receiver);
+            FORWARD(bound->method);
+            break;
+        }
+        case OBJ_CLASS: {
+            ObjClass* klass = (ObjClass*)object;
+            FORWARD(klass->name);
+            forwardTable(&klass->methods);
+            FORWARD(klass->rootShape);
+            break;
+        }
+        case OBJ_CLOSURE: {
+            ObjClosure* closure = (ObjClosure*)object;
+            FORWARD(closure->function);
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                FORWARD(closure->upvalues[i]);
+            }
+            break;
+        }
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*)object;
+            FORWARD(function->name);
+            forwardArray(&function->chunk.constants);
+            // Native code reads the caches through the chunk, which stays
+            // where it is.
+            for (int i = 0; i < function->chunk.cacheCount; i++) {
+                InlineCache* cache = &function->chunk.caches[i];
+                for (int j = 0; j < cache->count; j++) {
+                    FORWARD(cache->entries[j].shape);
+                    FORWARD(cache->entries[j].transition);
+                    forwardValue(&cache->entries[j].method);
+                }
+            }
+            break;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*)object;
+            FORWARD(instance->klass);
+            FORWARD(instance->shape);
+            if (instance->shape != NULL) {
+                for (int i = 0; i < instance->shape->slotCount; i++) {
+                    forwardValue(&instance->slots[i]);
+                }
+            }
+            if (instance->dictionary != NULL) forwardTable(instance->dictionary);
+            break;
+        }
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            FORWARD(shape->parent);
+            FORWARD(shape->name);
+            forwardTable(&shape->slots);
+            forwardTable(&shape->transitions);
+            break;
+        }
+        case OBJ_UPVALUE: {
+            ObjUpvalue* upvalue = (ObjUpvalue*)object;
+            forwardValue(&upvalue->closed);
+            FORWARD(upvalue->next);
+            break;
+        }
+        case OBJ_STRING:
+            if (((ObjString*)object)->form == STRING_ROPE) {
+                ObjRope* rope = (ObjRope*)object;
+                FORWARD(rope->left);
+                FORWARD(rope->right);
+            } else if (((ObjString*)object)->form == STRING_SLICE) {
+                FORWARD(((ObjSlice*)object)->parent);
+            }
+            break;
+        case OBJ_NATIVE:
+            break;
+    }
+}
+
+// Everything markRoots() marks.
+static void forwardRoots() {
+    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+        forwardValue(slot);
+    }
+    for (int i = 0; i < vm.frameCount; i++) {
+        FORWARD(vm.frames[i].closure);
+    }
+    FORWARD(vm.openUpvalues);
+
+    forwardTable(&vm.globalSlots);
+    forwardArray(&vm.globalValues);
+    forwardArray(&vm.globalNames);
+    forwardTable(&vm.strings);
+    FORWARD(vm.initString);
+}
+
+void compactHeap(double occupancy) {
+    if (heapStartEvacuation(&vm.heap, occupancy) == 0) return;
+
+    heapWalkEvacuating(&vm.heap, evacuate);
+    forwardRoots();
+    heapWalkObjects(&vm.heap, forwardFields);
+    heapEndEvacuation(&vm.heap, copySize);
+    vm.compactions++;
+}
+
+#endif
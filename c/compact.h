@@ -0,0 +1,24 @@
+#ifndef clox_compact_h
+#define clox_compact_h
+
+#include "common.h"
+
+#ifdef COMPACTING_GC
+
+// Fragmentation of the heap after a full collection that asks for
+// compaction, see heapFragmentation().
+#define GC_COMPACT_THRESHOLD 0.5
+// Smaller heaps aren't worth moving.
+#define GC_COMPACT_MIN_HEAP (4 * 1024 * 1024)
+// Object pages with at most this share of their cells in use get emptied.
+#define GC_EVACUATE_OCCUPANCY 0.5
+
+// Moves the objects out of sparsely used pages and points every reference
+// at the copies. Every live object has to be marked and nothing may be
+// left to sweep. Only call it where C code holds no object pointers
+// outside the roots, see GC_SAFEPOINT().
+void compactHeap(double occupancy);
+
+#endif
+
+#endif
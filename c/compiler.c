@@ -68,6 +68,11 @@ typedef struct Compiler {
     int localCount;
     Upvalue upvalues[UINT8_COUNT];
     int scopeDepth;
+
+    // Offsets of the last two instructions emitted, -1 if unknown. The
+    // peephole in emitOp() fuses them with the next instruction.
+    int lastInstruction;
+    int prevInstruction;
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -145,24 +150,103 @@ static void emitByte(uint8_t byte) {
     writeChunk(currentChunk(), byte, parser.previous.line);
 }
 
-static void emitBytes(uint8_t byte1, uint8_t byte2) {
-    emitByte(byte1);
-    emitByte(byte2);
+// Drops all code from offset on so the instructions there can be re-emitted.
+static void rewindChunk(int offset) {
+    Chunk* chunk = currentChunk();
+    chunk->count = offset;
+    while (chunk->lineCount > 0 && 
+           chunk->lines[chunk->lineCount - 1].offset >= offset) {
+        chunk->lineCount--;
+    }
+}
+
+// Tries to merge op with the instructions right before it into a
+// superinstruction. Returns true if op was absorbed and must not be emitted.
+// Any operands of op are still emitted by the caller as usual.
+static bool fuseInstruction(uint8_t op) {
+    Chunk* chunk = currentChunk();
+    int last = current->lastInstruction;
+    int prev = current->prevInstruction;
+    if (last == -1) return false;
+
+    switch (op) {
+        case OP_GET_LOCAL:
+            // GET_LOCAL a, GET_LOCAL b -> GET_LOCAL_GET_LOCAL a b
+            if (chunk->code[last] != OP_GET_LOCAL || last != chunk->count - 2) return false;
+            chunk->code[last] = OP_GET_LOCAL_GET_LOCAL;
+            return true;
+        case OP_ADD: {
+            // GET_LOCAL a, CONSTANT k, ADD -> ADD_LOCAL_CONST a k
+            if (prev == -1 || chunk->code[last] != OP_CONSTANT || 
+                last != chunk->count - 2 || chunk->code[prev] != OP_GET_LOCAL ||
+                prev != last - 2) return false;
+            uint8_t constant = chunk->code[last + 1];
+            chunk->code[prev] = OP_ADD_LOCAL_CONST;
+            chunk->code[prev + 2] = constant;
+            rewindChunk(prev + 3);
+            current->lastInstruction = prev;
+            current->prevInstruction = -1;
+            return true;
+        }
+        case OP_JUMP_IF_FALSE:
+            // LESS, JUMP_IF_FALSE offset -> LESS_JUMP_IF_FALSE offset
+            if (chunk->code[last] != OP_LESS || last != chunk->count - 1) return false;
+            chunk->code[last] = OP_LESS_JUMP_IF_FALSE;
+            return true;
+        case OP_POP:
+            // SET_LOCAL a, POP -> SET_LOCAL_POP a
+            if (chunk->code[last] != OP_SET_LOCAL || last != chunk->count - 2) return false;
+            chunk->code[last] = OP_SET_LOCAL_POP;
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Emits the opcode of an instruction, its operands follow with emitByte().
+static void emitOp(uint8_t op) {
+    if (fuseInstruction(op)) return;
+    current->prevInstruction = current->lastInstruction;
+    current->lastInstruction = currentChunk()->count;
+    emitByte(op);
+}
+
+static void emitBytes(uint8_t op, uint8_t operand) {
+    emitOp(op);
+    emitByte(operand);
+}
+
+// Returns the current offset for use as a jump destination. Instructions
+// after it must never be fused with the ones before it.
+static int jumpTarget() {
+    current->lastInstruction = -1;
+    current->prevInstruction = -1;
+    return currentChunk()->count;
+}
+
+// 2 byte operands are stored big-endian, like jump offsets.
+static void emitShort(uint16_t value) {
+    emitByte((value >> 8) & 0xff);
+    emitByte(value & 0xff);
 }
 
 static void emitLoop(int loopStart) {
-    emitByte(OP_LOOP);
+    emitOp(OP_LOOP);
 
-    // + 2 for the two operands specifying the offset after OP_LOOP.
-    int offset = currentChunk()->count - loopStart + 2;
+    // + 4 for the offset and loop index operands after OP_LOOP.
+    int offset = currentChunk()->count - loopStart + 4;
     if (offset > UINT16_MAX) error("Loop body too large.");
 
     emitByte((offset >> 8) & 0xff);
     emitByte(offset & 0xff);
+
+    int loop = addLoop(currentChunk());
+    if (loop > UINT16_MAX) error("Too many loops in one chunk.");
+    emitShort((uint16_t)loop);
 }
 
 static int emitJump(uint8_t instruction) {
-    emitByte(instruction);
+    emitOp(instruction);
     emitByte(0xff);
     emitByte(0xff);
     return currentChunk()->count - 2;
@@ -175,13 +259,14 @@ static void emitReturn() {
         // slot 0 contains the instance.
         emitBytes(OP_GET_LOCAL, 0);
     } else {
-        emitByte(OP_NIL);
+        emitOp(OP_NIL);
     }
-    emitByte(OP_RETURN);
+    emitOp(OP_RETURN);
 }
 
 static uint8_t makeConstant(Value value) {
   int constant = addConstant(currentChunk(), value);
+  gcWriteBarrier((Obj*)current->function, value);
   if (constant > UINT8_MAX) {
     error("Too many constants in one chunk.");
     return 0;
@@ -190,13 +275,22 @@ static uint8_t makeConstant(Value value) {
   return (uint8_t)constant;
 }
 
+// Reserves an inline cache slot and emits its index as a 2 byte operand.
+static void emitCache() {
+    int cache = addInlineCache(currentChunk());
+    if (cache > UINT16_MAX) {
+        error("Too many property accesses in one chunk.");
+    }
+    emitShort((uint16_t)cache);
+}
+
 static void emitConstant(Value value) {
     emitBytes(OP_CONSTANT, makeConstant(value));
 }
 
 static void patchJump(int offset){
     // -2 to adjust for the bytecode for the jump offset itself. 
-    int jump = currentChunk()->count - offset - 2;
+    int jump = jumpTarget() - offset - 2;
 
     if (jump > UINT16_MAX) {
         error("Too much code to jump over.");
@@ -213,10 +307,15 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
     compiler->type = type;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
+    compiler->lastInstruction = -1;
+    compiler->prevInstruction = -1;
     compiler->function = newFunction();
     current = compiler;
     if (type != TYPE_SCRIPT) {
-        current->function->name = copyString(parser.previous.start, parser.previous.length);
+        current->function->name = copyHashedString(parser.previous.start,
+                                                   parser.previous.length,
+                                                   parser.previous.hash);
+        gcWriteBarrier((Obj*)current->function, OBJ_VAL(current->function->name));
     }
 
     // Reserving stack slot [0] for VM's internal user.
@@ -232,6 +331,7 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
         local->name.start = "";
         local->name.length = 0;
     }
+    local->name.hash = hashString(local->name.start, local->name.length);
 }
 
 static ObjFunction* endCompiler() {
@@ -259,9 +359,9 @@ static void endScope() {
     while (current->localCount > 0 && 
            current->locals[current->localCount - 1].depth > current->scopeDepth) {
         if (current->locals[current->localCount - 1].isCaptured) {
-            emitByte(OP_CLOSE_UPVALUE); // Hoist variable to the heap.
+            emitOp(OP_CLOSE_UPVALUE); // Hoist variable to the heap.
         } else {
-            emitByte(OP_POP); // Simply pop it.
+            emitOp(OP_POP); // Simply pop it.
         }
         current->localCount--;
         }
@@ -281,6 +381,7 @@ static ParseRule* getRule(TokenType type);
 static void parsePrecedence(Precedence precedence);
 static void synchronize();
 static uint8_t identifierConstant(Token* name);
+static uint16_t globalVariable(Token* name);
 static int resolveLocal(Compiler* compiler, Token* name);
 static int resolveUpvalue(Compiler* compiler, Token* name);
 
@@ -292,23 +393,26 @@ static void binary(bool canAssign) {
   switch (operatorType) {
     case TOKEN_BANG_EQUAL:
         // a != b <-> !(a==b) 
-        emitBytes(OP_EQUAL, OP_NOT); 
+        emitOp(OP_EQUAL);
+        emitOp(OP_NOT); 
         break;
-    case TOKEN_EQUAL_EQUAL:   emitByte(OP_EQUAL); break;
-    case TOKEN_GREATER:       emitByte(OP_GREATER); break;
+    case TOKEN_EQUAL_EQUAL:   emitOp(OP_EQUAL); break;
+    case TOKEN_GREATER:       emitOp(OP_GREATER); break;
     case TOKEN_GREATER_EQUAL:
         // a >= b <-> !(a < b)   
-        emitBytes(OP_LESS, OP_NOT);
+        emitOp(OP_LESS);
+        emitOp(OP_NOT);
         break;
-    case TOKEN_LESS:          emitByte(OP_LESS); break;
+    case TOKEN_LESS:          emitOp(OP_LESS); break;
     case TOKEN_LESS_EQUAL:   
         // a <= b <-> !(a>b)
-        emitBytes(OP_GREATER, OP_NOT); 
+        emitOp(OP_GREATER);
+        emitOp(OP_NOT); 
         break;
-    case TOKEN_PLUS:          emitByte(OP_ADD); break;
-    case TOKEN_MINUS:         emitByte(OP_SUBTRACT); break;
-    case TOKEN_STAR:          emitByte(OP_MULTIPLY); break;
-    case TOKEN_SLASH:         emitByte(OP_DIVIDE); break;
+    case TOKEN_PLUS:          emitOp(OP_ADD); break;
+    case TOKEN_MINUS:         emitOp(OP_SUBTRACT); break;
+    case TOKEN_STAR:          emitOp(OP_MULTIPLY); break;
+    case TOKEN_SLASH:         emitOp(OP_DIVIDE); break;
     default: return; // Unreachable.
   }
 }
@@ -325,22 +429,25 @@ static void dot(bool canAssign) {
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
         emitBytes(OP_SET_PROPERTY, name);
+        emitCache();
 
     // method call
     } else if (match(TOKEN_LEFT_PAREN)) {
         uint8_t argCount = argumentList();
         emitBytes(OP_INVOKE, name);
         emitByte(argCount);
+        emitCache();
     } else {
         emitBytes(OP_GET_PROPERTY, name);
+        emitCache();
     }
 }
 
 static void literal(bool canAssign) {
     switch (parser.previous.type) {
-        case TOKEN_FALSE: emitByte(OP_FALSE); break;
-        case TOKEN_TRUE: emitByte(OP_TRUE); break;
-        case TOKEN_NIL: emitByte(OP_NIL); break;
+        case TOKEN_FALSE: emitOp(OP_FALSE); break;
+        case TOKEN_TRUE: emitOp(OP_TRUE); break;
+        case TOKEN_NIL: emitOp(OP_NIL); break;
         default: return; // Unreachable.
     }
 }
@@ -373,16 +480,23 @@ static void namedVariable(Token name, bool canAssign) {
         getOp = OP_GET_UPVALUE;
         setOp = OP_SET_UPVALUE;
     } else {
-        arg = identifierConstant(&name);
+        arg = globalVariable(&name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
     }
 
+    uint8_t op = getOp;
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
-        emitBytes(setOp, (uint8_t)arg);
+        op = setOp;
+    }
+
+    // Globals are indexed with 2 bytes, locals and upvalues with one.
+    emitOp(op);
+    if (getOp == OP_GET_GLOBAL) {
+        emitShort((uint16_t)arg);
     } else {
-        emitBytes(getOp, (uint8_t)arg);
+        emitByte((uint8_t)arg);
     }
 }
 
@@ -408,8 +522,8 @@ static void unary(bool canAssign) {
 
     // Emit theo operator instruction.
     switch (operatorType) {
-        case TOKEN_MINUS: emitByte(OP_NEGATE); break;
-        case TOKEN_BANG: emitByte(OP_NOT); break;
+        case TOKEN_MINUS: emitOp(OP_NEGATE); break;
+        case TOKEN_BANG: emitOp(OP_NOT); break;
         default: return; // This should be unreachable.
     }
 }
@@ -492,12 +606,25 @@ static void parsePrecedence(Precedence precedence) {
 }
 
 static uint8_t identifierConstant(Token* name) {
-    return makeConstant(OBJ_VAL(copyString(name->start, 
-                                           name->length)));
+    return makeConstant(OBJ_VAL(copyHashedString(name->start, name->length,
+                                                 name->hash)));
+}
+
+// Resolves a global variable to its slot in the VM's global array.
+// Variables that aren't defined yet get a slot too, so functions can refer
+// to globals declared after them.
+static uint16_t globalVariable(Token* name) {
+    int slot = globalSlot(copyHashedString(name->start, name->length,
+                                            name->hash));
+    if (slot > UINT16_MAX) {
+        error("Too many global variables.");
+        return 0;
+    }
+    return (uint16_t)slot;
 }
 
 static bool identifiersEqual(Token* a, Token* b) {
-    if (a->length != b->length) return false;
+    if (a->length != b->length || a->hash != b->hash) return false;
     return memcmp(a->start, b->start, a->length) == 0;
 }
 
@@ -588,14 +715,14 @@ static void declareVariable() {
     addLocal(*name);
 }
 
-static uint8_t parseVariable(const char* errorMessage) {
+static uint16_t parseVariable(const char* errorMessage) {
     consume(TOKEN_IDENTIFIER, errorMessage);
 
     declareVariable();
-    // only globals are added to constant table. Locals are looked up by index.
+    // only globals get a global slot. Locals are looked up by stack index.
     if (current->scopeDepth > 0) return 0;
 
-    return identifierConstant(&parser.previous);
+    return globalVariable(&parser.previous);
 }
 
 static void markInitialized() {
@@ -605,13 +732,14 @@ static void markInitialized() {
     current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
+static void defineVariable(uint16_t global) {
     // Nothing to emit for locals. Locals are stored on the stack.
     if (current->scopeDepth > 0) {
         markInitialized();
         return;
     }
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitOp(OP_DEFINE_GLOBAL);
+    emitShort(global);
 }
 
 static uint8_t argumentList() {
@@ -632,7 +760,7 @@ static uint8_t argumentList() {
 static void and_(bool canAssign) {
     int endJump = emitJump(OP_JUMP_IF_FALSE);
 
-    emitByte(OP_POP);
+    emitOp(OP_POP);
     // parse the rest of the 'and' expression.
     parsePrecedence(PREC_AND);
 
@@ -647,7 +775,7 @@ static void or_(bool canAssign) {
     int endJump = emitJump(OP_JUMP);
 
     patchJump(elseJump);
-    emitByte(OP_POP);
+    emitOp(OP_POP);
 
     parsePrecedence(PREC_OR);
     patchJump(endJump);
@@ -683,7 +811,7 @@ static void function(FunctionType type) {
             if (current->function->arity > 255) {
                 errorAtCurrent("Can't have more than 255 parameters.");
             }
-            uint8_t constant = parseVariable("Expected parameter name.");
+            uint16_t constant = parseVariable("Expected parameter name.");
             defineVariable(constant);
         } while (match(TOKEN_COMMA));
     }
@@ -720,9 +848,10 @@ static void classDeclaration() {
     uint8_t nameConstant = identifierConstant(&parser.previous);
     // Declares a variable of the same name.
     declareVariable();
+    uint16_t global = current->scopeDepth > 0 ? 0 : globalVariable(&className);
 
     emitBytes(OP_CLASS, nameConstant);
-    defineVariable(nameConstant);
+    defineVariable(global);
 
     ClassCompiler classCompiler;
     classCompiler.enclosing = currentClass;
@@ -735,7 +864,7 @@ static void classDeclaration() {
         method();
     }
     consume(TOKEN_RIGHT_BRACE, "Expected '}' after class body.");
-    emitByte(OP_POP); // pops class name from stack.
+    emitOp(OP_POP); // pops class name from stack.
 
     // After we finish declaring class, we set the currentClass back to what it was.
     currentClass = currentClass->enclosing;
@@ -743,29 +872,197 @@ static void classDeclaration() {
 
 static void funDeclaration() {
     // parsing function name is tha same as parsing variable name.
-    uint8_t global = parseVariable("Expected a function name.");
+    uint16_t global = parseVariable("Expected a function name.");
     markInitialized(); // To support recursion, we mark the name initialized immediately.
     function(TYPE_FUNCTION);
     defineVariable(global);
 }
 
 static void varDeclaration() {
-    int global = parseVariable("Expect variable name.");
+    uint16_t global = parseVariable("Expect variable name.");
 
     if (match(TOKEN_EQUAL)) {
         expression();
     } else {
-        emitByte(OP_NIL);
+        emitOp(OP_NIL);
     }
     consume(TOKEN_SEMICOLON, "Expected ';' after variable declaration.");
 
     defineVariable(global);
 }
 
+#ifdef REGISTER_OPS
+
+// Longest arithmetic chain registerStatement() will rewrite.
+#define REGISTER_CHAIN_MAX 16
+
+typedef enum {
+    OPERAND_REGISTER,
+    OPERAND_CONSTANT,
+    OPERAND_RESULT, // Already computed into the destination register.
+} OperandKind;
+
+typedef struct {
+    OperandKind kind;
+    uint8_t index;
+} Operand;
+
+typedef struct {
+    uint8_t op; // Stack opcode, or OP_SET_LOCAL_POP for the final store.
+    Operand operand; // Set for pushes, op is 0 then.
+    int line;
+} StackStep;
+
+// Register form of a stack arithmetic op for the given operand kinds. A
+// partial result lives in a register, so it counts as one.
+static uint8_t registerOp(uint8_t op, Operand a, Operand b) {
+    uint8_t base;
+    switch (op) {
+        case OP_ADD: base = OP_ADD_RR; break;
+        case OP_SUBTRACT: base = OP_SUBTRACT_RR; break;
+        case OP_MULTIPLY: base = OP_MULTIPLY_RR; break;
+        default: base = OP_DIVIDE_RR; break;
+    }
+    if (b.kind == OPERAND_CONSTANT) return base + 1;
+    if (a.kind == OPERAND_CONSTANT) return base + 2;
+    return base;
+}
+
+static void emitRegisterOp(uint8_t op, int line, uint8_t a, uint8_t b, 
+                           uint8_t c) {
+    Chunk* chunk = currentChunk();
+    writeChunk(chunk, op, line);
+    writeChunk(chunk, a, line);
+    writeChunk(chunk, b, line);
+    writeChunk(chunk, c, line);
+}
+
+// Recompiles the expression statement starting at 'start' into register
+// instructions when it assigns a local from a left-leaning chain of
+// arithmetic over locals and constants, like 'x = x + 1' or
+// 'z = a * b - c'. Intermediate results go straight into the destination,
+// so anything that would need a temporary stays stack code.
+static void registerStatement(int start) {
+    Chunk* chunk = currentChunk();
+    StackStep steps[REGISTER_CHAIN_MAX * 3];
+    int stepCount = 0;
+
+    // Decode the statement. Every instruction it may contain has fixed
+    // operands, anything else (jumps, calls, ...) rules it out.
+    int offset = start;
+    while (offset < chunk->count) {
+        if (stepCount + 3 > REGISTER_CHAIN_MAX * 3) return;
+        uint8_t* code = &chunk->code[offset];
+        int line = getLine(chunk, offset);
+        switch (code[0]) {
+            case OP_GET_LOCAL:
+                steps[stepCount++] = (StackStep){0, {OPERAND_REGISTER, code[1]}, line};
+                offset += 2;
+                break;
+            case OP_CONSTANT:
+                steps[stepCount++] = (StackStep){0, {OPERAND_CONSTANT, code[1]}, line};
+                offset += 2;
+                break;
+            case OP_GET_LOCAL_GET_LOCAL:
+                steps[stepCount++] = (StackStep){0, {OPERAND_REGISTER, code[1]}, line};
+                steps[stepCount++] = (StackStep){0, {OPERAND_REGISTER, code[2]}, line};
+                offset += 3;
+                break;
+            case OP_ADD_LOCAL_CONST:
+                steps[stepCount++] = (StackStep){0, {OPERAND_REGISTER, code[1]}, line};
+                steps[stepCount++] = (StackStep){0, {OPERAND_CONSTANT, code[2]}, line};
+                steps[stepCount++] = (StackStep){OP_ADD, {0, 0}, line};
+                offset += 3;
+                break;
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+                steps[stepCount++] = (StackStep){code[0], {0, 0}, line};
+                offset += 1;
+                break;
+            case OP_SET_LOCAL_POP:
+                if (offset + 2 != chunk->count) return;
+                steps[stepCount++] = (StackStep){OP_SET_LOCAL_POP, {OPERAND_REGISTER, code[1]}, line};
+                offset += 2;
+                break;
+            default:
+                return;
+        }
+    }
+    if (stepCount == 0 || steps[stepCount - 1].op != OP_SET_LOCAL_POP) return;
+    uint8_t dest = steps[stepCount - 1].operand.index;
+
+    // Run the steps on a stack of operands to check the shape of the chain.
+    Operand stack[REGISTER_CHAIN_MAX * 3];
+    int stackCount = 0;
+    bool computed = false;
+    for (int i = 0; i < stepCount - 1; i++) {
+        StackStep* step = &steps[i];
+        if (step->op == 0) {
+            stack[stackCount++] = step->operand;
+            continue;
+        }
+
+        Operand b = stack[--stackCount];
+        Operand a = stack[stackCount - 1];
+        // Once dest holds a partial result, the left operand must be that
+        // result and nothing may read the old value of dest.
+        if (b.kind == OPERAND_RESULT) return;
+        if (computed && a.kind != OPERAND_RESULT) return;
+        if (computed && b.kind == OPERAND_REGISTER && b.index == dest) return;
+        if (a.kind == OPERAND_CONSTANT && b.kind == OPERAND_CONSTANT) return;
+        stack[stackCount - 1] = (Operand){OPERAND_RESULT, dest};
+        computed = true;
+    }
+    if (stackCount != 1) return;
+
+    // The chain checks out, re-emit it. Arithmetic keeps the lines of the
+    // original operators so runtime errors point at the same place.
+    rewindChunk(start);
+    int line = steps[stepCount - 1].line;
+    Operand result = stack[0];
+    if (result.kind == OPERAND_REGISTER) {
+        writeChunk(chunk, OP_MOVE, line);
+        writeChunk(chunk, dest, line);
+        writeChunk(chunk, result.index, line);
+    } else if (result.kind == OPERAND_CONSTANT) {
+        writeChunk(chunk, OP_LOAD_CONSTANT, line);
+        writeChunk(chunk, dest, line);
+        writeChunk(chunk, result.index, line);
+    } else {
+        stackCount = 0;
+        for (int i = 0; i < stepCount - 1; i++) {
+            StackStep* step = &steps[i];
+            if (step->op == 0) {
+                stack[stackCount++] = step->operand;
+                continue;
+            }
+            Operand b = stack[--stackCount];
+            Operand a = stack[stackCount - 1];
+            emitRegisterOp(registerOp(step->op, a, b), step->line, 
+                           dest, a.index, b.index);
+            stack[stackCount - 1] = (Operand){OPERAND_RESULT, dest};
+        }
+    }
+    current->lastInstruction = -1;
+    current->prevInstruction = -1;
+}
+
+#endif
+
 static void expressionStatement() {
+#ifdef REGISTER_OPS
+    // Keep the peephole from fusing into the previous statement, so the
+    // statement's code starts at 'start'.
+    int start = jumpTarget();
+#endif
     expression();
     consume(TOKEN_SEMICOLON, "Expected ';' after an expression.");
-    emitByte(OP_POP);
+    emitOp(OP_POP);
+#ifdef REGISTER_OPS
+    registerStatement(start);
+#endif
 }
 
 static void ifStatement() {
@@ -774,13 +1071,13 @@ static void ifStatement() {
     consume(TOKEN_RIGHT_PAREN, "Expected ')' after condition.");
 
     int thenJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP); // Manually pop condition for jump-if.
+    emitOp(OP_POP); // Manually pop condition for jump-if.
     statement();
 
     int elseJump = emitJump(OP_JUMP);
 
     patchJump(thenJump);
-    emitByte(OP_POP); // Manually pop condition for jump-if.
+    emitOp(OP_POP); // Manually pop condition for jump-if.
 
     // Might not have an else statement.
     if (match(TOKEN_ELSE)) statement();
@@ -825,7 +1122,7 @@ static void printStatement() {
     // already consumed the 'print' token
     expression();
     consume(TOKEN_SEMICOLON, "Expected ';' after value.");
-    emitByte(OP_PRINT);
+    emitOp(OP_PRINT);
 }
 
 static void returnStatement() {
@@ -842,24 +1139,24 @@ static void returnStatement() {
 
         expression();
         consume(TOKEN_SEMICOLON, "Expected ';' after return value.");
-        emitByte(OP_RETURN);
+        emitOp(OP_RETURN);
     }
 }
 
 static void whileStatement() {
-    int loopStart = currentChunk()->count; // pointer to the start of the loop.
+    int loopStart = jumpTarget(); // pointer to the start of the loop.
 
     consume(TOKEN_LEFT_PAREN, "Expected '(' after 'while'.");
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expected ')' after condition.");
 
     int exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
+    emitOp(OP_POP);
     statement();
     emitLoop(loopStart);
 
     patchJump(exitJump);
-    emitByte(OP_POP);
+    emitOp(OP_POP);
 }
 
 static void forStatement() {
@@ -876,7 +1173,7 @@ static void forStatement() {
     }
 
     // Condition.
-    int loopStart = currentChunk()->count;
+    int loopStart = jumpTarget();
     int exitJump = -1;
     if (!match(TOKEN_SEMICOLON)) {
         expression(); // Condition expression.
@@ -884,7 +1181,7 @@ static void forStatement() {
 
         // Jump out of the loop if the condition is false.
         exitJump = emitJump(OP_JUMP_IF_FALSE);
-        emitByte(OP_POP); // Pops the condition.
+        emitOp(OP_POP); // Pops the condition.
     }
 
     if (!match(TOKEN_RIGHT_PAREN)) {
@@ -892,9 +1189,12 @@ static void forStatement() {
         // but it should only run after the body executes.
         int bodyJump = emitJump(OP_JUMP);
         // Store pointer to the start of the increment code.
-        int incrementStart = currentChunk()->count;
+        int incrementStart = jumpTarget();
         expression();
-        emitByte(OP_POP); // pop result of the increment 
+        emitOp(OP_POP); // pop result of the increment 
+#ifdef REGISTER_OPS
+        registerStatement(incrementStart);
+#endif
         consume(TOKEN_RIGHT_PAREN, "Expected ')' after for clause.");
 
         emitLoop(loopStart);
@@ -909,7 +1209,7 @@ static void forStatement() {
     
     if (exitJump != -1) {
         patchJump(exitJump);
-        emitByte(OP_POP); // Pop condition.
+        emitOp(OP_POP); // Pop condition.
     }
     
     endScope();
@@ -1,9 +1,12 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "debug.h"
 #include "object.h"
 #include "value.h"
 #include "scanner.h"
+#include "vm.h"
 
 
 void disassambleChunk(Chunk* chunk, const char* name) {
@@ -31,14 +34,25 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset) {
 }
 
 
+static int propertyInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t constantIdx = chunk->code[offset+1];
+    uint16_t cache = (uint16_t)((chunk->code[offset+2] << 8) | chunk->code[offset+3]);
+
+    printf("%-16s %4d '", name, constantIdx);
+    printValue(chunk->constants.values[constantIdx]);
+    printf("' ic %d\n", cache);
+    return offset + 4;
+}
+
 static int invokeInstruction(const char* name, Chunk* chunk, int offset) {
     uint8_t constantIdx = chunk->code[offset+1];
     uint8_t argCount = chunk->code[offset+2];
+    uint16_t cache = (uint16_t)((chunk->code[offset+3] << 8) | chunk->code[offset+4]);
 
     printf("%-16s (%d args) %4d '", name, argCount, constantIdx);
     printValue(chunk->constants.values[constantIdx]);
-    printf("'\n");
-    return offset + 3;
+    printf("' ic %d\n", cache);
+    return offset + 5;
 }
 
 static int longConstantInstruction(const char* name, Chunk* chunk, int offset) {
@@ -54,12 +68,56 @@ static int longConstantInstruction(const char* name, Chunk* chunk, int offset) {
     return offset + 4;
 }
 
+static int globalInstruction(const char* name, Chunk* chunk, int offset) {
+    uint16_t slot = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    printf("%-16s %4d '", name, slot);
+    printValue(vm.globalNames.values[slot]);
+    printf("'\n");
+    return offset + 3;
+}
+
 static int byteInstruction(const char* name, Chunk* chunk, int offset) {
     uint8_t slot = chunk->code[offset + 1];
     printf("%-16s %4d\n", name, slot);
     return offset + 2;
 }
 
+static int twoByteInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t first = chunk->code[offset + 1];
+    uint8_t second = chunk->code[offset + 2];
+    printf("%-16s %4d %4d\n", name, first, second);
+    return offset + 3;
+}
+
+static int localConstantInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constantIdx = chunk->code[offset + 2];
+    printf("%-16s %4d %4d '", name, slot, constantIdx);
+    printValue(chunk->constants.values[constantIdx]);
+    printf("'\n");
+    return offset + 3;
+}
+
+// Register instructions print their operands as rN for slots and kN for
+// constants.
+static int registerInstruction(const char* name, const char* operands,
+                               Chunk* chunk, int offset) {
+    printf("%-16s r%d", name, chunk->code[offset + 1]);
+    int count = (int)strlen(operands);
+    for (int i = 0; i < count; i++) {
+        uint8_t operand = chunk->code[offset + 2 + i];
+        if (operands[i] == 'K') {
+            printf(" k%d '", operand);
+            printValue(chunk->constants.values[operand]);
+            printf("'");
+        } else {
+            printf(" r%d", operand);
+        }
+    }
+    printf("\n");
+    return offset + 2 + count;
+}
+
 static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
     uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
     jump |= chunk->code[offset + 2]; // add buttom 8 bytes through OR.
@@ -67,6 +125,13 @@ static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
     return offset + 3;
 }
 
+static int loopInstruction(const char* name, Chunk* chunk, int offset) {
+    uint16_t jump = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    uint16_t loop = (uint16_t)((chunk->code[offset + 3] << 8) | chunk->code[offset + 4]);
+    printf("%-16s %d -> %d loop %d\n", name, offset, offset + 5 - jump, loop);
+    return offset + 5;
+}
+
 int disassambleInstruction(Chunk* chunk, int offset) {
     printf("%04d ", offset);
     int line = getLine(chunk, offset);
@@ -97,22 +162,22 @@ int disassambleInstruction(Chunk* chunk, int offset) {
             return byteInstruction("OP_SET_LOCAL", 
                                        chunk, offset);
         case OP_GET_GLOBAL:
-            return constantInstruction("OP_GET_GLOBAL", 
+            return globalInstruction("OP_GET_GLOBAL", 
                                        chunk, offset);
         case OP_DEFINE_GLOBAL:
-            return constantInstruction("OP_DEFINE_GLOBAL", 
+            return globalInstruction("OP_DEFINE_GLOBAL", 
                                        chunk, offset);
         case OP_SET_GLOBAL:
-            return constantInstruction("OP_SET_GLOBAL", 
+            return globalInstruction("OP_SET_GLOBAL", 
                                        chunk, offset);
         case OP_GET_UPVALUE:
             return byteInstruction("OP_GET_UPVALUE", chunk, offset);
         case OP_SET_UPVALUE:
             return byteInstruction("OP_SET_UPVALUE", chunk, offset);
         case OP_GET_PROPERTY:
-            return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+            return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
         case OP_SET_PROPERTY:
-            return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+            return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
         case OP_EQUAL:
             return simpleInstruction("OP_EQUAL", offset);
         case OP_GREATER:
@@ -138,7 +203,7 @@ int disassambleInstruction(Chunk* chunk, int offset) {
         case OP_JUMP_IF_FALSE:
             return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
         case OP_LOOP:
-            return jumpInstruction("OP_LOOP", -1, chunk, offset);
+            return loopInstruction("OP_LOOP", chunk, offset);
         case OP_CALL:
             return byteInstruction("OP_CALL", chunk, offset);
         case OP_INVOKE:
@@ -169,6 +234,58 @@ int disassambleInstruction(Chunk* chunk, int offset) {
             return constantInstruction("OP_CLASS", chunk, offset);
         case OP_METHOD:
             return constantInstruction("OP_METHOD", chunk, offset);
+        case OP_GET_LOCAL_GET_LOCAL:
+            return twoByteInstruction("OP_GET_LOCAL_GET_LOCAL", chunk, offset);
+        case OP_ADD_LOCAL_CONST:
+            return localConstantInstruction("OP_ADD_LOCAL_CONST", chunk, offset);
+        case OP_LESS_JUMP_IF_FALSE:
+            return jumpInstruction("OP_LESS_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_SET_LOCAL_POP:
+            return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
+        case OP_ADD_NUM:
+            return simpleInstruction("OP_ADD_NUM", offset);
+        case OP_ADD_STR:
+            return simpleInstruction("OP_ADD_STR", offset);
+        case OP_EQUAL_NUM:
+            return simpleInstruction("OP_EQUAL_NUM", offset);
+        case OP_EQUAL_STR:
+            return simpleInstruction("OP_EQUAL_STR", offset);
+        case OP_GET_PROPERTY_FIELD:
+            return propertyInstruction("OP_GET_PROPERTY_FIELD", chunk, offset);
+        case OP_CALL_CLOSURE:
+            return byteInstruction("OP_CALL_CLOSURE", chunk, offset);
+        case OP_CALL_NATIVE:
+            return byteInstruction("OP_CALL_NATIVE", chunk, offset);
+        case OP_CALL_CLASS:
+            return byteInstruction("OP_CALL_CLASS", chunk, offset);
+        case OP_MOVE:
+            return registerInstruction("OP_MOVE", "R", chunk, offset);
+        case OP_LOAD_CONSTANT:
+            return registerInstruction("OP_LOAD_CONSTANT", "K", chunk, offset);
+        case OP_ADD_RR:
+            return registerInstruction("OP_ADD_RR", "RR", chunk, offset);
+        case OP_ADD_RK:
+            return registerInstruction("OP_ADD_RK", "RK", chunk, offset);
+        case OP_ADD_KR:
+            return registerInstruction("OP_ADD_KR", "KR", chunk, offset);
+        case OP_SUBTRACT_RR:
+            return registerInstruction("OP_SUBTRACT_RR", "RR", chunk, offset);
+        case OP_SUBTRACT_RK:
+            return registerInstruction("OP_SUBTRACT_RK", "RK", chunk, offset);
+        case OP_SUBTRACT_KR:
+            return registerInstruction("OP_SUBTRACT_KR", "KR", chunk, offset);
+        case OP_MULTIPLY_RR:
+            return registerInstruction("OP_MULTIPLY_RR", "RR", chunk, offset);
+        case OP_MULTIPLY_RK:
+            return registerInstruction("OP_MULTIPLY_RK", "RK", chunk, offset);
+        case OP_MULTIPLY_KR:
+            return registerInstruction("OP_MULTIPLY_KR", "KR", chunk, offset);
+        case OP_DIVIDE_RR:
+            return registerInstruction("OP_DIVIDE_RR", "RR", chunk, offset);
+        case OP_DIVIDE_RK:
+            return registerInstruction("OP_DIVIDE_RK", "RK", chunk, offset);
+        case OP_DIVIDE_KR:
+            return registerInstruction("OP_DIVIDE_KR", "KR", chunk, offset);
             
         default:
             printf("Unknown opcode %d\n", instruction);
@@ -176,3 +293,138 @@ int disassambleInstruction(Chunk* chunk, int offset) {
     }
 }
 
+
+#ifdef DEBUG_PROFILE_OPCODES
+
+static const char* opcodeNames[OP_COUNT] = {
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_CONSTANT_LONG] = "OP_CONSTANT_LONG",
+    [OP_NIL] = "OP_NIL",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_LESS] = "OP_LESS",
+    [OP_ADD] = "OP_ADD",
+    [OP_SUBTRACT] = "OP_SUBTRACT",
+    [OP_MULTIPLY] = "OP_MULTIPLY",
+    [OP_DIVIDE] = "OP_DIVIDE",
+    [OP_NOT] = "OP_NOT",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_POP] = "OP_POP",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_LOOP] = "OP_LOOP",
+    [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+    [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+    [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+    [OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+    [OP_GET_PROPERTY] = "OP_GET_PROPERTY",
+    [OP_SET_PROPERTY] = "OP_SET_PROPERTY",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_CALL] = "OP_CALL",
+    [OP_INVOKE] = "OP_INVOKE",
+    [OP_CLOSURE] = "OP_CLOSURE",
+    [OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+    [OP_RETURN] = "OP_RETURN",
+    [OP_CLASS] = "OP_CLASS",
+    [OP_METHOD] = "OP_METHOD",
+    [OP_GET_LOCAL_GET_LOCAL] = "OP_GET_LOCAL_GET_LOCAL",
+    [OP_ADD_LOCAL_CONST] = "OP_ADD_LOCAL_CONST",
+    [OP_LESS_JUMP_IF_FALSE] = "OP_LESS_JUMP_IF_FALSE",
+    [OP_SET_LOCAL_POP] = "OP_SET_LOCAL_POP",
+    [OP_ADD_NUM] = "OP_ADD_NUM",
+    [OP_ADD_STR] = "OP_ADD_STR",
+    [OP_EQUAL_NUM] = "OP_EQUAL_NUM",
+    [OP_EQUAL_STR] = "OP_EQUAL_STR",
+    [OP_GET_PROPERTY_FIELD] = "OP_GET_PROPERTY_FIELD",
+    [OP_CALL_CLOSURE] = "OP_CALL_CLOSURE",
+    [OP_CALL_NATIVE] = "OP_CALL_NATIVE",
+    [OP_CALL_CLASS] = "OP_CALL_CLASS",
+    [OP_MOVE] = "OP_MOVE",
+    [OP_LOAD_CONSTANT] = "OP_LOAD_CONSTANT",
+    [OP_ADD_RR] = "OP_ADD_RR",
+    [OP_ADD_RK] = "OP_ADD_RK",
+    [OP_ADD_KR] = "OP_ADD_KR",
+    [OP_SUBTRACT_RR] = "OP_SUBTRACT_RR",
+    [OP_SUBTRACT_RK] = "OP_SUBTRACT_RK",
+    [OP_SUBTRACT_KR] = "OP_SUBTRACT_KR",
+    [OP_MULTIPLY_RR] = "OP_MULTIPLY_RR",
+    [OP_MULTIPLY_RK] = "OP_MULTIPLY_RK",
+    [OP_MULTIPLY_KR] = "OP_MULTIPLY_KR",
+    [OP_DIVIDE_RR] = "OP_DIVIDE_RR",
+    [OP_DIVIDE_RK] = "OP_DIVIDE_RK",
+    [OP_DIVIDE_KR] = "OP_DIVIDE_KR",
+};
+
+// How often each opcode was directly followed by another one at runtime.
+static uint64_t pairCounts[OP_COUNT][OP_COUNT];
+static uint64_t tripleCounts[OP_COUNT][OP_COUNT][OP_COUNT];
+static int lastOps[2] = {-1, -1};
+
+void profileInstruction(uint8_t instruction) {
+    if (lastOps[1] != -1) {
+        pairCounts[lastOps[1]][instruction]++;
+        if (lastOps[0] != -1) {
+            tripleCounts[lastOps[0]][lastOps[1]][instruction]++;
+        }
+    }
+    lastOps[0] = lastOps[1];
+    lastOps[1] = instruction;
+}
+
+typedef struct {
+    uint64_t count;
+    int ops[3];
+} Sequence;
+
+static int compareSequences(const void* a, const void* b) {
+    uint64_t countA = ((const Sequence*)a)->count;
+    uint64_t countB = ((const Sequence*)b)->count;
+    return countA < countB ? 1 : (countA > countB ? -1 : 0);
+}
+
+static void printTopSequences(Sequence* sequences, int count, int length) {
+    qsort(sequences, count, sizeof(Sequence), compareSequences);
+    for (int i = 0; i < count && i < 20; i++) {
+        fprintf(stderr, "%12llu ", (unsigned long long)sequences[i].count);
+        for (int j = 0; j < length; j++) {
+            fprintf(stderr, " %s", opcodeNames[sequences[i].ops[j]]);
+        }
+        fprintf(stderr, "\n");
+    }
+}
+
+void printInstructionProfile() {
+    Sequence* sequences = malloc(sizeof(Sequence) * OP_COUNT * OP_COUNT * OP_COUNT);
+    if (sequences == NULL) return;
+
+    int count = 0;
+    for (int a = 0; a < OP_COUNT; a++) {
+        for (int b = 0; b < OP_COUNT; b++) {
+            if (pairCounts[a][b] == 0) continue;
+            sequences[count++] = (Sequence){pairCounts[a][b], {a, b, 0}};
+        }
+    }
+    fprintf(stderr, "== opcode pairs ==\n");
+    printTopSequences(sequences, count, 2);
+
+    count = 0;
+    for (int a = 0; a < OP_COUNT; a++) {
+        for (int b = 0; b < OP_COUNT; b++) {
+            for (int c = 0; c < OP_COUNT; c++) {
+                if (tripleCounts[a][b][c] == 0) continue;
+                sequences[count++] = (Sequence){tripleCounts[a][b][c], {a, b, c}};
+            }
+        }
+    }
+    fprintf(stderr, "== opcode triples ==\n");
+    printTopSequences(sequences, count, 3);
+
+    free(sequences);
+}
+
+#endif
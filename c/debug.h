@@ -6,4 +6,9 @@
 void disassambleChunk(Chunk* chunk, const char* name);
 int disassambleInstruction(Chunk* chunk, int offset);
 
+#ifdef DEBUG_PROFILE_OPCODES
+void profileInstruction(uint8_t instruction);
+void printInstructionProfile();
+#endif
+
 #endif
\ No newline at end of file
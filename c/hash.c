@@ -0,0 +1,193 @@
+#include <string.h>
+
+#include "hash.h"
+
+#ifdef SIMD_HASH
+#include <emmintrin.h>
+#endif
+
+// Short inputs follow wyhash: 64-bit words multiplied into 128-bit
+// products whose halves are folded together. Long ones are cut into
+// stripes of 64 bytes, accumulated like XXH3 does in eight lanes, which
+// don't wait on each other's multiplies.
+
+#define STRIPE_SIZE 64
+#define LANES 8
+// Stripes between two scrambles of the lanes.
+#define BLOCK_STRIPES 16
+#define PRIME32 0x9E3779B1u
+
+// Stripe i of a block keys its lanes with secret[i] up to secret[i + 7],
+// so moving data around within a block changes the hash. The lanes are
+// scrambled with the last eight.
+static const uint64_t secret[BLOCK_STRIPES + LANES] = {
+    0x2cb0f69f4abea221, 0x9417034723148989, 0xdd555950609dfe03,
+    0xdbafb150deb12800, 0x7e789b2e6c442cb6, 0xf41e5636c7e4f8c4,
+    0x0959d150f8fba7e4, 0xa97316f13cdb9eea, 0x74cd8258f9520068,
+    0x55c74a62e116868b, 0xd2f4c799a2023cbd, 0xdf98cb79a37b51b9,
+    0x396f5885524f3905, 0xaf1d56386ca3b276, 0xa9ffbe6b5104e85a,
+    0x6bd0c51b9fd533b3, 0x980ce91c50ab4b56, 0x28ac395780fe62c5,
+    0x768912e3a6bcedc7, 0x50b3e8c9332c7c88, 0xce3bbfe520bd47da,
+    0xcba6c8e8e0bb7c4f, 0xbf194db8434a346d, 0x7d8f2a7b60416d7f,
+};
+
+static inline uint64_t read64(const uint8_t* bytes) {
+    uint64_t word;
+    memcpy(&word, bytes, sizeof(word));
+    return word;
+}
+
+static inline uint64_t read32(const uint8_t* bytes) {
+    uint32_t word;
+    memcpy(&word, bytes, sizeof(word));
+    return word;
+}
+
+// Both halves of the 128-bit product.
+static inline void multiply(uint64_t* a, uint64_t* b) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t product = (__uint128_t)*a * *b;
+    *a = (uint64_t)product;
+    *b = (uint64_t)(product >> 64);
+#else
+    uint64_t aHigh = *a >> 32, aLow = (uint32_t)*a;
+    uint64_t bHigh = *b >> 32, bLow = (uint32_t)*b;
+    uint64_t high = aHigh * bHigh, middle1 = aHigh * bLow;
+    uint64_t middle2 = aLow * bHigh, low = aLow * bLow;
+    uint64_t carry = ((low >> 32) + (uint32_t)middle1 + (uint32_t)middle2) >> 32;
+    *a = low + (middle1 << 32) + (middle2 << 32);
+    *b = high + (middle1 >> 32) + (middle2 >> 32) + carry;
+#endif
+}
+
+static inline uint64_t mix(uint64_t a, uint64_t b) {
+    multiply(&a, &b);
+    return a ^ b;
+}
+
+#ifdef SIMD_HASH
+// Two lanes of a stripe: each adds the low half of its keyed word times
+// the high half, and its neighbor's plain word.
+static inline __m128i accumulate(__m128i lanes, const uint8_t* data,
+                                 const uint64_t* keys) {
+    __m128i words = _mm_loadu_si128((const __m128i*)data);
+    __m128i keyed = _mm_xor_si128(words, _mm_loadu_si128((const __m128i*)keys));
+    __m128i product = _mm_mul_epu32(
+        keyed, _mm_shuffle_epi32(keyed, _MM_SHUFFLE(0, 3, 0, 1)));
+    __m128i swapped = _mm_shuffle_epi32(words, _MM_SHUFFLE(1, 0, 3, 2));
+    return _mm_add_epi64(lanes, _mm_add_epi64(product, swapped));
+}
+
+static inline __m128i scramble(__m128i lanes, const uint64_t* keys) {
+    lanes = _mm_xor_si128(lanes, _mm_srli_epi64(lanes, 47));
+    lanes = _mm_xor_si128(lanes, _mm_loadu_si128((const __m128i*)keys));
+    // SSE2 only multiplies 32-bit halves.
+    const __m128i prime = _mm_set1_epi32((int)PRIME32);
+    __m128i low = _mm_mul_epu32(lanes, prime);
+    __m128i high = _mm_mul_epu32(_mm_srli_epi64(lanes, 32), prime);
+    return _mm_add_epi64(low, _mm_slli_epi64(high, 32));
+}
+#endif
+
+// Adds every whole stripe of the bytes to the lanes, returns the lanes
+// folded into one word.
+static uint64_t hashStripes(const uint8_t* bytes, size_t length) {
+    size_t stripes = length / STRIPE_SIZE;
+    uint64_t words[LANES];
+#ifdef SIMD_HASH
+    // Spelled out, -O2 doesn't unroll a loop over the registers.
+    __m128i lanes0 = _mm_loadu_si128((const __m128i*)&secret[0]);
+    __m128i lanes1 = _mm_loadu_si128((const __m128i*)&secret[2]);
+    __m128i lanes2 = _mm_loadu_si128((const __m128i*)&secret[4]);
+    __m128i lanes3 = _mm_loadu_si128((const __m128i*)&secret[6]);
+    for (size_t stripe = 0; stripe < stripes; stripe++) {
+        const uint8_t* data = bytes + stripe * STRIPE_SIZE;
+        const uint64_t* keys = &secret[stripe % BLOCK_STRIPES];
+        lanes0 = accumulate(lanes0, data, keys);
+        lanes1 = accumulate(lanes1, data + 16, keys + 2);
+        lanes2 = accumulate(lanes2, data + 32, keys + 4);
+        lanes3 = accumulate(lanes3, data + 48, keys + 6);
+        if (stripe % BLOCK_STRIPES != BLOCK_STRIPES - 1) continue;
+
+        // Sums alone would let blocks trade places.
+        lanes0 = scramble(lanes0, &secret[BLOCK_STRIPES]);
+        lanes1 = scramble(lanes1, &secret[BLOCK_STRIPES + 2]);
+        lanes2 = scramble(lanes2, &secret[BLOCK_STRIPES + 4]);
+        lanes3 = scramble(lanes3, &secret[BLOCK_STRIPES + 6]);
+    }
+    _mm_storeu_si128((__m128i*)&words[0], lanes0);
+    _mm_storeu_si128((__m128i*)&words[2], lanes1);
+    _mm_storeu_si128((__m128i*)&words[4], lanes2);
+    _mm_storeu_si128((__m128i*)&words[6], lanes3);
+#else
+    memcpy(words, secret, sizeof(words));
+    for (size_t stripe = 0; stripe < stripes; stripe++) {
+        const uint8_t* data = bytes + stripe * STRIPE_SIZE;
+        const uint64_t* keys = &secret[stripe % BLOCK_STRIPES];
+        for (int i = 0; i < LANES; i++) {
+            uint64_t word = read64(data + 8 * i);
+            uint64_t keyed = word ^ keys[i];
+            words[i ^ 1] += word;
+            words[i] += (keyed & 0xffffffff) * (keyed >> 32);
+        }
+        if (stripe % BLOCK_STRIPES != BLOCK_STRIPES - 1) continue;
+
+        // Sums alone would let blocks trade places.
+        for (int i = 0; i < LANES; i++) {
+            uint64_t lane = words[i] ^ (words[i] >> 47);
+            words[i] = (lane ^ secret[BLOCK_STRIPES + i]) * PRIME32;
+        }
+    }
+#endif
+
+    uint64_t hash = length * secret[0];
+    for (int i = 0; i < LANES; i += 2) {
+        hash += mix(words[i] ^ secret[i + 8], words[i + 1] ^ secret[i + 9]);
+    }
+    return hash;
+}
+
+uint32_t hashString(const char* key, int length) {
+    const uint8_t* bytes = (const uint8_t*)key;
+    size_t left = (size_t)length;
+    uint64_t seed = 0;
+    if (left >= HASH_WIDE_MIN) {
+        seed = hashStripes(bytes, left);
+        size_t done = left / STRIPE_SIZE * STRIPE_SIZE;
+        bytes += done;
+        left -= done;
+    }
+
+    seed ^= mix(seed ^ secret[0], secret[1]);
+    uint64_t a, b;
+    if (left <= 16) {
+        if (left >= 4) {
+            // Two overlapping reads of four bytes from each end.
+            size_t middle = (left >> 3) << 2;
+            a = read32(bytes) << 32 | read32(bytes + middle);
+            b = read32(bytes + left - 4) << 32 | read32(bytes + left - 4 - middle);
+        } else if (left > 0) {
+            a = (uint64_t)bytes[0] << 16 | (uint64_t)bytes[left >> 1] << 8 |
+                bytes[left - 1];
+            b = 0;
+        } else {
+            a = 0;
+            b = 0;
+        }
+    } else {
+        while (left > 16) {
+            seed = mix(read64(bytes) ^ secret[1], read64(bytes + 8) ^ seed);
+            bytes += 16;
+            left -= 16;
+        }
+        // The last 16 bytes, overlapping what the loop did.
+        a = read64(bytes + left - 16);
+        b = read64(bytes + left - 8);
+    }
+
+    a ^= secret[1];
+    b ^= seed;
+    multiply(&a, &b);
+    uint64_t hash = mix(a ^ secret[0] ^ (uint64_t)length, b ^ secret[1]);
+    return (uint32_t)(hash ^ hash >> 32);
+}
@@ -0,0 +1,13 @@
+#ifndef clox_hash_h
+#define clox_hash_h
+
+#include "common.h"
+
+// Hash of the bytes, what interned strings are looked up by. Reads eight
+// bytes at a time, and inputs of HASH_WIDE_MIN bytes or more in eight
+// independent lanes, in SSE2 registers where there are any.
+#define HASH_WIDE_MIN 256
+
+uint32_t hashString(const char* key, int length);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,614 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "heap.h"
+#include "memory.h"
+
+#ifdef __SANITIZE_ADDRESS__
+// Free cells stay off limits, so AddressSanitizer still catches use after
+// free although the memory never goes back to malloc.
+#include <sanitizer/asan_interface.h>
+#define POISON(cell, size) ASAN_POISON_MEMORY_REGION(cell, size)
+#define UNPOISON(cell, size) ASAN_UNPOISON_MEMORY_REGION(cell, size)
+#else
+#define POISON(cell, size) ((void)(cell), (void)(size))
+#define UNPOISON(cell, size) ((void)(cell), (void)(size))
+#endif
+
+struct HeapPage {
+    HeapPage* prev;
+    HeapPage* next;
+    // Links in the class's list of pages with free cells.
+    HeapPage* prevAvailable;
+    HeapPage* nextAvailable;
+    SizeClass* sizeClass; // NULL for a large object's block.
+    void* freeList; // Freed cells, linked through their first word.
+    char* fresh; // Cells from here on were never handed out.
+    int cellCount;
+    int freeCount;
+    int unsweptCount; // Bits set in the unswept bitmap.
+    int sweepEpoch; // The unswept bitmap is current when it matches the heap's.
+    int youngEpoch; // On the list of young pages when it matches the heap's.
+    bool evacuating; // Its objects are being moved out, see heapStartEvacuation().
+};
+
+_Static_assert(sizeof(HeapPage) <= HEAP_PAGE_HEADER, "Page header too big.");
+
+// Where the cells of a page start.
+#define DATA_CELLS HEAP_PAGE_HEADER
+#define OBJECT_CELLS (HEAP_PAGE_HEADER + 3 * HEAP_BITMAP_WORDS * sizeof(uint64_t))
+
+#define PAGE_OF(pointer) \
+    ((HeapPage*)((uintptr_t)(pointer) & ~(uintptr_t)(HEAP_PAGE_SIZE - 1)))
+
+// Nothing in the VM needs more than word alignment, so small objects get a
+// class every 8 bytes, an instance with its inline slots fits exactly. Four
+// classes per doubling past 128 bytes keeps the rounding loss under a
+// quarter.
+static const size_t cellSizes[HEAP_CLASS_COUNT] = {
+    8, 16, 24, 32, 40, 48, 56, 64, 72, 80, 88, 96, 104, 112, 120, 128,
+    160, 192, 224, 256, 320, 384, 448, 512,
+    640, 768, 896, 1024, 1280, 1536, 1792, 2048,
+};
+
+// Size class of every 8 byte step up to HEAP_MAX_CELL.
+static uint8_t classIndex[HEAP_MAX_CELL / 8 + 1];
+
+static inline int classOf(size_t size) {
+    return classIndex[(size + 7) / 8];
+}
+
+static uint64_t* bitmap(HeapPage* page, HeapBitmap bitmap) {
+    return (uint64_t*)((char*)page + HEAP_PAGE_HEADER) + bitmap * HEAP_BITMAP_WORDS;
+}
+
+static void initClass(SizeClass* sizeClass, size_t cellSize, bool objects) {
+    sizeClass->cellSize = cellSize;
+    sizeClass->objects = objects;
+    sizeClass->pages = NULL;
+    sizeClass->available = NULL;
+    sizeClass->pageCount = 0;
+    sizeClass->liveCells = 0;
+    sizeClass->requestedBytes = 0;
+}
+
+void initHeap(Heap* heap) {
+    int index = 0;
+    for (int step = 0; step <= HEAP_MAX_CELL / 8; step++) {
+        if (cellSizes[index] < (size_t)step * 8) index++;
+        classIndex[step] = index;
+    }
+
+    for (int i = 0; i < HEAP_CLASS_COUNT; i++) {
+        initClass(&heap->classes[i], cellSizes[i], false);
+        initClass(&heap->objectClasses[i], cellSizes[i], true);
+    }
+    heap->largeObjects = NULL;
+    heap->sparePages = NULL;
+    heap->spareCount = 0;
+    heap->pageBytes = 0;
+    heap->largeBytes = 0;
+    heap->largeCount = 0;
+    heap->largeObjectBytes = 0;
+    heap->sweepPages = NULL;
+    heap->sweepCount = 0;
+    heap->sweepCapacity = 0;
+    heap->sweepIndex = 0;
+    heap->sweepWord = 0;
+    heap->sweepEpoch = 0;
+    heap->youngPages = NULL;
+    heap->youngCount = 0;
+    heap->youngCapacity = 0;
+    heap->youngIndex = 0;
+    heap->youngWord = 0;
+    heap->youngEpoch = 0;
+    heap->evacuatePages = NULL;
+    heap->evacuateCount = 0;
+    heap->evacuateCapacity = 0;
+}
+
+static void* allocatePage(size_t size) {
+    void* page;
+    if (posix_memalign(&page, HEAP_PAGE_SIZE, size) != 0) {
+        fprintf(stderr, "Allocating a heap page failed!\n");
+        exit(1);
+    }
+    return page;
+}
+
+static void linkAvailable(SizeClass* sizeClass, HeapPage* page) {
+    page->prevAvailable = NULL;
+    page->nextAvailable = sizeClass->available;
+    if (sizeClass->available != NULL) {
+        sizeClass->available->prevAvailable = page;
+    }
+    sizeClass->available = page;
+}
+
+static void unlinkAvailable(SizeClass* sizeClass, HeapPage* page) {
+    if (page->prevAvailable != NULL) {
+        page->prevAvailable->nextAvailable = page->nextAvailable;
+    } else {
+        sizeClass->available = page->nextAvailable;
+    }
+    if (page->nextAvailable != NULL) {
+        page->nextAvailable->prevAvailable = page->prevAvailable;
+    }
+}
+
+static void linkPage(HeapPage** list, HeapPage* page) {
+    page->prev = NULL;
+    page->next = *list;
+    if (*list != NULL) (*list)->prev = page;
+    *list = page;
+}
+
+static void unlinkPage(HeapPage** list, HeapPage* page) {
+    if (page->prev != NULL) {
+        page->prev->next = page->next;
+    } else {
+        *list = page->next;
+    }
+    if (page->next != NULL) page->next->prev = page->prev;
+}
+
+static HeapPage* newPage(Heap* heap, SizeClass* sizeClass) {
+    HeapPage* page = heap->sparePages;
+    if (page != NULL) {
+        heap->sparePages = page->next;
+        heap->spareCount--;
+    } else {
+        page = allocatePage(HEAP_PAGE_SIZE);
+        heap->pageBytes += HEAP_PAGE_SIZE;
+    }
+
+    size_t cells = sizeClass->objects ? OBJECT_CELLS : DATA_CELLS;
+    UNPOISON(page + 1, HEAP_PAGE_SIZE - sizeof(HeapPage));
+    if (sizeClass->objects) {
+        memset(bitmap(page, HEAP_MARKS), 0, OBJECT_CELLS - HEAP_PAGE_HEADER);
+    }
+    page->sizeClass = sizeClass;
+    page->fresh = (char*)page + cells;
+    page->cellCount = (HEAP_PAGE_SIZE - cells) / sizeClass->cellSize;
+    page->freeCount = page->cellCount;
+    page->unsweptCount = 0;
+    page->sweepEpoch = heap->sweepEpoch;
+    page->youngEpoch = heap->youngEpoch - 1;
+    page->evacuating = false;
+    page->freeList = NULL;
+    POISON(page->fresh, (size_t)page->cellCount * sizeClass->cellSize);
+
+    linkPage(&sizeClass->pages, page);
+    linkAvailable(sizeClass, page);
+    sizeClass->pageCount++;
+    return page;
+}
+
+static void releasePage(Heap* heap, SizeClass* sizeClass, HeapPage* page) {
+    unlinkAvailable(sizeClass, page);
+    unlinkPage(&sizeClass->pages, page);
+    sizeClass->pageCount--;
+
+    // A few empty pages are kept for whichever class needs one next, the
+    // nursery empties and refills the same pages over and over.
+    if (heap->spareCount < HEAP_SPARE_PAGES) {
+        page->next = heap->sparePages;
+        heap->sparePages = page;
+        heap->spareCount++;
+        return;
+    }
+    heap->pageBytes -= HEAP_PAGE_SIZE;
+    UNPOISON(page + 1, HEAP_PAGE_SIZE - sizeof(HeapPage));
+    free(page);
+}
+
+static void freePages(HeapPage* page, size_t size) {
+    while (page != NULL) {
+        HeapPage* next = page->next;
+        UNPOISON(page + 1, size - sizeof(HeapPage));
+        free(page);
+        page = next;
+    }
+}
+
+void freeHeap(Heap* heap) {
+    for (int i = 0; i < HEAP_CLASS_COUNT; i++) {
+        freePages(heap->classes[i].pages, HEAP_PAGE_SIZE);
+        freePages(heap->objectClasses[i].pages, HEAP_PAGE_SIZE);
+    }
+    freePages(heap->sparePages, HEAP_PAGE_SIZE);
+    // Large objects are never poisoned.
+    freePages(heap->largeObjects, sizeof(HeapPage));
+    free(heap->sweepPages);
+    free(heap->youngPages);
+    free(heap->evacuatePages);
+    initHeap(heap);
+}
+
+static void* allocateCell(SizeClass* sizeClass, HeapPage* page, size_t size) {
+    void* cell;
+    if (page->freeList != NULL) {
+        cell = page->freeList;
+        UNPOISON(cell, sizeClass->cellSize);
+        page->freeList = *(void**)cell;
+    } else {
+        cell = page->fresh;
+        UNPOISON(cell, sizeClass->cellSize);
+        page->fresh += sizeClass->cellSize;
+    }
+
+    if (--page->freeCount == 0) unlinkAvailable(sizeClass, page);
+    sizeClass->liveCells++;
+    sizeClass->requestedBytes += size;
+    return cell;
+}
+
+static void freeCell(Heap* heap, HeapPage* page, void* cell, size_t size) {
+    SizeClass* sizeClass = page->sizeClass;
+    *(void**)cell = page->freeList;
+    page->freeList = cell;
+    POISON(cell, sizeClass->cellSize);
+    sizeClass->liveCells--;
+    sizeClass->requestedBytes -= size;
+
+    if (page->freeCount++ == 0) linkAvailable(sizeClass, page);
+    // An empty page goes back to the system unless the class would be left
+    // without free cells, which would have the next allocation map it again.
+    if (page->freeCount == page->cellCount &&
+        (sizeClass->available != page || page->nextAvailable != NULL)) {
+        releasePage(heap, sizeClass, page);
+    }
+}
+
+void* heapAllocate(Heap* heap, size_t size) {
+    if (size > HEAP_MAX_CELL) {
+        void* block = malloc(size);
+        if (block == NULL) {
+            fprintf(stderr, "Allocating failed!\n");
+            exit(1);
+        }
+        heap->largeBytes += size;
+        heap->largeCount++;
+        return block;
+    }
+
+    SizeClass* sizeClass = &heap->classes[classOf(size)];
+    HeapPage* page = sizeClass->available;
+    if (page == NULL) page = newPage(heap, sizeClass);
+    return allocateCell(sizeClass, page, size);
+}
+
+void heapFree(Heap* heap, void* pointer, size_t size) {
+    if (pointer == NULL) return;
+
+    if (size > HEAP_MAX_CELL) {
+        free(pointer);
+        heap->largeBytes -= size;
+        heap->largeCount--;
+        return;
+    }
+    freeCell(heap, PAGE_OF(pointer), pointer, size);
+}
+
+void* heapReallocate(Heap* heap, void* pointer, size_t oldSize, size_t newSize) {
+    if (pointer == NULL) return heapAllocate(heap, newSize);
+
+    if (oldSize <= HEAP_MAX_CELL && newSize <= HEAP_MAX_CELL &&
+        classOf(oldSize) == classOf(newSize)) {
+        heap->classes[classOf(oldSize)].requestedBytes += newSize - oldSize;
+        return pointer;
+    }
+
+    if (oldSize > HEAP_MAX_CELL && newSize > HEAP_MAX_CELL) {
+        void* block = realloc(pointer, newSize);
+        if (block == NULL) {
+            fprintf(stderr, "Reallocating failed!\n");
+            exit(1);
+        }
+        heap->largeBytes += newSize - oldSize;
+        return block;
+    }
+
+    void* block = heapAllocate(heap, newSize);
+    memcpy(block, pointer, oldSize < newSize ? oldSize : newSize);
+    heapFree(heap, pointer, oldSize);
+    return block;
+}
+
+static void takeSnapshot(Heap* heap, HeapPage* page);
+
+static void pushPage(HeapPage*** pages, int* count, int* capacity,
+                     HeapPage* page) {
+    if (*capacity < *count + 1) {
+        *capacity = GROW_CAPACITY(*capacity);
+        *pages = realloc(*pages, sizeof(HeapPage*) * *capacity);
+        if (*pages == NULL) exit(1);
+    }
+    (*pages)[(*count)++] = page;
+}
+
+void* heapAllocateObject(Heap* heap, size_t size) {
+    void* object;
+    HeapPage* page;
+    if (size > HEAP_MAX_CELL) {
+        page = allocatePage(OBJECT_CELLS + size);
+        memset(bitmap(page, HEAP_MARKS), 0, OBJECT_CELLS - HEAP_PAGE_HEADER);
+        page->sizeClass = NULL;
+        page->cellCount = 1;
+        page->freeCount = 0;
+        page->unsweptCount = 0;
+        page->sweepEpoch = heap->sweepEpoch;
+        page->youngEpoch = heap->youngEpoch - 1;
+        page->evacuating = false;
+        linkPage(&heap->largeObjects, page);
+        heap->pageBytes += OBJECT_CELLS + size;
+        heap->largeObjectBytes += size;
+        object = (char*)page + OBJECT_CELLS;
+    } else {
+        SizeClass* sizeClass = &heap->objectClasses[classOf(size)];
+        page = sizeClass->available;
+        if (page == NULL) page = newPage(heap, sizeClass);
+        if (page->sweepEpoch != heap->sweepEpoch) takeSnapshot(heap, page);
+        object = allocateCell(sizeClass, page, size);
+    }
+
+    *heapBitmapWord(object, HEAP_ALLOCATED) |= heapBitMask(object);
+    if (page->youngEpoch != heap->youngEpoch) {
+        page->youngEpoch = heap->youngEpoch;
+        pushPage(&heap->youngPages, &heap->youngCount, &heap->youngCapacity,
+                 page);
+    }
+    return object;
+}
+
+void heapFreeObject(Heap* heap, void* object, size_t size) {
+    *heapBitmapWord(object, HEAP_ALLOCATED) &= ~heapBitMask(object);
+
+    HeapPage* page = PAGE_OF(object);
+    if (page->sizeClass == NULL) {
+        unlinkPage(&heap->largeObjects, page);
+        heap->pageBytes -= OBJECT_CELLS + size;
+        heap->largeObjectBytes -= size;
+        free(page);
+        return;
+    }
+    freeCell(heap, page, object, size);
+}
+
+// Runs body with page set to every page that holds objects.
+#define FOR_EACH_OBJECT_PAGE(heap, page, body) \
+    do { \
+        for (int i = 0; i < HEAP_CLASS_COUNT; i++) { \
+            for (HeapPage* page = (heap)->objectClasses[i].pages; \
+                 page != NULL; page = page->next) { \
+                body; \
+            } \
+        } \
+        for (HeapPage* page = (heap)->largeObjects; page != NULL; \
+             page = page->next) { \
+            body; \
+        } \
+    } while (false)
+
+void heapClearMarks(Heap* heap) {
+    FOR_EACH_OBJECT_PAGE(heap, page,
+        memset(bitmap(page, HEAP_MARKS), 0, HEAP_BITMAP_WORDS * sizeof(uint64_t)));
+}
+
+// Notes which objects of the page the sweep frees. Until something gets
+// allocated in the page those are exactly the unmarked ones, so this waits
+// for the sweep to get there or the page to be allocated from, whatever
+// comes first.
+static void takeSnapshot(Heap* heap, HeapPage* page) {
+    uint64_t* marks = bitmap(page, HEAP_MARKS);
+    uint64_t* allocated = bitmap(page, HEAP_ALLOCATED);
+    uint64_t* unswept = bitmap(page, HEAP_UNSWEPT);
+    int count = 0;
+    for (int i = 0; i < HEAP_BITMAP_WORDS; i++) {
+        unswept[i] = allocated[i] & ~marks[i];
+        count += __builtin_popcountll(unswept[i]);
+    }
+    page->unsweptCount = count;
+    page->sweepEpoch = heap->sweepEpoch;
+}
+
+static void addSweepPage(Heap* heap, HeapPage* page) {
+    // Empty pages have nothing to sweep. The others can't empty out before
+    // the sweep gets to them: minor collections only free objects allocated
+    // after this.
+    if (page->freeCount == page->cellCount) return;
+    pushPage(&heap->sweepPages, &heap->sweepCount, &heap->sweepCapacity, page);
+}
+
+void heapStartSweep(Heap* heap) {
+    heap->sweepEpoch++;
+    heap->sweepCount = 0;
+    heap->sweepIndex = 0;
+    heap->sweepWord = 0;
+    FOR_EACH_OBJECT_PAGE(heap, page, addSweepPage(heap, page));
+}
+
+void* heapNextUnswept(Heap* heap) {
+    HeapPage* page;
+    for (;;) {
+        if (heap->sweepIndex == heap->sweepCount) return NULL;
+        page = heap->sweepPages[heap->sweepIndex];
+        if (page->sweepEpoch != heap->sweepEpoch) takeSnapshot(heap, page);
+        if (page->unsweptCount > 0) break;
+        heap->sweepIndex++;
+        heap->sweepWord = 0;
+    }
+
+    uint64_t* unswept = bitmap(page, HEAP_UNSWEPT);
+    while (unswept[heap->sweepWord] == 0) heap->sweepWord++;
+
+    uint64_t bits = unswept[heap->sweepWord];
+    unswept[heap->sweepWord] = bits & (bits - 1);
+    char* object = (char*)page +
+        (heap->sweepWord * 64 + __builtin_ctzll(bits)) * HEAP_GRANULE;
+    // Move on before the caller frees the last object, the page may go
+    // with it.
+    if (--page->unsweptCount == 0) {
+        heap->sweepIndex++;
+        heap->sweepWord = 0;
+    }
+    return object;
+}
+
+void heapForgetYoung(Heap* heap) {
+    heap->youngEpoch++;
+    heap->youngCount = 0;
+    heap->youngIndex = 0;
+    heap->youngWord = 0;
+}
+
+void* heapNextDeadYoung(Heap* heap) {
+    while (heap->youngIndex < heap->youngCount) {
+        HeapPage* page = heap->youngPages[heap->youngIndex];
+        uint64_t* marks = bitmap(page, HEAP_MARKS);
+        uint64_t* allocated = bitmap(page, HEAP_ALLOCATED);
+        uint64_t* unswept = bitmap(page, HEAP_UNSWEPT);
+        // Allocating took the page's snapshot, so the unswept bits are
+        // current and keep the old garbage out.
+        for (; heap->youngWord < HEAP_BITMAP_WORDS; heap->youngWord++) {
+            int word = heap->youngWord;
+            uint64_t dead = allocated[word] & ~marks[word] & ~unswept[word];
+            if (dead == 0) continue;
+
+            char* object = (char*)page +
+                (word * 64 + __builtin_ctzll(dead)) * HEAP_GRANULE;
+            // Same as the sweep, the last object may take the page along.
+            if (page->cellCount - page->freeCount == 1) {
+                heap->youngIndex++;
+                heap->youngWord = 0;
+            }
+            return object;
+        }
+        heap->youngIndex++;
+        heap->youngWord = 0;
+    }
+    return NULL;
+}
+
+static void walkPage(HeapPage* page, HeapVisitor visit) {
+    uint64_t* allocated = bitmap(page, HEAP_ALLOCATED);
+    for (int word = 0; word < HEAP_BITMAP_WORDS; word++) {
+        // Read up front, the visitor may allocate in the same page.
+        uint64_t bits = allocated[word];
+        while (bits != 0) {
+            visit((char*)page + (word * 64 + __builtin_ctzll(bits)) * HEAP_GRANULE);
+            bits &= bits - 1;
+        }
+    }
+}
+
+void heapWalkObjects(Heap* heap, HeapVisitor visit) {
+    FOR_EACH_OBJECT_PAGE(heap, page,
+        if (!page->evacuating) walkPage(page, visit));
+}
+
+int heapStartEvacuation(Heap* heap, double occupancy) {
+    heap->evacuateCount = 0;
+    for (int i = 0; i < HEAP_CLASS_COUNT; i++) {
+        SizeClass* sizeClass = &heap->objectClasses[i];
+        // A lone page would only move to a fresh one.
+        if (sizeClass->pageCount < 2) continue;
+
+        for (HeapPage* page = sizeClass->pages; page != NULL; page = page->next) {
+            int used = page->cellCount - page->freeCount;
+            if (used == 0 || used > occupancy * page->cellCount) continue;
+
+            // Copies have to land somewhere else.
+            if (page->freeCount > 0) unlinkAvailable(sizeClass, page);
+            page->evacuating = true;
+            pushPage(&heap->evacuatePages, &heap->evacuateCount,
+                     &heap->evacuateCapacity, page);
+        }
+    }
+    return heap->evacuateCount;
+}
+
+void heapWalkEvacuating(Heap* heap, HeapVisitor visit) {
+    for (int i = 0; i < heap->evacuateCount; i++) {
+        walkPage(heap->evacuatePages[i], visit);
+    }
+}
+
+void heapEndEvacuation(Heap* heap, size_t (*sizeOf)(void* copy)) {
+    for (int i = 0; i < heap->evacuateCount; i++) {
+        HeapPage* page = heap->evacuatePages[i];
+        SizeClass* sizeClass = page->sizeClass;
+        page->evacuating = false;
+        if (page->freeCount > 0) linkAvailable(sizeClass, page);
+
+        uint64_t* allocated = bitmap(page, HEAP_ALLOCATED);
+        int left = page->cellCount - page->freeCount;
+        for (int word = 0; left > 0; word++) {
+            uint64_t bits = allocated[word];
+            for (; bits != 0; bits &= bits - 1) {
+                char* object = (char*)page +
+                    (word * 64 + __builtin_ctzll(bits)) * HEAP_GRANULE;
+                size_t size = sizeOf(heapForwardee(object));
+                *heapBitmapWord(object, HEAP_UNSWEPT) &= ~heapBitMask(object);
+                // The last one may take the page along.
+                left--;
+                heapFreeObject(heap, object, size);
+            }
+        }
+    }
+    heap->evacuateCount = 0;
+}
+
+static size_t requestedBytes(Heap* heap) {
+    size_t bytes = heap->largeBytes + heap->largeObjectBytes;
+    for (int i = 0; i < HEAP_CLASS_COUNT; i++) {
+        bytes += heap->classes[i].requestedBytes;
+        bytes += heap->objectClasses[i].requestedBytes;
+    }
+    return bytes;
+}
+
+double heapFragmentation(Heap* heap) {
+    size_t held = heap->pageBytes + heap->largeBytes;
+    if (held == 0) return 0;
+    return 1 - (double)requestedBytes(heap) / held;
+}
+
+static size_t printClasses(const char* kind, SizeClass* classes) {
+    size_t cellBytes = 0;
+    for (int i = 0; i < HEAP_CLASS_COUNT; i++) {
+        SizeClass* sizeClass = &classes[i];
+        if (sizeClass->pageCount == 0) continue;
+
+        size_t cells = 0;
+        for (HeapPage* page = sizeClass->pages; page != NULL; page = page->next) {
+            cells += page->cellCount;
+        }
+        printf("%-7s %5zu %6d %7zu/%-7zu %8.1f%%\n", kind, sizeClass->cellSize,
+               sizeClass->pageCount, sizeClass->liveCells, cells,
+               100.0 * sizeClass->liveCells / cells);
+        cellBytes += sizeClass->liveCells * sizeClass->cellSize;
+    }
+    return cellBytes;
+}
+
+void printHeapStats(Heap* heap) {
+    printf("kind    class  pages           cells  occupancy\n");
+    size_t cellBytes = printClasses("objects", heap->objectClasses) +
+                       printClasses("data", heap->classes);
+    printf("spare   %d pages\n", heap->spareCount);
+    printf("large   %zu blocks, %zu bytes, objects %zu bytes\n",
+           heap->largeCount, heap->largeBytes, heap->largeObjectBytes);
+
+    // Internal: rounding up to the cell size. External: cells nobody uses,
+    // page headers and bitmaps.
+    size_t held = heap->pageBytes + heap->largeBytes;
+    size_t used = heap->largeBytes + heap->largeObjectBytes + cellBytes;
+    double internal = held == 0 ? 0 :
+        (double)(used - requestedBytes(heap)) / held;
+    printf("fragmentation %.1f%% (internal %.1f%%, external %.1f%%)\n",
+           100 * heapFragmentation(heap), 100 * internal,
+           100 * (heapFragmentation(heap) - internal));
+}
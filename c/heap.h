@@ -0,0 +1,166 @@
+#ifndef clox_heap_h
+#define clox_heap_h
+
+#include "common.h"
+
+// The VM's own allocator. Small blocks come from size classes, each with
+// free lists of equal cells carved out of aligned pages, so the page of a
+// cell is found by masking its address. Bigger blocks go straight to malloc.
+//
+// Objects get pages of their own. Right after the page header those keep
+// three bitmaps with a bit per granule, set at the granules where cells
+// start: the collector's mark bits, which cells hold an object, and which
+// dead objects a sweep still has to free. Objects too big for a size class
+// sit alone in an aligned block laid out the same way.
+
+#define HEAP_PAGE_SIZE (64 * 1024)
+// Biggest block a size class serves.
+#define HEAP_MAX_CELL 2048
+#define HEAP_CLASS_COUNT 32
+// Empty pages kept around instead of going back to the system.
+#define HEAP_SPARE_PAGES 16
+
+#define HEAP_PAGE_HEADER 128
+#define HEAP_GRANULE 8
+#define HEAP_BITMAP_WORDS (HEAP_PAGE_SIZE / HEAP_GRANULE / 64)
+
+typedef enum {
+    HEAP_MARKS,
+    HEAP_ALLOCATED,
+    HEAP_UNSWEPT
+} HeapBitmap;
+
+typedef struct HeapPage HeapPage;
+
+typedef struct {
+    size_t cellSize;
+    bool objects; // Pages with bitmaps.
+    HeapPage* pages; // Every page of the class.
+    HeapPage* available; // Pages with at least one free cell.
+    int pageCount;
+    size_t liveCells;
+    size_t requestedBytes; // What callers asked for, at most liveCells * cellSize.
+} SizeClass;
+
+typedef struct {
+    SizeClass classes[HEAP_CLASS_COUNT];
+    SizeClass objectClasses[HEAP_CLASS_COUNT];
+    HeapPage* largeObjects; // Blocks of one object each.
+    HeapPage* sparePages; // Empty pages, linked through next.
+    int spareCount;
+    size_t pageBytes; // Held in pages, whether the cells are used or not.
+    size_t largeBytes; // Held in blocks too big for a size class.
+    size_t largeCount;
+    size_t largeObjectBytes;
+    // Pages with objects left to sweep, see heapStartSweep().
+    HeapPage** sweepPages;
+    int sweepCount;
+    int sweepCapacity;
+    int sweepIndex;
+    int sweepWord;
+    int sweepEpoch; // Counts sweeps.
+    // Pages objects were allocated in since heapForgetYoung().
+    HeapPage** youngPages;
+    int youngCount;
+    int youngCapacity;
+    int youngIndex;
+    int youngWord;
+    int youngEpoch;
+    // Pages whose objects are being moved out.
+    HeapPage** evacuatePages;
+    int evacuateCount;
+    int evacuateCapacity;
+} Heap;
+
+typedef void (*HeapVisitor)(void* object);
+
+void initHeap(Heap* heap);
+// Hands every page back to the system.
+void freeHeap(Heap* heap);
+void* heapAllocate(Heap* heap, size_t size);
+// size has to be what the block was allocated with.
+void heapFree(Heap* heap, void* pointer, size_t size);
+// Keeps the block where it is when the new size falls in the same class.
+void* heapReallocate(Heap* heap, void* pointer, size_t oldSize, size_t newSize);
+// Same for objects, which start out unmarked.
+void* heapAllocateObject(Heap* heap, size_t size);
+void heapFreeObject(Heap* heap, void* object, size_t size);
+// Unmarks every object.
+void heapClearMarks(Heap* heap);
+// Takes note of the objects that are unmarked now, heapNextUnswept() hands
+// them out one by one. Objects allocated later aren't part of the sweep,
+// and until the sweep is done no object that is unmarked now may get
+// marked.
+void heapStartSweep(Heap* heap);
+// The next object of the sweep, NULL once there are none left. The caller
+// frees it.
+void* heapNextUnswept(Heap* heap);
+// Objects allocated from here on are young.
+void heapForgetYoung(Heap* heap);
+// The next young object that is neither marked nor left to the sweep, NULL
+// once there are none left. The caller frees it before asking again.
+void* heapNextDeadYoung(Heap* heap);
+// Calls visit with every object outside the pages being evacuated. It may
+// allocate but not free objects.
+void heapWalkObjects(Heap* heap, HeapVisitor visit);
+// Picks the object pages with at most the given share of their cells in
+// use for evacuation, new objects stay out of them from now on. Big objects
+// never move. Returns how many pages were picked.
+int heapStartEvacuation(Heap* heap, double occupancy);
+// Calls visit with every object of the pages being evacuated, which is
+// expected to move it and leave a forwarding address with heapForward().
+void heapWalkEvacuating(Heap* heap, HeapVisitor visit);
+// Frees the objects that were moved out. sizeOf gets their copies.
+void heapEndEvacuation(Heap* heap, size_t (*sizeOf)(void* copy));
+// Share of the memory the heap holds that isn't handed out: the unused tails
+// of cells plus the free cells of pages.
+double heapFragmentation(Heap* heap);
+// Pages and cell occupancy of every size class, on stdout.
+void printHeapStats(Heap* heap);
+
+static inline uint64_t* heapBitmapWord(const void* object, HeapBitmap bitmap) {
+    uintptr_t address = (uintptr_t)object;
+    uintptr_t page = address & ~(uintptr_t)(HEAP_PAGE_SIZE - 1);
+    return (uint64_t*)(page + HEAP_PAGE_HEADER) + bitmap * HEAP_BITMAP_WORDS +
+        (address - page) / HEAP_GRANULE / 64;
+}
+
+static inline uint64_t heapBitMask(const void* object) {
+    return (uint64_t)1 << ((uintptr_t)object / HEAP_GRANULE % 64);
+}
+
+static inline bool heapIsMarked(const void* object) {
+    return (__atomic_load_n(heapBitmapWord(object, HEAP_MARKS), __ATOMIC_RELAXED) &
+            heapBitMask(object)) != 0;
+}
+
+// Sets the mark bit, returns whether it was set already. Atomic where other
+// threads may be marking in the same words.
+static inline bool heapMark(const void* object, bool atomic) {
+    uint64_t* word = heapBitmapWord(object, HEAP_MARKS);
+    uint64_t mask = heapBitMask(object);
+    if (atomic) {
+        return (__atomic_fetch_or(word, mask, __ATOMIC_RELAXED) & mask) != 0;
+    }
+    bool marked = (*word & mask) != 0;
+    *word |= mask;
+    return marked;
+}
+
+// An evacuated object keeps the address of its copy in its first word.
+// The unswept bits aren't used outside a sweep, so they tell the moved
+// objects apart until heapEndEvacuation().
+static inline void heapForward(void* object, void* copy) {
+    *(void**)object = copy;
+    *heapBitmapWord(object, HEAP_UNSWEPT) |= heapBitMask(object);
+}
+
+// Where the object was moved to, NULL if it wasn't.
+static inline void* heapForwardee(const void* object) {
+    if ((*heapBitmapWord(object, HEAP_UNSWEPT) & heapBitMask(object)) == 0) {
+        return NULL;
+    }
+    return *(void* const*)object;
+}
+
+#endif
@@ -0,0 +1,857 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "assembler.h"
+#include "jit.h"
+#include "memory.h"
+
+#ifdef JIT
+
+// A baseline JIT. Every instruction of a hot function becomes a small
+// template of x86-64 code, stitched together in bytecode order. Moves,
+// jumps and number arithmetic are inlined, everything else calls a helper
+// that does what run() would do. Calls and returns leave the native code,
+// run() then moves on to whichever frame is on top.
+//
+// Native code keeps the current CallFrame in rbx and &vm.stackTop in r12.
+// Both are callee-saved, so they survive the calls into the helpers.
+
+#define FRAME_REG RBX
+#define STACK_TOP_REG R12
+
+typedef JitStatus (*JitHelper)(CallFrame* frame, uint8_t* ip);
+typedef JitStatus (*JitEntry)(CallFrame* frame, uint8_t* address);
+
+// Helpers. ip points to the instruction's first operand. Each one mirrors
+// the instruction's case in run().
+
+#define PEEK(distance) (vm.stackTop[-1 - (distance)])
+#define CONSTANT(index) (frame->closure->function->chunk.constants.values[index])
+#define CACHE(ip) \
+    (&frame->closure->function->chunk.caches[(uint16_t)(((ip)[0] << 8) | (ip)[1])])
+
+static JitStatus helperConstant(CallFrame* frame, uint8_t* ip) {
+    push(CONSTANT(ip[0]));
+    return JIT_CONTINUE;
+}
+
+static JitStatus helperConstantLong(CallFrame* frame, uint8_t* ip) {
+    push(CONSTANT(ip[0] | (ip[1] << 8) | (ip[2] << 16)));
+    return JIT_CONTINUE;
+}
+
+static JitStatus helperGetUpvalue(CallFrame* frame, uint8_t* ip) {
+    push(*frame->closure->upvalues[ip[0]]->location);
+    return JIT_CONTINUE;
+}
+
+static JitStatus helperSetUpvalue(CallFrame* frame, uint8_t* ip) {
+    ObjUpvalue* upvalue = frame->closure->upvalues[ip[0]];
+    gcOverwriteBarrier(*upvalue->location);
+    *upvalue->location = PEEK(0);
+    gcWriteBarrier((Obj*)upvalue, PEEK(0));
+    return JIT_CONTINUE;
+}
+
+static JitStatus helperGetGlobal(CallFrame* frame, uint8_t* ip) {
+    uint16_t slot = (uint16_t)((ip[0] << 8) | ip[1]);
+    Value value = vm.globalValues.values[slot];
+    if (IS_UNDEFINED(value)) {
+        frame->ip = ip + 2;
+        runtimeError("Undefined variable '%s'.",
+            AS_CSTRING(vm.globalNames.values[slot]));
+        return JIT_ERROR;
+    }
+    push(value);
+    return JIT_CONTINUE;
+}
+
+static JitStatus helperDefineGlobal(CallFrame* frame, uint8_t* ip) {
+    vm.globalValues.values[(ip[0] << 8) | ip[1]] = PEEK(0);
+    pop();
+    return JIT_CONTINUE;
+}
+
+static JitStatus helperSetGlobal(CallFrame* frame, uint8_t* ip) {
+    uint16_t slot = (uint16_t)((ip[0] << 8) | ip[1]);
+    if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+        frame->ip = ip + 2;
+        runtimeError("Undefined variable '%s'.",
+            AS_CSTRING(vm.globalNames.values[slot]));
+        return JIT_ERROR;
+    }
+    vm.globalValues.values[slot] = PEEK(0);
+    return JIT_CONTINUE;
+}
+
+static JitStatus helperGetProperty(CallFrame* frame, uint8_t* ip) {
+    frame->ip = ip + 3;
+    if (!IS_INSTANCE(PEEK(0))) {
+        runtimeError("Only instances have properties.");
+        return JIT_ERROR;
+    }
+    if (!getProperty(AS_INSTANCE(PEEK(0)), AS_STRING(CONSTANT(ip[0])),
+                     CACHE(ip + 1))) {
+        return JIT_ERROR;
+    }
+    return JIT_CONTINUE;
+}
+
+static JitStatus helperSetProperty(CallFrame* frame, uint8_t* ip) {
+    if (!IS_INSTANCE(PEEK(1))) {
+        frame->ip = ip + 3;
+        runtimeError("Only instances have fields.");
+        return JIT_ERROR;
+    }
+    setProperty(AS_INSTANCE(PEEK(1)), AS_STRING(CONSTANT(ip[0])), PEEK(0),
+                CACHE(ip + 1));
+    Value value = pop();
+    pop();
+    push(value);
+    return JIT_CONTINUE;
+}
+
+static JitStatus helperEqual(CallFrame* frame, uint8_t* ip) {
+    Value b = pop();
+    Value a = pop();
+    push(BOOL_VAL(valuesEqual(a, b)));
+    return JIT_CONTINUE;
+}
+
+static JitStatus helperAdd(CallFrame* frame, uint8_t* ip) {
+    if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+        double b = AS_NUMBER(pop());
+        double a = AS_NUMBER(pop());
+        push(NUMBER_VAL(a + b));
+        return JIT_CONTINUE;
+    }
+    frame->ip = ip;
+    return addNonNumbers() ? JIT_CONTINUE : JIT_ERROR;
+}
+
+#define BINARY_HELPER(name, valueType, op) \
+    static JitStatus name(CallFrame* frame, uint8_t* ip) { \
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+            frame->ip = ip; \
+            runtimeError("Operands must be numbers."); \
+            return JIT_ERROR; \
+        } \
+        double b = AS_NUMBER(pop()); \
+        double a = AS_NUMBER(pop()); \
+        push(valueType(a op b)); \
+        return JIT_CONTINUE; \
+    }
+
+BINARY_HELPER(helperGreater, BOOL_VAL, >)
+BINARY_HELPER(helperLess, BOOL_VAL, <)
+BINARY_HELPER(helperSubtract, NUMBER_VAL, -)
+BINARY_HELPER(helperMultiply, NUMBER_VAL, *)
+BINARY_HELPER(helperDivide, NUMBER_VAL, /)
+
+#undef BINARY_HELPER
+
+static JitStatus helperNot(CallFrame* frame, uint8_t* ip) {
+    push(BOOL_VAL(isFalsey(pop())));
+    return JIT_CONTINUE;
+}
+
+static JitStatus helperNegate(CallFrame* frame, uint8_t* ip) {
+    if (!IS_NUMBER(PEEK(0))) {
+        frame->ip = ip;
+        runtimeError("Operand must be a number.");
+        return JIT_ERROR;
+    }
+    vm.stackTop[-1] = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+    return JIT_CONTINUE;
+}
+
+static JitStatus helperPrint(CallFrame* frame, uint8_t* ip) {
+    printValue(pop());
+    printf("\n");
+    return JIT_CONTINUE;
+}
+
+// Finishes a call that was made with frameCount frames on the stack. A
+// compiled callee runs right here, so calls between compiled functions
+// don't go through run(). Interpreted callees are left to run().
+static JitStatus finishCall(int frameCount) {
+    // Natives and classes without an initializer finish right away.
+    if (vm.frameCount == frameCount) return JIT_CONTINUE;
+
+    CallFrame* callee = &vm.frames[vm.frameCount - 1];
+    if (callee->closure->function->jit == NULL) return JIT_FRAME;
+    JitStatus status = jitRun(callee);
+    // Back in the caller's frame means the callee returned.
+    if (status == JIT_FRAME && vm.frameCount == frameCount) return JIT_CONTINUE;
+    return status;
+}
+
+static JitStatus helperCall(CallFrame* frame, uint8_t* ip) {
+    int argCount = ip[0];
+    int frameCount = vm.frameCount;
+    frame->ip = ip + 1;
+    if (!callValue(PEEK(argCount), argCount)) return JIT_ERROR;
+    return finishCall(frameCount);
+}
+
+static JitStatus helperInvoke(CallFrame* frame, uint8_t* ip) {
+    int frameCount = vm.frameCount;
+    frame->ip = ip + 4;
+    if (!invoke(AS_STRING(CONSTANT(ip[0])), ip[1], CACHE(ip + 2))) {
+        return JIT_ERROR;
+    }
+    return finishCall(frameCount);
+}
+
+static JitStatus helperClosure(CallFrame* frame, uint8_t* ip) {
+    ObjClosure* closure = newClosure(AS_FUNCTION(CONSTANT(ip[0])));
+    push(OBJ_VAL(closure));
+    for (int i = 0; i < closure->upvalueCount; i++) {
+        uint8_t isLocal = ip[1 + 2 * i];
+        uint8_t index = ip[2 + 2 * i];
+        if (isLocal) {
+            closure->upvalues[i] = captureUpvalue(frame->slots + index);
+        } else {
+            closure->upvalues[i] = frame->closure->upvalues[index];
+        }
+        gcWriteBarrier((Obj*)closure, OBJ_VAL(closure->upvalues[i]));
+    }
+    return JIT_CONTINUE;
+}
+
+static JitStatus helperCloseUpvalue(CallFrame* frame, uint8_t* ip) {
+    closeUpvalues(vm.stackTop - 1);
+    pop();
+    return JIT_CONTINUE;
+}
+
+static JitStatus helperReturn(CallFrame* frame, uint8_t* ip) {
+    Value result = pop();
+    closeUpvalues(frame->slots);
+    vm.frameCount--;
+    if (vm.frameCount == 0) {
+        pop();
+        return JIT_DONE;
+    }
+    vm.stackTop = frame->slots;
+    push(result);
+    return JIT_FRAME;
+}
+
+static JitStatus helperAddLocalConst(CallFrame* frame, uint8_t* ip) {
+    push(frame->slots[ip[0]]);
+    push(CONSTANT(ip[1]));
+    return helperAdd(frame, ip + 2);
+}
+
+static JitStatus helperLoadConstant(CallFrame* frame, uint8_t* ip) {
+    frame->slots[ip[0]] = CONSTANT(ip[1]);
+    return JIT_CONTINUE;
+}
+
+// Any of the RR, RK and KR arithmetic instructions. Register instructions
+// are never quickened, so the opcode byte tells which one this is.
+static JitStatus helperRegisterOp(CallFrame* frame, uint8_t* ip) {
+    int op = (ip[-1] - OP_ADD_RR) / 3;
+    int form = (ip[-1] - OP_ADD_RR) % 3;
+    Value a = form == 2 ? CONSTANT(ip[1]) : frame->slots[ip[1]];
+    Value b = form == 1 ? CONSTANT(ip[2]) : frame->slots[ip[2]];
+    if (op == 0 && !(IS_NUMBER(a) && IS_NUMBER(b))) {
+        push(a);
+        push(b);
+        frame->ip = ip + 3;
+        if (!addNonNumbers()) return JIT_ERROR;
+        frame->slots[ip[0]] = pop();
+        return JIT_CONTINUE;
+    }
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+        frame->ip = ip + 3;
+        runtimeError("Operands must be numbers.");
+        return JIT_ERROR;
+    }
+
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (op) {
+        case 0: frame->slots[ip[0]] = NUMBER_VAL(x + y); break;
+        case 1: frame->slots[ip[0]] = NUMBER_VAL(x - y); break;
+        case 2: frame->slots[ip[0]] = NUMBER_VAL(x * y); break;
+        default: frame->slots[ip[0]] = NUMBER_VAL(x / y); break;
+    }
+    return JIT_CONTINUE;
+}
+
+#undef PEEK
+#undef CONSTANT
+#undef CACHE
+
+// Machine code emission.
+
+// add qword [r12], delta
+static void emitAdjustStackTop(Assembler* as, int8_t delta) {
+    emitBytes(as, 5, (uint8_t[]){0x49, 0x83, 0x44, 0x24, 0x00});
+    emitByte(as, (uint8_t)delta);
+}
+
+// Calls helper(frame, ip) and leaves for run() unless it returns JIT_CONTINUE.
+static void emitHelper(Assembler* as, JitHelper helper, uint8_t* ip) {
+    emitRegisters(as, X86_STORE, RDI, FRAME_REG);
+    emitMoveImmediate(as, RSI, (uint64_t)(uintptr_t)ip);
+    emitMoveImmediate(as, RAX, (uint64_t)(uintptr_t)helper);
+    emitBytes(as, 2, (uint8_t[]){0xFF, 0xD0}); // call rax
+    emitBytes(as, 2, (uint8_t[]){0x85, 0xC0}); // test eax, eax
+    patchJump(as, emitJump(as, X86_JNE), as->exit);
+}
+
+static void loadSlot(Assembler* as, int reg, int slot) {
+    emitMemory(as, X86_LOAD, RDX, FRAME_REG, offsetof(CallFrame, slots));
+    emitMemory(as, X86_LOAD, reg, RDX, slot * (int)sizeof(Value));
+}
+
+// Stores reg into a slot, rdx must still hold frame->slots.
+static void storeSlot(Assembler* as, int reg, int slot) {
+    emitMemory(as, X86_STORE, reg, RDX, slot * (int)sizeof(Value));
+}
+
+// Pushes rax, clobbers rcx.
+static void pushRax(Assembler* as) {
+    emitMemory(as, X86_LOAD, RCX, STACK_TOP_REG, 0);
+    emitMemory(as, X86_STORE, RAX, RCX, 0);
+    emitAdjustStackTop(as, sizeof(Value));
+}
+
+// The two jumps of a number check, both lead to the slow path.
+typedef struct {
+    int first;
+    int second;
+} Guard;
+
+// Jumps away unless both registers hold numbers, see patchGuard().
+static Guard guardNumbers(Assembler* as, int a, int b) {
+    emitMoveImmediate(as, RSI, QNAN);
+    emitRegisters(as, X86_STORE, RDI, a);
+    emitRegisters(as, X86_AND, RDI, RSI);
+    emitRegisters(as, X86_CMP, RDI, RSI);
+    int first = emitJump(as, X86_JE);
+    emitRegisters(as, X86_STORE, RDI, b);
+    emitRegisters(as, X86_AND, RDI, RSI);
+    emitRegisters(as, X86_CMP, RDI, RSI);
+    int second = emitJump(as, X86_JE);
+    return (Guard){first, second};
+}
+
+static void patchGuard(Assembler* as, Guard guard, int target) {
+    patchJump(as, guard.first, target);
+    patchJump(as, guard.second, target);
+}
+
+// Computes xmm0 = rax op rdx into rax. A comparison leaves a bool Value.
+static void emitArithmetic(Assembler* as, OpCode op) {
+    emitToXmm(as, 0, RAX);
+    emitToXmm(as, 1, RDX);
+    switch (op) {
+        case OP_ADD: emitSse(as, SSE_ADD); break;
+        case OP_SUBTRACT: emitSse(as, SSE_SUB); break;
+        case OP_MULTIPLY: emitSse(as, SSE_MUL); break;
+        case OP_DIVIDE: emitSse(as, SSE_DIV); break;
+        case OP_GREATER:
+        case OP_LESS:
+            // ucomisd sets 'above' only for ordered operands, so NaN
+            // compares false like in C. a < b is tested as b > a.
+            emitBytes(as, 4, (uint8_t[]){0x66, 0x0F, 0x2E,
+                                         op == OP_GREATER ? 0xC1 : 0xC8});
+            emitBytes(as, 3, (uint8_t[]){0x0F, 0x97, 0xC0}); // seta al
+            emitBytes(as, 3, (uint8_t[]){0x0F, 0xB6, 0xC0}); // movzx eax, al
+            emitMoveImmediate(as, RDX, FALSE_VAL);
+            emitRegisters(as, X86_ADD, RAX, RDX); // false + 1 is true.
+            return;
+        default: break;
+    }
+    emitFromXmm(as, RAX, 0);
+}
+
+// Binary stack instruction with an inline path for two numbers.
+static void emitBinary(Assembler* as, OpCode op, JitHelper helper, uint8_t* ip) {
+    emitMemory(as, X86_LOAD, RCX, STACK_TOP_REG, 0);
+    emitMemory(as, X86_LOAD, RAX, RCX, -2 * (int)sizeof(Value));
+    emitMemory(as, X86_LOAD, RDX, RCX, -1 * (int)sizeof(Value));
+    Guard guard = guardNumbers(as, RAX, RDX);
+    emitArithmetic(as, op);
+    emitMemory(as, X86_STORE, RAX, RCX, -2 * (int)sizeof(Value));
+    emitAdjustStackTop(as, -(int)sizeof(Value));
+    int done = emitJump(as, 0);
+    patchGuard(as, guard, as->count);
+    emitHelper(as, helper, ip);
+    patchJump(as, done, as->count);
+}
+
+// Loads a register instruction operand, numbers in the constant table are
+// inlined. Returns false for other constants.
+static bool loadOperand(Assembler* as, Chunk* chunk, int reg, bool constant,
+                        uint8_t index) {
+    if (!constant) {
+        loadSlot(as, reg, index);
+        return true;
+    }
+    Value value = chunk->constants.values[index];
+    if (!IS_NUMBER(value)) return false;
+    emitMoveImmediate(as, reg, value);
+    return true;
+}
+
+static void emitRegisterOp(Assembler* as, Chunk* chunk, int offset) {
+    uint8_t* code = &chunk->code[offset];
+    static const OpCode ops[] = {OP_ADD, OP_SUBTRACT, OP_MULTIPLY, OP_DIVIDE};
+    int form = (code[0] - OP_ADD_RR) % 3;
+    // rcx holds the second operand here, rdx is taken by frame->slots.
+    if (!loadOperand(as, chunk, RCX, form == 1, code[3]) ||
+        !loadOperand(as, chunk, RAX, form == 2, code[2])) {
+        emitHelper(as, helperRegisterOp, code + 1);
+        return;
+    }
+    Guard guard = guardNumbers(as, RAX, RCX);
+    emitRegisters(as, X86_STORE, RDX, RCX);
+    emitArithmetic(as, ops[(code[0] - OP_ADD_RR) / 3]);
+    emitMemory(as, X86_LOAD, RDX, FRAME_REG, offsetof(CallFrame, slots));
+    storeSlot(as, RAX, code[1]);
+    int done = emitJump(as, 0);
+    patchGuard(as, guard, as->count);
+    emitHelper(as, helperRegisterOp, code + 1);
+    patchJump(as, done, as->count);
+}
+
+// Jumps to the bytecode target if the value on top of the stack is falsey.
+static void emitJumpIfFalse(Assembler* as, int target) {
+    emitMemory(as, X86_LOAD, RCX, STACK_TOP_REG, 0);
+    emitMemory(as, X86_LOAD, RAX, RCX, -(int)sizeof(Value));
+    emitMoveImmediate(as, RDX, NIL_VAL);
+    emitRegisters(as, X86_CMP, RAX, RDX);
+    emitJumpTo(as, X86_JE, target);
+    emitMoveImmediate(as, RDX, FALSE_VAL);
+    emitRegisters(as, X86_CMP, RAX, RDX);
+    emitJumpTo(as, X86_JE, target);
+}
+
+// Property get or set. If the inline cache already knows a field, the
+// template checks the receiver against the cache's first shape and accesses
+// the slot directly. The first entry never changes once it's filled in, but
+// its shape is still loaded at runtime rather than baked into the code.
+static void emitProperty(Assembler* as, Chunk* chunk, int offset,
+                         JitHelper helper) {
+    uint8_t* code = &chunk->code[offset];
+    bool isGet = helper == helperGetProperty;
+    InlineCache* cache = &chunk->caches[(code[2] << 8) | code[3]];
+    CacheEntry* entry = &cache->entries[0];
+    if (cache->count == 0 || entry->slot < 0 ||
+        (!isGet && entry->transition != NULL)) {
+        emitHelper(as, helper, code + 1);
+        return;
+    }
+
+    int receiver = isGet ? -1 : -2;
+    emitMemory(as, X86_LOAD, RCX, STACK_TOP_REG, 0);
+    emitMemory(as, X86_LOAD, RAX, RCX, receiver * (int)sizeof(Value));
+    // Is it an instance?
+    emitMoveImmediate(as, RDX, QNAN | SIGN_BIT);
+    emitRegisters(as, X86_STORE, RSI, RAX);
+    emitRegisters(as, X86_AND, RSI, RDX);
+    emitRegisters(as, X86_CMP, RSI, RDX);
+    int notObject = emitJump(as, X86_JNE);
+    emitMoveImmediate(as, RDX, ~(QNAN | SIGN_BIT));
+    emitRegisters(as, X86_AND, RAX, RDX);
+    // cmp byte [rax + type], OBJ_INSTANCE
+    emitBytes(as, 2, (uint8_t[]){0x80, 0xB8});
+    emit32(as, offsetof(Obj, type));
+    emitByte(as, OBJ_INSTANCE);
+    int notInstance = emitJump(as, X86_JNE);
+    // Does it have the cached shape?
+    emitMoveImmediate(as, RDX, (uint64_t)(uintptr_t)&entry->shape);
+    emitMemory(as, X86_LOAD, RDX, RDX, 0);
+    emitMemory(as, X86_CMP, RDX, RAX, offsetof(ObjInstance, shape));
+    int otherShape = emitJump(as, X86_JNE);
+    int barrier = -1;
+    int marking = -1;
+    if (!isGet) {
+#ifdef CONCURRENT_GC
+        // The overwritten value has to be logged while the marker runs.
+        emitMoveImmediate(as, RSI, (uint64_t)(uintptr_t)&vm.gcPhase);
+        emitBytes(as, 3, (uint8_t[]){0x83, 0x3E, GC_MARKING}); // cmp dword [rsi], GC_MARKING
+        marking = emitJump(as, X86_JE);
+#endif
+        // Storing an object into an old instance needs the write barrier,
+        // the helper takes care of that.
+        emitMemory(as, X86_LOAD, RDX, RCX, -(int)sizeof(Value));
+        emitMoveImmediate(as, RSI, QNAN | SIGN_BIT);
+        emitRegisters(as, X86_STORE, RDI, RDX);
+        emitRegisters(as, X86_AND, RDI, RSI);
+        emitRegisters(as, X86_CMP, RDI, RSI);
+        int notObjectValue = emitJump(as, X86_JNE);
+        // Is the instance marked? Its bit in the page's mark bitmap is
+        // granule number (rax - page).
+        emitMoveImmediate(as, RSI, ~(uint64_t)(HEAP_PAGE_SIZE - 1));
+        emitRegisters(as, X86_AND, RSI, RAX);
+        emitRegisters(as, X86_STORE, RDI, RAX);
+        emitRegisters(as, X86_SUB, RDI, RSI);
+        // shr rdi, 3, granules are 8 bytes.
+        emitBytes(as, 4, (uint8_t[]){0x48, 0xC1, 0xEF, 0x03});
+        // bt [rsi + marks], rdi
+        emitBytes(as, 4, (uint8_t[]){0x48, 0x0F, 0xA3, 0xBE});
+        emit32(as, HEAP_PAGE_HEADER + HEAP_MARKS * HEAP_BITMAP_WORDS * 8);
+        barrier = emitJump(as, X86_JB);
+        patchJump(as, notObjectValue, as->count);
+    }
+
+    emitMemory(as, X86_LOAD, RAX, RAX, offsetof(ObjInstance, slots));
+    if (isGet) {
+        emitMemory(as, X86_LOAD, RDX, RAX, entry->slot * (int)sizeof(Value));
+        emitMemory(as, X86_STORE, RDX, RCX, -(int)sizeof(Value));
+    } else {
+        // The assigned value replaces the instance on the stack.
+        emitMemory(as, X86_LOAD, RDX, RCX, -(int)sizeof(Value));
+        emitMemory(as, X86_STORE, RDX, RAX, entry->slot * (int)sizeof(Value));
+        emitMemory(as, X86_STORE, RDX, RCX, -2 * (int)sizeof(Value));
+        emitAdjustStackTop(as, -(int)sizeof(Value));
+    }
+    emitMoveImmediate(as, RDX, (uint64_t)(uintptr_t)&vm.cacheHits);
+    emitBytes(as, 3, (uint8_t[]){0x48, 0xFF, 0x02}); // inc qword [rdx]
+    int done = emitJump(as, 0);
+
+    patchJump(as, notObject, as->count);
+    patchJump(as, notInstance, as->count);
+    patchJump(as, otherShape, as->count);
+    if (barrier >= 0) patchJump(as, barrier, as->count);
+    if (marking >= 0) patchJump(as, marking, as->count);
+    emitHelper(as, helper, code + 1);
+    patchJump(as, done, as->count);
+}
+
+// Returns to the caller's frame inline when no upvalues need closing.
+static void emitReturn(Assembler* as, uint8_t* ip) {
+    // Any open upvalue at or above frame->slots goes to the helper.
+    emitMoveImmediate(as, RDX, (uint64_t)(uintptr_t)&vm.openUpvalues);
+    emitMemory(as, X86_LOAD, RDX, RDX, 0);
+    emitMemory(as, X86_LOAD, RSI, FRAME_REG, offsetof(CallFrame, slots));
+    emitRegisters(as, X86_TEST, RDX, RDX);
+    int noUpvalues = emitJump(as, X86_JE);
+    emitMemory(as, X86_LOAD, RDX, RDX, offsetof(ObjUpvalue, location));
+    emitRegisters(as, X86_CMP, RDX, RSI);
+    int closeUpvalues = emitJump(as, X86_JAE);
+    patchJump(as, noUpvalues, as->count);
+
+    // Returning from the script itself is also left to the helper.
+    emitMoveImmediate(as, RDX, (uint64_t)(uintptr_t)&vm.frameCount);
+    emitBytes(as, 3, (uint8_t[]){0x83, 0x3A, 0x01}); // cmp dword [rdx], 1
+    int lastFrame = emitJump(as, X86_JE);
+    emitBytes(as, 2, (uint8_t[]){0xFF, 0x0A}); // dec dword [rdx]
+
+    // The result replaces the callee and its arguments.
+    emitMemory(as, X86_LOAD, RCX, STACK_TOP_REG, 0);
+    emitMemory(as, X86_LOAD, RAX, RCX, -(int)sizeof(Value));
+    emitMemory(as, X86_STORE, RAX, RSI, 0);
+    emitMemory(as, X86_LEA, RSI, RSI, sizeof(Value));
+    emitMemory(as, X86_STORE, RSI, STACK_TOP_REG, 0);
+    emitByte(as, 0xB8); // mov eax, JIT_FRAME
+    emit32(as, JIT_FRAME);
+    patchJump(as, emitJump(as, 0), as->exit);
+
+    patchJump(as, closeUpvalues, as->count);
+    patchJump(as, lastFrame, as->count);
+    emitHelper(as, helperReturn, ip);
+}
+
+// Length of the instruction at offset including operands, or 0 if the
+// JIT doesn't handle it.
+static int instructionLength(Chunk* chunk, int offset) {
+    switch (chunk->code[offset]) {
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_POP:
+        case OP_PRINT:
+        case OP_CLOSE_UPVALUE:
+        case OP_RETURN:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+        case OP_EQUAL_NUM:
+        case OP_EQUAL_STR:
+            return 1;
+        case OP_CONSTANT:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_CALL:
+        case OP_SET_LOCAL_POP:
+        case OP_CALL_CLOSURE:
+        case OP_CALL_NATIVE:
+        case OP_CALL_CLASS:
+            return 2;
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP:
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_LOCAL_GET_LOCAL:
+        case OP_ADD_LOCAL_CONST:
+        case OP_LESS_JUMP_IF_FALSE:
+        case OP_MOVE:
+        case OP_LOAD_CONSTANT:
+            return 3;
+        case OP_CONSTANT_LONG:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_GET_PROPERTY_FIELD:
+        case OP_ADD_RR:
+        case OP_ADD_RK:
+        case OP_ADD_KR:
+        case OP_SUBTRACT_RR:
+        case OP_SUBTRACT_RK:
+        case OP_SUBTRACT_KR:
+        case OP_MULTIPLY_RR:
+        case OP_MULTIPLY_RK:
+        case OP_MULTIPLY_KR:
+        case OP_DIVIDE_RR:
+        case OP_DIVIDE_RK:
+        case OP_DIVIDE_KR:
+            return 4;
+        case OP_LOOP:
+        case OP_INVOKE:
+            return 5;
+        case OP_CLOSURE: {
+            ObjFunction* function =
+                AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+            return 2 + 2 * function->upvalueCount;
+        }
+        default:
+            // Class declarations only run once, they stay interpreted.
+            return 0;
+    }
+}
+
+static void emitInstruction(Assembler* as, Chunk* chunk, int offset) {
+    uint8_t* code = &chunk->code[offset];
+    uint8_t* operands = code + 1;
+    // Quickened instructions are compiled like their generic form, the
+    // templates do their own type checks.
+    switch (code[0]) {
+        case OP_CONSTANT: {
+            Value value = chunk->constants.values[code[1]];
+            // Numbers can be baked in, objects are loaded from the chunk.
+            if (IS_NUMBER(value)) {
+                emitMoveImmediate(as, RAX, value);
+                pushRax(as);
+            } else {
+                emitHelper(as, helperConstant, operands);
+            }
+            break;
+        }
+        case OP_CONSTANT_LONG: emitHelper(as, helperConstantLong, operands); break;
+        case OP_NIL: emitMoveImmediate(as, RAX, NIL_VAL); pushRax(as); break;
+        case OP_TRUE: emitMoveImmediate(as, RAX, TRUE_VAL); pushRax(as); break;
+        case OP_FALSE: emitMoveImmediate(as, RAX, FALSE_VAL); pushRax(as); break;
+        case OP_POP: emitAdjustStackTop(as, -(int)sizeof(Value)); break;
+        case OP_GET_LOCAL:
+            loadSlot(as, RAX, code[1]);
+            pushRax(as);
+            break;
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_POP:
+            emitMemory(as, X86_LOAD, RCX, STACK_TOP_REG, 0);
+            emitMemory(as, X86_LOAD, RAX, RCX, -(int)sizeof(Value));
+            emitMemory(as, X86_LOAD, RDX, FRAME_REG, offsetof(CallFrame, slots));
+            storeSlot(as, RAX, code[1]);
+            if (code[0] == OP_SET_LOCAL_POP) {
+                emitAdjustStackTop(as, -(int)sizeof(Value));
+            }
+            break;
+        case OP_GET_LOCAL_GET_LOCAL:
+            loadSlot(as, RAX, code[1]);
+            pushRax(as);
+            loadSlot(as, RAX, code[2]);
+            pushRax(as);
+            break;
+        case OP_GET_UPVALUE: emitHelper(as, helperGetUpvalue, operands); break;
+        case OP_SET_UPVALUE: emitHelper(as, helperSetUpvalue, operands); break;
+        case OP_GET_GLOBAL: {
+            // The values array moves as globals are added, load it each time.
+            int slot = (code[1] << 8) | code[2];
+            emitMoveImmediate(as, RAX, (uint64_t)(uintptr_t)&vm.globalValues.values);
+            emitMemory(as, X86_LOAD, RAX, RAX, 0);
+            emitMemory(as, X86_LOAD, RAX, RAX, slot * (int)sizeof(Value));
+            emitMoveImmediate(as, RDX, UNDEFINED_VAL);
+            emitRegisters(as, X86_CMP, RAX, RDX);
+            int undefined = emitJump(as, X86_JE);
+            pushRax(as);
+            int done = emitJump(as, 0);
+            patchJump(as, undefined, as->count);
+            emitHelper(as, helperGetGlobal, operands);
+            patchJump(as, done, as->count);
+            break;
+        }
+        case OP_DEFINE_GLOBAL: emitHelper(as, helperDefineGlobal, operands); break;
+        case OP_SET_GLOBAL: emitHelper(as, helperSetGlobal, operands); break;
+        case OP_GET_PROPERTY:
+        case OP_GET_PROPERTY_FIELD:
+            emitProperty(as, chunk, offset, helperGetProperty);
+            break;
+        case OP_SET_PROPERTY:
+            emitProperty(as, chunk, offset, helperSetProperty);
+            break;
+        case OP_EQUAL:
+        case OP_EQUAL_NUM:
+        case OP_EQUAL_STR:
+            emitHelper(as, helperEqual, operands);
+            break;
+        case OP_GREATER: emitBinary(as, OP_GREATER, helperGreater, operands); break;
+        case OP_LESS: emitBinary(as, OP_LESS, helperLess, operands); break;
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+            emitBinary(as, OP_ADD, helperAdd, operands);
+            break;
+        case OP_SUBTRACT: emitBinary(as, OP_SUBTRACT, helperSubtract, operands); break;
+        case OP_MULTIPLY: emitBinary(as, OP_MULTIPLY, helperMultiply, operands); break;
+        case OP_DIVIDE: emitBinary(as, OP_DIVIDE, helperDivide, operands); break;
+        case OP_NOT: emitHelper(as, helperNot, operands); break;
+        case OP_NEGATE: emitHelper(as, helperNegate, operands); break;
+        case OP_PRINT: emitHelper(as, helperPrint, operands); break;
+        case OP_JUMP_IF_FALSE:
+            emitJumpIfFalse(as, offset + 3 + ((code[1] << 8) | code[2]));
+            break;
+        case OP_JUMP:
+            emitJumpTo(as, 0, offset + 3 + ((code[1] << 8) | code[2]));
+            break;
+        case OP_LOOP:
+            emitJumpTo(as, 0, offset + 5 - ((code[1] << 8) | code[2]));
+            break;
+        case OP_LESS_JUMP_IF_FALSE:
+            // The slow path only ever reports the type error.
+            emitBinary(as, OP_LESS, helperLess, operands);
+            emitJumpIfFalse(as, offset + 3 + ((code[1] << 8) | code[2]));
+            break;
+        case OP_CALL:
+        case OP_CALL_CLOSURE:
+        case OP_CALL_NATIVE:
+        case OP_CALL_CLASS:
+            emitHelper(as, helperCall, operands);
+            break;
+        case OP_INVOKE: emitHelper(as, helperInvoke, operands); break;
+        case OP_CLOSURE: emitHelper(as, helperClosure, operands); break;
+        case OP_CLOSE_UPVALUE: emitHelper(as, helperCloseUpvalue, operands); break;
+        case OP_RETURN: emitReturn(as, operands); break;
+        case OP_ADD_LOCAL_CONST: {
+            Value constant = chunk->constants.values[code[2]];
+            if (!IS_NUMBER(constant)) {
+                emitHelper(as, helperAddLocalConst, operands);
+                break;
+            }
+            loadSlot(as, RAX, code[1]);
+            emitMoveImmediate(as, RDX, constant);
+            Guard guard = guardNumbers(as, RAX, RDX);
+            emitArithmetic(as, OP_ADD);
+            pushRax(as);
+            int done = emitJump(as, 0);
+            patchGuard(as, guard, as->count);
+            emitHelper(as, helperAddLocalConst, operands);
+            patchJump(as, done, as->count);
+            break;
+        }
+        case OP_MOVE:
+            loadSlot(as, RAX, code[2]);
+            storeSlot(as, RAX, code[1]);
+            break;
+        case OP_LOAD_CONSTANT: {
+            Value value = chunk->constants.values[code[2]];
+            if (!IS_NUMBER(value)) {
+                emitHelper(as, helperLoadConstant, operands);
+                break;
+            }
+            emitMoveImmediate(as, RAX, value);
+            emitMemory(as, X86_LOAD, RDX, FRAME_REG, offsetof(CallFrame, slots));
+            storeSlot(as, RAX, code[1]);
+            break;
+        }
+        default:
+            emitRegisterOp(as, chunk, offset);
+            break;
+    }
+}
+
+bool jitCompile(ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+    for (int offset = 0; offset < chunk->count;) {
+        int length = instructionLength(chunk, offset);
+        if (length == 0) return false;
+        offset += length;
+    }
+
+    Assembler as = {0};
+    uint32_t* entries = malloc(sizeof(uint32_t) * chunk->count);
+    if (entries == NULL) exit(1);
+
+    // Entry stub: jitRun() calls it with the frame and the address to start at.
+    emitByte(&as, 0x53); // push rbx
+    emitBytes(&as, 2, (uint8_t[]){0x41, 0x54}); // push r12
+    emitByte(&as, 0x55); // push rbp, keeps the stack 16 byte aligned for calls.
+    emitRegisters(&as, X86_STORE, FRAME_REG, RDI);
+    emitMoveImmediate(&as, STACK_TOP_REG, (uint64_t)(uintptr_t)&vm.stackTop);
+    emitBytes(&as, 2, (uint8_t[]){0xFF, 0xE6}); // jmp rsi
+
+    // Exit stub, the status is already in eax.
+    as.exit = as.count;
+    emitByte(&as, 0x5D); // pop rbp
+    emitBytes(&as, 2, (uint8_t[]){0x41, 0x5C}); // pop r12
+    emitByte(&as, 0x5B); // pop rbx
+    emitByte(&as, 0xC3); // ret
+
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        entries[offset] = as.count;
+        emitInstruction(&as, chunk, offset);
+    }
+    patchLabels(&as, entries);
+
+    size_t size;
+    uint8_t* code = finishAssembler(&as, &size);
+    freeAssembler(&as);
+    if (code == NULL) {
+        free(entries);
+        return false;
+    }
+
+    JitCode* jit = malloc(sizeof(JitCode));
+    if (jit == NULL) exit(1);
+    jit->code = code;
+    jit->size = size;
+    jit->entries = entries;
+    function->jit = jit;
+    return true;
+}
+
+JitStatus jitRun(CallFrame* frame) {
+    ObjFunction* function = frame->closure->function;
+    JitEntry entry = (JitEntry)(void*)function->jit->code;
+    int offset = (int)(frame->ip - function->chunk.code);
+    return entry(frame, function->jit->code + function->jit->entries[offset]);
+}
+
+void jitFree(ObjFunction* function) {
+    if (function->jit == NULL) return;
+    munmap(function->jit->code, function->jit->size);
+    free(function->jit->entries);
+    free(function->jit);
+    function->jit = NULL;
+}
+
+#endif
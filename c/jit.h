@@ -0,0 +1,38 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+#ifdef JIT
+
+// Calls after which a function is compiled to machine code.
+#define JIT_CALL_THRESHOLD 100
+
+// Why native code handed control back to run().
+typedef enum {
+    JIT_CONTINUE, // Only used between native code and its helpers.
+    JIT_FRAME, // A call or return changed the frame on top.
+    JIT_ERROR, // A runtime error has been reported.
+    JIT_DONE, // The top-level script returned.
+} JitStatus;
+
+typedef struct JitCode {
+    uint8_t* code; // Executable mapping, starts with the entry stub.
+    size_t size;
+    // Native offset for each bytecode offset that starts an instruction, so
+    // frames can be resumed wherever the interpreter left them.
+    uint32_t* entries;
+} JitCode;
+
+// Compiles the function's chunk. Returns false if the chunk uses an
+// instruction the JIT doesn't support, the function stays interpreted then.
+bool jitCompile(ObjFunction* function);
+// Runs the compiled code of the frame on top, starting at frame->ip.
+JitStatus jitRun(CallFrame* frame);
+void jitFree(ObjFunction* function);
+
+#endif
+
+#endif
@@ -6,8 +6,26 @@
 #include "common.h"
 #include "chunk.h"
 #include "debug.h"
+#include "memory.h"
+#include "snapshot.h"
+#include "telemetry.h"
 #include "vm.h"
 
+// Flags that set a field of vm.gcConfig, see gcSetParameter(). Sizes may
+// end in K, M or G.
+static const struct {
+    const char* flag;
+    const char* parameter;
+} gcFlags[] = {
+    {"--gc-initial-heap=", "initialHeap"},
+    {"--gc-grow-factor=", "growFactor"},
+    {"--gc-max-heap=", "maxHeap"},
+    {"--gc-min-interval=", "minInterval"},
+};
+
+#define TELEMETRY_FLAG "--gc-telemetry="
+#define SNAPSHOT_FLAG "--heap-snapshot="
+
 static void repl() {
     char line[1024];
     for (;;) {
@@ -54,29 +72,95 @@ static char* readFile(const char* path) {
     return buffer;
 }
 
-static void runFile(const char* path) {
+// Returns the exit status.
+static int runFile(const char* path) {
     char* source = readFile(path);
     InterpretResult result = interpret(source);
     // readfile allocates memory and passes freeing it to us.
     free(source);
 
-    if (result == INTERPRET_COMPILE_ERROR) exit(65);
-    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+    if (result == INTERPRET_COMPILE_ERROR) return 65;
+    if (result == INTERPRET_RUNTIME_ERROR) return 70;
+    return 0;
+}
+
+static void usage() {
+    fprintf(stderr,
+        "Usage: clox [options] [path]\n"
+        "  --gc-initial-heap=BYTES  first full collection at this heap size\n"
+        "  --gc-grow-factor=N       next one at the heap left times this\n"
+        "  --gc-max-heap=BYTES      run out of memory past this\n"
+        "  --gc-min-interval=BYTES  allocate this much between full collections\n"
+        "  --gc-telemetry=FILE      write collector telemetry as JSON at exit,\n"
+        "                           - for stderr\n"
+        "  --heap-snapshot=FILE     write the object graph at exit, see\n"
+        "                           tools/heapdom.c\n");
+    exit(64);
 }
 
+static bool parseGcFlag(const char* arg) {
+    for (size_t i = 0; i < sizeof(gcFlags) / sizeof(gcFlags[0]); i++) {
+        size_t length = strlen(gcFlags[i].flag);
+        if (strncmp(arg, gcFlags[i].flag, length) != 0) continue;
+
+        char* end;
+        double value = strtod(arg + length, &end);
+        if (end == arg + length) return false;
+        switch (*end) {
+            case 'K': value *= 1024; end++; break;
+            case 'M': value *= 1024 * 1024; end++; break;
+            case 'G': value *= 1024 * 1024 * 1024; end++; break;
+        }
+        if (*end != '\0') return false;
+        return gcSetParameter(gcFlags[i].parameter, value);
+    }
+    return false;
+}
+
+static void writeTelemetry(const char* path) {
+    if (strcmp(path, "-") == 0) {
+        gcWriteTelemetry(stderr);
+        return;
+    }
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        return;
+    }
+    gcWriteTelemetry(file);
+    fclose(file);
+}
 
 int main(int argc, const char* argv[]) {
     initVM();
 
-    if (argc == 1) {
+    const char* path = NULL;
+    const char* telemetryPath = NULL;
+    const char* snapshotPath = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--", 2) != 0) {
+            if (path != NULL) usage();
+            path = argv[i];
+        } else if (strncmp(argv[i], TELEMETRY_FLAG, strlen(TELEMETRY_FLAG)) == 0) {
+            telemetryPath = argv[i] + strlen(TELEMETRY_FLAG);
+        } else if (strncmp(argv[i], SNAPSHOT_FLAG, strlen(SNAPSHOT_FLAG)) == 0) {
+            snapshotPath = argv[i] + strlen(SNAPSHOT_FLAG);
+        } else if (!parseGcFlag(argv[i])) {
+            usage();
+        }
+    }
+
+    int status = 0;
+    if (path == NULL) {
         repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        status = runFile(path);
     }
-    
+    if (telemetryPath != NULL) writeTelemetry(telemetryPath);
+    if (snapshotPath != NULL && !writeHeapSnapshot(snapshotPath)) {
+        fprintf(stderr, "Could not write file \"%s\".\n", snapshotPath);
+    }
+
     freeVM();
-    return 0;
+    return status;
 }
@@ -0,0 +1,227 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mark.h"
+#include "memory.h"
+#include "vm.h"
+
+#ifdef PARALLEL_MARK
+
+typedef struct {
+    int64_t capacity; // Power of two.
+    Obj* objects[];
+} DequeBuffer;
+
+// Aligned so two workers' indices never share a cache line.
+struct GrayDeque {
+    int64_t top; // Thieves take from here.
+    int64_t bottom; // The owner pushes and pops here.
+    DequeBuffer* buffer;
+    // Buffers outgrown during this mark. Thieves may still be reading them.
+    DequeBuffer** retired;
+    int retiredCount;
+    int retiredCapacity;
+} __attribute__((aligned(64)));
+
+_Thread_local GrayDeque* markDeque = NULL;
+
+// State of the mark under way.
+static struct {
+    GrayDeque* deques;
+    int count;
+    int idle; // Workers that found no work anywhere.
+} pool;
+
+static DequeBuffer* newBuffer(int64_t capacity) {
+    DequeBuffer* buffer = malloc(sizeof(DequeBuffer) + sizeof(Obj*) * capacity);
+    if (buffer == NULL) exit(1);
+    buffer->capacity = capacity;
+    return buffer;
+}
+
+static DequeBuffer* growDeque(GrayDeque* deque, DequeBuffer* buffer,
+                              int64_t top, int64_t bottom) {
+    DequeBuffer* grown = newBuffer(buffer->capacity * 2);
+    for (int64_t i = top; i < bottom; i++) {
+        grown->objects[i & (grown->capacity - 1)] =
+            buffer->objects[i & (buffer->capacity - 1)];
+    }
+
+    if (deque->retiredCapacity < deque->retiredCount + 1) {
+        deque->retiredCapacity = GROW_CAPACITY(deque->retiredCapacity);
+        deque->retired = realloc(deque->retired,
+                                 sizeof(DequeBuffer*) * deque->retiredCapacity);
+        if (deque->retired == NULL) exit(1);
+    }
+    deque->retired[deque->retiredCount++] = buffer;
+    __atomic_store_n(&deque->buffer, grown, __ATOMIC_RELEASE);
+    return grown;
+}
+
+void grayDequePush(GrayDeque* deque, Obj* object) {
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    DequeBuffer* buffer = deque->buffer;
+    if (bottom - top >= buffer->capacity) {
+        buffer = growDeque(deque, buffer, top, bottom);
+    }
+    __atomic_store_n(&buffer->objects[bottom & (buffer->capacity - 1)], object,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+}
+
+// Takes the object pushed last, NULL if the deque is empty. Only the owner
+// pops.
+static Obj* grayDequePop(GrayDeque* deque) {
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    DequeBuffer* buffer = deque->buffer;
+    __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+    if (top > bottom) {
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    Obj* object = __atomic_load_n(&buffer->objects[bottom & (buffer->capacity - 1)],
+                                  __ATOMIC_RELAXED);
+    if (top == bottom) {
+        // The last one, a thief may be after it too.
+        if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            object = NULL;
+        }
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+    return object;
+}
+
+// Takes the oldest object. Returns NULL if the deque is empty or another
+// thief won the race, sets *lost in the latter case.
+static Obj* grayDequeSteal(GrayDeque* deque, bool* lost) {
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+    if (top >= bottom) return NULL;
+
+    DequeBuffer* buffer = __atomic_load_n(&deque->buffer, __ATOMIC_ACQUIRE);
+    Obj* object = __atomic_load_n(&buffer->objects[top & (buffer->capacity - 1)],
+                                  __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        *lost = true;
+        return NULL;
+    }
+    return object;
+}
+
+static Obj* stealWork(int self) {
+    for (;;) {
+        bool lost = false;
+        for (int i = 1; i < pool.count; i++) {
+            Obj* object = grayDequeSteal(&pool.deques[(self + i) % pool.count], &lost);
+            if (object != NULL) return object;
+        }
+        // Only give up once every deque looked empty.
+        if (!lost) return NULL;
+    }
+}
+
+static bool workLeft(int self) {
+    for (int i = 1; i < pool.count; i++) {
+        GrayDeque* deque = &pool.deques[(self + i) % pool.count];
+        if (__atomic_load_n(&deque->top, __ATOMIC_ACQUIRE) <
+            __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void runWorker(int self) {
+    markDeque = &pool.deques[self];
+    for (;;) {
+        Obj* object;
+        while ((object = grayDequePop(markDeque)) != NULL) {
+            blackenObject(object);
+        }
+        object = stealWork(self);
+        if (object != NULL) {
+            blackenObject(object);
+            continue;
+        }
+
+        // A worker only goes idle with an empty deque and nothing in hand,
+        // and nobody else pushes onto its deque. Once all of them are idle
+        // there is no gray object left anywhere.
+        __atomic_add_fetch(&pool.idle, 1, __ATOMIC_SEQ_CST);
+        for (;;) {
+            if (__atomic_load_n(&pool.idle, __ATOMIC_SEQ_CST) == pool.count) {
+                markDeque = NULL;
+                return;
+            }
+            if (workLeft(self)) {
+                __atomic_sub_fetch(&pool.idle, 1, __ATOMIC_SEQ_CST);
+                break;
+            }
+            sched_yield();
+        }
+    }
+}
+
+static void* workerThread(void* self) {
+    runWorker((int)(intptr_t)self);
+    return NULL;
+}
+
+void markInParallel() {
+    pool.count = vm.gcThreads;
+    pool.idle = 0;
+    pool.deques = calloc(pool.count, sizeof(GrayDeque));
+    if (pool.deques == NULL) exit(1);
+    for (int i = 0; i < pool.count; i++) {
+        pool.deques[i].buffer = newBuffer(1024);
+    }
+
+    // Deal out what's gray so far.
+    for (int i = 0; i < vm.grayCount; i++) {
+        grayDequePush(&pool.deques[i % pool.count], vm.grayStack[i]);
+    }
+    vm.grayCount = 0;
+
+    pthread_t* threads = malloc(sizeof(pthread_t) * pool.count);
+    if (threads == NULL) exit(1);
+    for (int i = 1; i < pool.count; i++) {
+        if (pthread_create(&threads[i], NULL, workerThread,
+                           (void*)(intptr_t)i) != 0) {
+            fprintf(stderr, "Could not start a marker thread.\n");
+            exit(1);
+        }
+    }
+    runWorker(0);
+    for (int i = 1; i < pool.count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    for (int i = 0; i < pool.count; i++) {
+        GrayDeque* deque = &pool.deques[i];
+        for (int j = 0; j < deque->retiredCount; j++) free(deque->retired[j]);
+        free(deque->retired);
+        free(deque->buffer);
+    }
+    free(pool.deques);
+    pool.deques = NULL;
+}
+
+int defaultMarkThreads() {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 1 ? (int)cores : 1;
+}
+
+#endif
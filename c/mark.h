@@ -0,0 +1,30 @@
+#ifndef clox_mark_h
+#define clox_mark_h
+
+#include "common.h"
+#include "object.h"
+
+#ifdef PARALLEL_MARK
+
+// Objects one worker blackens before marking goes parallel. Smaller marks
+// aren't worth starting threads for.
+#define PARALLEL_MARK_THRESHOLD 10000
+
+// A worker's gray objects. The worker pushes and pops at the bottom, idle
+// workers steal from the top (Chase-Lev).
+typedef struct GrayDeque GrayDeque;
+
+// The deque of the worker running on this thread, NULL outside a parallel
+// mark. markObject() pushes onto it.
+extern _Thread_local GrayDeque* markDeque;
+
+void grayDequePush(GrayDeque* deque, Obj* object);
+// Drains vm.grayStack and everything reachable from it with vm.gcThreads
+// workers, the calling thread being one of them.
+void markInParallel();
+// One worker per core.
+int defaultMarkThreads();
+
+#endif
+
+#endif
@@ -1,8 +1,16 @@
+#include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 
+#include "compact.h"
 #include "compiler.h"
+#include "jit.h"
+#include "mark.h"
 #include "memory.h"
+#include "trace.h"
 #include "vm.h"
 
 #ifdef DEBUG_LOG_GC
@@ -10,48 +18,90 @@
 #include "debug.h"
 #endif
 
-#define GC_HEAP_GROW_FACTOR 2
+static void gcPoll();
+static void gcSlice(int work);
+static void startCycle();
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+#ifdef CONCURRENT_GC
+static void deferFree(void* pointer, size_t size) {
+    if (vm.deferredCapacity < vm.deferredCount + 1) {
+        vm.deferredCapacity = GROW_CAPACITY(vm.deferredCapacity);
+        vm.deferredFrees = realloc(vm.deferredFrees,
+                                   sizeof(DeferredFree) * vm.deferredCapacity);
+        if (vm.deferredFrees == NULL) exit(1);
+    }
+    vm.deferredFrees[vm.deferredCount++] = (DeferredFree){pointer, size};
+}
+#endif
+
+// Counts the bytes and does the collection work growing the heap made due.
+static void countAllocation(size_t oldSize, size_t newSize) {
     vm.bytesAllocated += newSize - oldSize;
     if (newSize > oldSize) {
 #ifdef DEBUG_STRESS_GC
-        collectGarbage();
+        // Minor collections promote everything reachable right away, which
+        // shakes out missing write barriers. Full collections run as tiny
+        // slices so the mutator keeps running in between them.
+        static int stressCount = 0;
+        stressCount++;
+        if (stressCount % 256 == 0) {
+            collectGarbage();
+        } else if (vm.gcPhase == GC_IDLE && stressCount % 64 == 0) {
+            startCycle();
+        } else if (vm.gcPhase != GC_IDLE) {
+            gcSlice(4);
+        }
+        if (vm.gcPhase != GC_MARKING) collectYoung();
+#ifdef COMPACTING_GC
+        if (stressCount % 1024 == 0) vm.compactPending = true;
+#endif
 #endif
 
-        // Trigger GC when threshold is reached.
-        if (vm.bytesAllocated > vm.nextGC) {
-            collectGarbage();
+        if (vm.bytesAllocated > vm.nextGC ||
+            vm.bytesAllocated > vm.nextMinorGC ||
+            vm.bytesAllocated > vm.nextSliceGC) {
+            gcPoll();
         }
     }
+}
 
+void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+    countAllocation(oldSize, newSize);
+
+#ifdef CONCURRENT_GC
+    // The marker may be reading the old block, keep it until the remark.
+    if (vm.gcPhase == GC_MARKING && pointer != NULL) {
+        deferFree(pointer, oldSize);
+        if (newSize == 0) return NULL;
+        void* result = heapAllocate(&vm.heap, newSize);
+        memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+        return result;
+    }
+#endif
     
     if (newSize == 0) {
-        free(pointer);
+        heapFree(&vm.heap, pointer, oldSize);
         return NULL;
     }
     
-    void* result = realloc(pointer, newSize);
-    // Allocating memory failed - maybe no free memory?
-    if (result == NULL) {
-        fprintf(stderr, "Reallocating failed!\n");
-        exit(1);
-    }
-    return result;
+    return heapReallocate(&vm.heap, pointer, oldSize, newSize);
 }
 
-void markObject(Obj* object) {
-    if (object == NULL) return;
-    if (object->isMarked) return;
+void* allocateObjectMemory(size_t size) {
+    countAllocation(0, size);
+    return heapAllocateObject(&vm.heap, size);
+}
 
-#ifdef DEBUG_LOG_GC
-    printf("%p mark ", (void*)object);
-    printValue(OBJ_VAL(object));
-    printf("\n");
-#endif
+// Objects are only freed by the collector, never while the concurrent
+// marker runs.
+static void freeObjectMemory(Obj* object, size_t size) {
+    vm.bytesAllocated -= size;
+    heapFreeObject(&vm.heap, object, size);
+}
 
-    object->isMarked = true;
+#define FREE_OBJECT(type, object) freeObjectMemory(object, sizeof(type))
 
+static void pushGray(Obj* object) {
     // add pointer to marked object to a list of gray objects. Makes tracing easier.
     if (vm.grayCapacity < vm.grayCount + 1) {
         vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
@@ -63,17 +113,94 @@ void markObject(Obj* object) {
     vm.grayStack[vm.grayCount++] = object;
 }
 
+void gcRemember(Obj* owner) {
+    // While marking, going gray again gets the object rescanned.
+    if (vm.gcPhase == GC_MARKING) {
+#ifndef CONCURRENT_GC
+        pushGray(owner);
+#endif
+        return;
+    }
+
+    if (owner->isRemembered) return;
+    owner->isRemembered = true;
+
+    if (vm.rememberedCapacity < vm.rememberedCount + 1) {
+        vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+        vm.rememberedSet = (Obj**)realloc(vm.rememberedSet,
+                                          sizeof(Obj*) * vm.rememberedCapacity);
+        if (vm.rememberedSet == NULL) exit(1);
+    }
+    vm.rememberedSet[vm.rememberedCount++] = owner;
+}
+
+void gcRecordWrite(Obj* owner, Obj* value) {
+    if (vm.gcPhase == GC_MARKING) {
+        // The concurrent marker owns the gray stack, and the snapshot only
+        // cares about overwritten references anyway.
+#ifndef CONCURRENT_GC
+        markObject(value);
+#endif
+    } else {
+        gcRemember(owner);
+    }
+}
+
+#ifdef CONCURRENT_GC
+void gcRecordOverwrite(Obj* old) {
+    if (IS_MARKED(old)) return;
+
+    if (vm.overwriteCapacity < vm.overwriteCount + 1) {
+        vm.overwriteCapacity = GROW_CAPACITY(vm.overwriteCapacity);
+        vm.overwriteLog = (Obj**)realloc(vm.overwriteLog,
+                                         sizeof(Obj*) * vm.overwriteCapacity);
+        if (vm.overwriteLog == NULL) exit(1);
+    }
+    vm.overwriteLog[vm.overwriteCount++] = old;
+}
+#endif
+
+void markObject(Obj* object) {
+    if (object == NULL) return;
+
+#ifdef PARALLEL_MARK
+    if (markDeque != NULL) {
+        // Workers race for the object, whoever sets the bit traces it.
+        if (IS_MARKED(object) || heapMark(object, true)) return;
+        grayDequePush(markDeque, object);
+        return;
+    }
+#endif
+
+    if (IS_MARKED(object)) return;
+
+#ifdef DEBUG_LOG_GC
+    printf("%p mark ", (void*)object);
+    printValue(OBJ_VAL(object));
+    printf("\n");
+#endif
+
+#ifdef CONCURRENT_GC
+    // The program sets bits in the same words when it allocates black.
+    heapMark(object, true);
+#else
+    heapMark(object, false);
+#endif
+    pushGray(object);
+}
+
 void markValue(Value value) {
     if (IS_OBJ(value)) markObject(AS_OBJ(value));
 }
 
 static void markArray(ValueArray* array) {
-    for (int i = 0; i < array->count; i++) {
+    int count = OBSERVE(array->count);
+    for (int i = 0; i < count; i++) {
         markValue(array->values[i]);
     }
 }
 
-static void blackenObject(Obj* object) {
+void blackenObject(Obj* object) {
 #ifdef DEBUG_LOG_GC
     printf("%p blacken ", (void*)object);
     printValue(OBJ_VAL(object));
@@ -91,6 +218,7 @@ static void blackenObject(Obj* object) {
             ObjClass* klass = (ObjClass*)object;
             markObject((Obj*)klass->name);
             markTable(&klass->methods);
+            markObject((Obj*)klass->rootShape);
             break;
         }
         case OBJ_CLOSURE: {
@@ -106,19 +234,72 @@ static void blackenObject(Obj* object) {
             markObject((Obj*)function->name);
             // mark values in constant table
             markArray(&function->chunk.constants);
+            // Inline caches hold on to the shapes and methods they saw.
+            int cacheCount = OBSERVE(function->chunk.cacheCount);
+            for (int i = 0; i < cacheCount; i++) {
+                InlineCache* cache = &function->chunk.caches[i];
+                int count = OBSERVE(cache->count);
+                for (int j = 0; j < count; j++) {
+                    markObject((Obj*)cache->entries[j].shape);
+                    markObject((Obj*)cache->entries[j].transition);
+                    markValue(cache->entries[j].method);
+                }
+            }
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*)object;
             markObject((Obj*)instance->klass);
-            markTable(&instance->fields);
+            // The shape covers the slots, load it first.
+            ObjShape* shape = OBSERVE(instance->shape);
+            if (shape != NULL) {
+                markObject((Obj*)shape);
+                for (int i = 0; i < shape->slotCount; i++) {
+                    markValue(instance->slots[i]);
+                }
+            }
+            if (instance->dictionary != NULL) markTable(instance->dictionary);
+            break;
+        }
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            markObject((Obj*)shape->parent);
+            markObject((Obj*)shape->name);
+            markTable(&shape->slots);
+            markTable(&shape->transitions);
             break;
         }
+        case OBJ_STRING:
+            switch ((StringForm)((ObjString*)object)->form) {
+                case STRING_FLAT:
+                    break;
+                case STRING_ROPE: {
+                    ObjRope* rope = (ObjRope*)object;
+                    markObject((Obj*)OBSERVE(rope->left));
+                    markObject((Obj*)OBSERVE(rope->right));
+                    break;
+                }
+                case STRING_SLICE: {
+                    ObjSlice* slice = (ObjSlice*)object;
+                    ObjString* parent = OBSERVE(slice->parent);
+                    // Whether a much longer parent is worth keeping for a
+                    // full collection's slices is up to copySlices().
+                    if (vm.gcPhase == GC_MARKING &&
+                        (int64_t)slice->length * SLICE_RETAIN_FACTOR <
+                            parent->length) {
+                        __atomic_store_n(&vm.slicesDeferred, true,
+                                         __ATOMIC_RELAXED);
+                        break;
+                    }
+                    markObject((Obj*)parent);
+                    break;
+                }
+            }
+            break;
         case OBJ_UPVALUE:
             markValue(((ObjUpvalue*)object)->closed);
             break;
         case OBJ_NATIVE:
-        case OBJ_STRING:
             break;
     }
 }
@@ -130,49 +311,77 @@ static void freeObject(Obj* object) {
 
     switch (object->type) {
         case OBJ_BOUND_METHOD: {
-            FREE(ObjBoundMethod, object);
+            FREE_OBJECT(ObjBoundMethod, object);
             // BoundMethod does not own its fields, so they are not freed here.
             break;
         }
         case OBJ_CLASS: {
             ObjClass* klass = (ObjClass*)object;
             freeTable(&klass->methods);
-            FREE(ObjClass, object);
+            FREE_OBJECT(ObjClass, object);
             break;
         }
         case OBJ_CLOSURE: {
             ObjClosure* closure = (ObjClosure*)object;
             FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
             // We only free the object, no the function. The object is first in the struct.
-            FREE(ObjClosure, object);
+            FREE_OBJECT(ObjClosure, object);
             break;
         }
         case OBJ_FUNCTION: {
             ObjFunction* function = (ObjFunction*)object;
+#ifdef JIT
+            jitFree(function);
+#endif
+#ifdef TRACE_JIT
+            traceFree(&function->chunk);
+#endif
             freeChunk(&function->chunk);
-            FREE(ObjFunction, object);
+            FREE_OBJECT(ObjFunction, object);
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*)object;
             // We free the table but not its entries 
             // since there might be other references to them.
-            freeTable(&instance->fields);
-            FREE(ObjInstance, object);
+            if (instance->dictionary != NULL) {
+                freeTable(instance->dictionary);
+                FREE(Table, instance->dictionary);
+            }
+            if (instance->slots != instance->inlineSlots) {
+                FREE_ARRAY(Value, instance->slots, instance->slotCapacity);
+            }
+            freeObjectMemory(object, sizeof(ObjInstance) +
+                sizeof(Value) * instance->inlineCapacity);
+            break;
+        }
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            freeTable(&shape->slots);
+            freeTable(&shape->transitions);
+            FREE_OBJECT(ObjShape, object);
             break;
         }
         case OBJ_NATIVE: {
-            FREE(ObjNative, object);
+            FREE_OBJECT(ObjNative, object);
             break;
         }
         case OBJ_STRING: {
             ObjString* string = (ObjString*)object;
+            if (string->form == STRING_ROPE) {
+                FREE_OBJECT(ObjRope, object);
+                break;
+            }
+            if (string->form == STRING_SLICE) {
+                FREE_OBJECT(ObjSlice, object);
+                break;
+            }
             // can free since the string is inlined. sizeof assumes the string is 0 len, so we need to add length and '\0'.
-            reallocate(object, sizeof(ObjString) + string->length + 1, 0);
+            freeObjectMemory(object, sizeof(ObjString) + string->length + 1);
             break;
         }
         case OBJ_UPVALUE:
-            FREE(ObjUpvalue, object);
+            FREE_OBJECT(ObjUpvalue, object);
             break;
     }
 }
@@ -193,72 +402,416 @@ static void markRoots() {
         markObject((Obj*)upvalue);
     }
 
-    markTable(&vm.globals);
+    markTable(&vm.globalSlots);
+    markArray(&vm.globalValues);
+    markArray(&vm.globalNames);
     // Any values used by the compiler must also be kept alive.
     markCompilerRoots();
     markObject((Obj*)vm.initString);
 }
 
 static void traceReferences() {
+#ifdef PARALLEL_MARK
+    int traced = 0;
+#endif
     while (vm.grayCount > 0) {
+#ifdef PARALLEL_MARK
+        // Still going after a while, let the other cores help.
+        if (vm.gcThreads > 1 && ++traced > PARALLEL_MARK_THRESHOLD) {
+            markInParallel();
+            return;
+        }
+#endif
         // grayCount is always points to the next value to be inserted, so we decrement first.
         Obj* object = vm.grayStack[--vm.grayCount];
         blackenObject(object);
     }
 }
 
-static void sweep() {
-    Obj* previous = NULL;
-    Obj* object = vm.objects; // Iterative over a linked list of all heap allocated objects.
-    while (object != NULL) {
-        // Move to the next node
-        if (object->isMarked) {
-            object->isMarked = false; // reset for next GC iteration.
-            previous = object;
-            object = object->next;
-        // Remove object from LL while preserving it, free the object.
-        } else {
-            Obj* unreached = object;
-            object = object->next;
-            if (previous != NULL) {
-                previous->next = object;
-            } else {
-                vm.objects = object;
-            }
+// Frees the unmarked young objects. Marks are sticky, the ones that
+// survived are old now.
+static void sweepYoung() {
+    size_t before = vm.bytesAllocated;
+    Obj* object;
+    while ((object = heapNextDeadYoung(&vm.heap)) != NULL) {
+        freeObject(object);
+    }
+    heapForgetYoung(&vm.heap);
+    vm.bytesFreed += before - vm.bytesAllocated;
+}
+
+static void forgetRemembered() {
+    for (int i = 0; i < vm.rememberedCount; i++) {
+        vm.rememberedSet[i]->isRemembered = false;
+    }
+    vm.rememberedCount = 0;
+}
 
-            freeObject(unreached);
+// Mark bits are sticky: outside a full collection exactly the old objects
+// are marked. A minor collection marks from the roots and the remembered
+// set, never looks into old objects, and only sweeps the young generation.
+// It can't run while a full collection is marking, the old objects aren't
+// all marked then.
+void collectYoung() {
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc begin\n");
+    size_t before = vm.bytesAllocated;
+#endif
+
+    markRoots();
+    // Old objects that were handed a young reference act as roots.
+    for (int i = 0; i < vm.rememberedCount; i++) {
+        blackenObject(vm.rememberedSet[i]);
+    }
+    traceReferences();
+    vm.stringsCleared += tableRemoveWhite(&vm.strings);
+    sweepYoung();
+    forgetRemembered();
+
+    vm.nextMinorGC = vm.bytesAllocated + GC_NURSERY_SIZE;
+    vm.minorCollections++;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc end\n");
+    printf("   collected %zu bytes (from %zu to %zu)\n",
+        before - vm.bytesAllocated, before, vm.bytesAllocated);
+#endif
+}
+
+// Where the heap may grow to before the next full collection.
+static size_t nextFullGC() {
+    GcConfig* config = &vm.gcConfig;
+    size_t next = (size_t)(vm.bytesAllocated * config->growFactor);
+    if (next < vm.bytesAllocated + config->minInterval) {
+        next = vm.bytesAllocated + config->minInterval;
+    }
+    if (config->maxHeap != 0 && next > config->maxHeap) next = config->maxHeap;
+    return next;
+}
+
+bool gcSetParameter(const char* name, double value) {
+    GcConfig* config = &vm.gcConfig;
+    if (strcmp(name, "growFactor") == 0) {
+        if (!(value > 1)) return false;
+        config->growFactor = value;
+        return true;
+    }
+
+    // The others are byte counts.
+    if (!(value >= 0) || value > (double)SIZE_MAX / 2) return false;
+    if (strcmp(name, "initialHeap") == 0) {
+        config->initialHeap = (size_t)value;
+        // Still waiting for the first collection.
+        if (vm.majorCollections == 0 && vm.gcPhase == GC_IDLE) {
+            vm.nextGC = config->initialHeap;
         }
+    } else if (strcmp(name, "maxHeap") == 0) {
+        config->maxHeap = (size_t)value;
+        if (config->maxHeap != 0 && vm.nextGC > config->maxHeap) {
+            vm.nextGC = config->maxHeap;
+        }
+    } else if (strcmp(name, "minInterval") == 0) {
+        config->minInterval = (size_t)value;
+    } else {
+        return false;
     }
+    return true;
 }
 
-void collectGarbage() {
+double gcClock() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+#ifdef CONCURRENT_GC
+static void* markerThread(void* unused) {
+    (void)unused;
+    traceReferences();
+    __atomic_store_n(&vm.markerDone, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+#endif
+
+// A full collection is a tri-color mark of the whole heap followed by a
+// sweep, both of which can be sliced up and interleaved with the mutator.
+// Objects allocated meanwhile start out white. The write
+// barrier shades whatever gets stored into a marked object, and since
+// roots have no barrier they are scanned again when the gray stack runs
+// dry.
+//
+// With CONCURRENT_GC a background thread does the marking instead. It
+// traces the heap as it was when the cycle started: objects allocated
+// meanwhile are black and the deletion barrier logs references that get
+// overwritten. The roots are only marked once, up front.
+static void startCycle() {
 #ifdef DEBUG_LOG_GC
     printf("-- gc begin\n");
-    size_t before = vm.bytesAllocated;
 #endif
 
+    // Promote everything first, then clearing the mark bitmaps makes the
+    // whole heap white.
+    collectYoung();
+    heapClearMarks(&vm.heap);
+
+    vm.gcPhase = GC_MARKING;
+    markRoots();
+    // Finish the cycle in one go if the program outruns it.
+    vm.nextGC = nextFullGC();
+    vm.nextMinorGC = SIZE_MAX;
+    vm.nextSliceGC = vm.bytesAllocated + GC_SLICE_SIZE;
+
+#ifdef CONCURRENT_GC
+    vm.markerDone = false;
+    if (pthread_create(&vm.marker, NULL, markerThread, NULL) != 0) {
+        fprintf(stderr, "Could not start the marker thread.\n");
+        exit(1);
+    }
+#endif
+}
+
+// Slices the heap walk found with a parent nothing else marked.
+static ObjSlice** loneSlices;
+static int loneCount;
+static int loneCapacity;
+
+static void findLoneSlice(void* pointer) {
+    ObjString* string = (ObjString*)pointer;
+    if (string->obj.type != OBJ_STRING || string->form != STRING_SLICE) return;
+    ObjSlice* slice = (ObjSlice*)string;
+    if (!IS_MARKED(slice) || IS_MARKED(slice->parent)) return;
+
+    if (loneCapacity < loneCount + 1) {
+        loneCapacity = GROW_CAPACITY(loneCapacity);
+        loneSlices = (ObjSlice**)realloc(loneSlices,
+                                         sizeof(ObjSlice*) * loneCapacity);
+        if (loneSlices == NULL) exit(1);
+    }
+    loneSlices[loneCount++] = slice;
+}
+
+// Marking skipped the parents of slices much shorter than them. Parents
+// that are only reachable through such slices get swept, the slices get
+// copies of their characters. Runs between marking and the sweep, the
+// copies are allocated marked and without polling the collector.
+static void copySlices() {
+    loneCount = 0;
+    heapWalkObjects(&vm.heap, findLoneSlice);
+
+    // A long slice keeps its parent, the shorter ones can share it then.
+    for (int i = 0; i < loneCount; i++) {
+        ObjSlice* slice = loneSlices[i];
+        if ((int64_t)slice->length * SLICE_RETAIN_FACTOR >=
+                slice->parent->length) {
+            heapMark(slice->parent, false);
+        }
+    }
+
+    for (int i = 0; i < loneCount; i++) {
+        ObjSlice* slice = loneSlices[i];
+        if (IS_MARKED(slice->parent)) continue;
+
+        size_t size = sizeof(ObjString) + slice->length + 1;
+        ObjString* copy = (ObjString*)heapAllocateObject(&vm.heap, size);
+        vm.bytesAllocated += size;
+        heapMark(copy, false);
+        copy->obj.type = OBJ_STRING;
+        copy->obj.isRemembered = false;
+        copy->isInterned = false;
+        copy->form = STRING_FLAT;
+        copy->hash = slice->hash;
+        copy->length = slice->length;
+        memcpy(copy->chars, slice->parent->chars + slice->start, slice->length);
+        copy->chars[slice->length] = '\0';
+
+        slice->start = 0;
+        slice->parent = copy;
+        vm.slicesCopied++;
+    }
+    vm.slicesDeferred = false;
+}
+
+static void finishMarking() {
+#ifdef CONCURRENT_GC
+    // The final remark: wait for the marker, then mark what the program
+    // overwrote while it ran.
+    pthread_join(vm.marker, NULL);
+    for (int i = 0; i < vm.overwriteCount; i++) {
+        markObject(vm.overwriteLog[i]);
+    }
+    vm.overwriteCount = 0;
+    traceReferences();
+    for (int i = 0; i < vm.deferredCount; i++) {
+        heapFree(&vm.heap, vm.deferredFrees[i].pointer,
+                 vm.deferredFrees[i].size);
+    }
+    vm.deferredCount = 0;
+#else
     markRoots();
     traceReferences();
-    tableRemoveWhite(&vm.strings);
-    sweep();
+#endif
+    if (vm.slicesDeferred) copySlices();
+    // Unmarked objects are garbage now and nothing can reach them again.
+    // The heap takes note of them for the sweep, so minor collections can
+    // carry on with the objects allocated from here on.
+    vm.gcPhase = GC_SWEEPING;
+    vm.stringsCleared += tableRemoveWhite(&vm.strings);
+    heapStartSweep(&vm.heap);
+    heapForgetYoung(&vm.heap);
+    vm.nextMinorGC = vm.bytesAllocated + GC_NURSERY_SIZE;
+}
 
-    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+static void finishSweeping() {
+    vm.gcPhase = GC_IDLE;
+    size_t maxHeap = vm.gcConfig.maxHeap;
+    // Whatever was allocated during the cycle may be garbage already.
+    if (maxHeap != 0 && vm.bytesAllocated > maxHeap) collectYoung();
+    if (maxHeap != 0 && vm.bytesAllocated > maxHeap) {
+        fprintf(stderr, "Out of memory: %zu bytes live, the limit is %zu.\n",
+                vm.bytesAllocated, maxHeap);
+        exit(1);
+    }
+    vm.nextGC = nextFullGC();
+    vm.nextSliceGC = SIZE_MAX;
+    vm.majorCollections++;
+#ifdef COMPACTING_GC
+    // Objects can only move where run() knows no C code holds on to them.
+    if (vm.heap.pageBytes > GC_COMPACT_MIN_HEAP &&
+        heapFragmentation(&vm.heap) > GC_COMPACT_THRESHOLD) {
+        vm.compactPending = true;
+    }
+#endif
 
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
-    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-        before - vm.bytesAllocated, before, vm.bytesAllocated,
-        vm.nextGC);
+    printf("   %zu bytes left, next at %zu\n", vm.bytesAllocated, vm.nextGC);
 #endif
 }
 
-void freeObjects() {
-    Obj* object = vm.objects;
-    while (object != NULL) {
-        Obj* next = object->next;
+// Frees up to 'work' garbage objects. Returns whether everything is swept.
+static bool sweepSome(int work) {
+    size_t before = vm.bytesAllocated;
+    Obj* object = NULL;
+    while (work-- > 0 && (object = heapNextUnswept(&vm.heap)) != NULL) {
         freeObject(object);
-        object = next;
     }
+    // The nursery is counted from where the heap stood, it doesn't grow
+    // by what the sweep gives back.
+    vm.nextMinorGC -= before - vm.bytesAllocated;
+    vm.bytesFreed += before - vm.bytesAllocated;
+    return object == NULL;
+}
+
+// Runs the cycle under way to its end.
+static void finishCycle() {
+    if (vm.gcPhase == GC_MARKING) {
+#ifndef CONCURRENT_GC
+        traceReferences();
+#endif
+        finishMarking();
+    }
+    if (vm.gcPhase == GC_SWEEPING) {
+        sweepSome(INT_MAX);
+        finishSweeping();
+    }
+}
+
+static void gcSlice(int work) {
+    if (vm.gcPhase == GC_MARKING) {
+#ifdef CONCURRENT_GC
+        if (__atomic_load_n(&vm.markerDone, __ATOMIC_ACQUIRE)) finishMarking();
+#else
+        while (work-- > 0 && vm.grayCount > 0) {
+            blackenObject(vm.grayStack[--vm.grayCount]);
+        }
+        if (vm.grayCount == 0) finishMarking();
+#endif
+    } else if (vm.gcPhase == GC_SWEEPING) {
+        if (sweepSome(work)) finishSweeping();
+    }
+    vm.nextSliceGC = vm.gcPhase == GC_IDLE
+        ? SIZE_MAX : vm.bytesAllocated + GC_SLICE_SIZE;
+}
+
+static void recordPause(double pause) {
+    vm.gcPauseTotal += pause;
+    if (pause > vm.gcMaxPause) vm.gcMaxPause = pause;
+
+    double micros = pause * 1e6;
+    int bucket = 0;
+    while (bucket < GC_PAUSE_BUCKETS - 1 && micros >= (double)(1 << bucket)) {
+        bucket++;
+    }
+    vm.gcPauses[bucket]++;
+}
+
+// Does the collection work that allocating made due and keeps track of the
+// pauses.
+static void gcPoll() {
+    double start = gcClock();
+
+    if (vm.bytesAllocated > vm.nextGC) {
+#ifdef INCREMENTAL_GC
+        if (vm.gcPhase == GC_IDLE) {
+            startCycle();
+        } else {
+            finishCycle();
+        }
+#else
+        collectGarbage();
+#endif
+    }
+    if (vm.bytesAllocated > vm.nextSliceGC) gcSlice(vm.gcSliceWork);
+    if (vm.bytesAllocated > vm.nextMinorGC) collectYoung();
+
+    recordPause(gcClock() - start);
+}
+
+#ifdef COMPACTING_GC
+// The program is at a safepoint: run() keeps nothing but the frames and
+// ip, which point into chunks, and no native or compiler is running.
+void gcSafepoint() {
+    double start = gcClock();
+
+    // Leftover garbage would be taken for objects, and young objects
+    // for garbage.
+    finishCycle();
+    collectYoung();
+#ifdef DEBUG_STRESS_GC
+    // Move everything that can move.
+    compactHeap(1.0);
+#else
+    compactHeap(GC_EVACUATE_OCCUPANCY);
+#endif
+    vm.compactPending = false;
+
+    recordPause(gcClock() - start);
+}
+#endif
+
+void collectGarbage() {
+    // Run the cycle under way to its end. A fresh one is only needed if
+    // its marking was over already.
+    if (vm.gcPhase == GC_SWEEPING) finishCycle();
+    if (vm.gcPhase == GC_IDLE) startCycle();
+    finishCycle();
+}
+
+void freeObjects() {
+#ifdef CONCURRENT_GC
+    if (vm.gcPhase == GC_MARKING) finishMarking();
+    free(vm.overwriteLog);
+    free(vm.deferredFrees);
+#endif
+    // Everything is garbage now.
+    heapClearMarks(&vm.heap);
+    heapStartSweep(&vm.heap);
+    sweepSome(INT_MAX);
+    heapForgetYoung(&vm.heap);
 
     free(vm.grayStack);
+    free(vm.rememberedSet);
+    free(loneSlices);
+    loneSlices = NULL;
+    loneCapacity = 0;
 }
\ No newline at end of file
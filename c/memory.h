@@ -3,8 +3,38 @@
 
 #include "common.h"
 #include "object.h"
+#include "vm.h"
 
 
+// Defaults of vm.gcConfig.
+#define GC_INITIAL_HEAP (1024 * 1024)
+#define GC_GROW_FACTOR 2
+// Small heaps would otherwise be collected in full every few kilobytes,
+// over and over for the young garbage the minor collections promote.
+#define GC_MIN_INTERVAL (1024 * 1024)
+// Bytes allocated between two minor collections.
+#define GC_NURSERY_SIZE (256 * 1024)
+// Bytes allocated between two slices of an incremental full collection.
+#define GC_SLICE_SIZE (32 * 1024)
+// Objects a slice blackens or sweeps by default, see vm.gcSliceWork.
+#define GC_SLICE_WORK 2000
+
+// Stores to and loads from fields the concurrent marker reads while the
+// program changes them. Whatever was written before PUBLISH() is visible to
+// the marker once OBSERVE() sees the published value. Containers publish
+// their bigger bound only after the storage behind it.
+#ifdef CONCURRENT_GC
+#define PUBLISH(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELEASE)
+#define OBSERVE(field) __atomic_load_n(&(field), __ATOMIC_ACQUIRE)
+#else
+#define PUBLISH(field, value) ((field) = (value))
+#define OBSERVE(field) (field)
+#endif
+
+// Mark bits live in bitmaps of the heap's object pages. Clearing them at
+// the start of a full collection turns every object white at once.
+#define IS_MARKED(object) heapIsMarked(object)
+
 #define ALLOCATE(type, count) \
     (type*)reallocate(NULL, 0, sizeof(type) * (count))
 
@@ -21,9 +51,64 @@
     reallocate(pointer, sizeof(type) * (oldCount), 0)
 
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+// Memory for a new object, from the pages that have mark bitmaps.
+void* allocateObjectMemory(size_t size);
 void markObject(Obj* object); 
 void markValue(Value value);
+// Marks what the gray object refers to.
+void blackenObject(Obj* object);
+// Full collection of both generations. Finishes an incremental one that is
+// under way.
 void collectGarbage();
+// Minor collection, only frees and promotes young objects.
+void collectYoung();
 void freeObjects();
+// Monotonic wall clock in seconds, what collector pauses are measured in.
+double gcClock();
+// Sets a field of vm.gcConfig by name: initialHeap, growFactor, maxHeap or
+// minInterval. Returns false for unknown names and values out of range.
+bool gcSetParameter(const char* name, double value);
+// Owner's fields changed in ways the barrier below didn't see, look at all
+// of them again.
+void gcRemember(Obj* owner);
+void gcRecordWrite(Obj* owner, Obj* value);
+void gcRecordOverwrite(Obj* old);
+
+// Write barrier, call it after storing value into a field of owner.
+// Outside a full collection exactly the old objects are marked, and an old
+// object that now points at a young one goes into the remembered set,
+// which minor collections treat as roots. While a full collection marks,
+// the value is shaded instead so a black object never points at a white
+// one.
+static inline void gcWriteBarrier(Obj* owner, Value value) {
+    if (IS_MARKED(owner) && IS_OBJ(value) && !IS_MARKED(AS_OBJ(value))) {
+        gcRecordWrite(owner, AS_OBJ(value));
+    }
+}
+
+#ifdef COMPACTING_GC
+// Compacts the heap if a collection asked for it.
+void gcSafepoint();
+#define GC_SAFEPOINT() \
+    do { \
+        if (vm.compactPending) gcSafepoint(); \
+    } while (false)
+#else
+#define GC_SAFEPOINT() do { } while (false)
+#endif
+
+// Deletion barrier, call it before a reference gets overwritten or dropped
+// from an object. The concurrent marker traces the heap as it was when the
+// collection started, so references it might not have seen yet are logged
+// and marked at the final remark.
+static inline void gcOverwriteBarrier(Value old) {
+#ifdef CONCURRENT_GC
+    if (vm.gcPhase == GC_MARKING && IS_OBJ(old)) {
+        gcRecordOverwrite(AS_OBJ(old));
+    }
+#else
+    (void)old;
+#endif
+}
 
 #endif
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "memory.h"
@@ -11,13 +12,13 @@
     (type*)allocateObject(sizeof(type), objectType)
 
 static Obj* allocateObject(size_t size, ObjType type) {
-    Obj* object = (Obj*)reallocate(NULL, 0, size);
+    Obj* object = (Obj*)allocateObjectMemory(size);
     object->type = type;
-    object->isMarked = false;
-
-    // Place new object at the head of the linked list.
-    object->next = vm.objects;
-    vm.objects = object;
+#ifdef CONCURRENT_GC
+    // The marker traces a snapshot, anything newer is black.
+    if (vm.gcPhase == GC_MARKING) heapMark(object, true);
+#endif
+    object->isRemembered = false;
 
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void*)object, size, type);
@@ -26,6 +27,45 @@ static Obj* allocateObject(size_t size, ObjType type) {
     return object;
 }
 
+size_t objectSize(Obj* object) {
+    switch ((ObjType)object->type) {
+        case OBJ_BOUND_METHOD: return sizeof(ObjBoundMethod);
+        case OBJ_CLASS: return sizeof(ObjClass);
+        case OBJ_CLOSURE: return sizeof(ObjClosure);
+        case OBJ_FUNCTION: return sizeof(ObjFunction);
+        case OBJ_INSTANCE:
+            return sizeof(ObjInstance) +
+                sizeof(Value) * ((ObjInstance*)object)->inlineCapacity;
+        case OBJ_NATIVE: return sizeof(ObjNative);
+        case OBJ_SHAPE: return sizeof(ObjShape);
+        case OBJ_STRING:
+            switch ((StringForm)((ObjString*)object)->form) {
+                case STRING_FLAT:
+                    return sizeof(ObjString) + ((ObjString*)object)->length + 1;
+                case STRING_ROPE: return sizeof(ObjRope);
+                case STRING_SLICE: return sizeof(ObjSlice);
+            }
+            break;
+        case OBJ_UPVALUE: return sizeof(ObjUpvalue);
+    }
+    return 0; // Unreachable.
+}
+
+const char* objectTypeName(ObjType type) {
+    static const char* names[OBJ_TYPE_COUNT] = {
+        [OBJ_BOUND_METHOD] = "boundMethod",
+        [OBJ_CLASS] = "class",
+        [OBJ_CLOSURE] = "closure",
+        [OBJ_FUNCTION] = "function",
+        [OBJ_INSTANCE] = "instance",
+        [OBJ_NATIVE] = "native",
+        [OBJ_SHAPE] = "shape",
+        [OBJ_STRING] = "string",
+        [OBJ_UPVALUE] = "upvalue",
+    };
+    return names[type];
+}
+
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method) {
     ObjBoundMethod* bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
     bound->receiver = receiver;
@@ -37,6 +77,8 @@ ObjClass* newClass(ObjString* name) {
     ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
     klass->name = name;
     initTable(&klass->methods);
+    klass->rootShape = NULL;
+    klass->inlineSlots = 4;
     return klass;
 }
 
@@ -60,17 +102,179 @@ ObjFunction* newFunction() {
     function->arity = 0;
     function->upvalueCount = 0;
     function->name = NULL;
+    function->calls = 0;
+    function->jit = NULL;
     initChunk(&function->chunk);
     return function;
 }
 
+static ObjShape* newShape(ObjShape* parent, ObjString* name) {
+    ObjShape* shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+    shape->parent = parent;
+    shape->name = name;
+    shape->slotCount = 0;
+    initTable(&shape->slots);
+    initTable(&shape->transitions);
+    return shape;
+}
+
+// Returns the shape reached by adding field 'name' to 'shape'.
+// Transitions are cached, so every instance that adds the same fields in the
+// same order ends up with the very same shape.
+static ObjShape* shapeTransition(ObjShape* shape, ObjString* name) {
+    Value next;
+    if (tableGet(&shape->transitions, name, &next)) return AS_SHAPE(next);
+
+    ObjShape* child = newShape(shape, name);
+    push(OBJ_VAL(child)); // Filling in the tables allocates.
+    tableAddAll(&shape->slots, &child->slots);
+    tableSet(&child->slots, name, NUMBER_VAL(shape->slotCount));
+    // Filling in the tables may have made both shapes old halfway through,
+    // rescan the child as a whole then.
+    if (IS_MARKED(&child->obj)) gcRemember((Obj*)child);
+    child->slotCount = shape->slotCount + 1;
+    tableSet(&shape->transitions, name, OBJ_VAL(child));
+    gcWriteBarrier((Obj*)shape, OBJ_VAL(name));
+    gcWriteBarrier((Obj*)shape, OBJ_VAL(child));
+    pop();
+    return child;
+}
+
 ObjInstance* newInstance(ObjClass* klass) {
-    ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+    // Create the root shape first, klass is still on the stack at this point.
+    if (klass->rootShape == NULL) {
+        klass->rootShape = newShape(NULL, NULL);
+        gcWriteBarrier((Obj*)klass, OBJ_VAL(klass->rootShape));
+    }
+
+    int inlineCapacity = klass->inlineSlots;
+    ObjInstance* instance = (ObjInstance*)allocateObject(
+        sizeof(ObjInstance) + sizeof(Value) * inlineCapacity, OBJ_INSTANCE);
     instance->klass = klass;
-    initTable(&instance->fields);
+    instance->shape = klass->rootShape;
+    instance->dictionary = NULL;
+    instance->slots = instance->inlineSlots;
+    instance->slotCapacity = inlineCapacity;
+    instance->inlineCapacity = inlineCapacity;
     return instance;
 }
 
+static void ensureSlotCapacity(ObjInstance* instance, int count) {
+    if (count <= instance->slotCapacity) return;
+
+    int oldCapacity = instance->slotCapacity;
+    int capacity = GROW_CAPACITY(oldCapacity);
+    if (instance->slots == instance->inlineSlots) {
+        // Move out of the inline storage, it stays allocated but unused.
+        Value* slots = ALLOCATE(Value, capacity);
+        memcpy(slots, instance->inlineSlots, sizeof(Value) * oldCapacity);
+        instance->slots = slots;
+        // Clear the inline storage, makeDictionary() points the slots back
+        // at it and the concurrent marker may look before the shape is gone.
+        for (int i = 0; i < oldCapacity; i++) {
+            gcOverwriteBarrier(instance->inlineSlots[i]);
+            instance->inlineSlots[i] = NIL_VAL;
+        }
+    } else {
+        instance->slots = GROW_ARRAY(Value, instance->slots, oldCapacity, capacity);
+    }
+    instance->slotCapacity = capacity;
+}
+
+// Moves every field into a hash table. Used when shapes stop paying off.
+static void makeDictionary(ObjInstance* instance) {
+    Table* dictionary = ALLOCATE(Table, 1);
+    initTable(dictionary);
+    // While both are set the GC traces the slots and the dictionary.
+    instance->dictionary = dictionary;
+
+    ObjShape* shape = instance->shape;
+    for (int i = 0; i < shape->slots.capacity; i++) {
+        Entry* entry = &shape->slots.entries[i];
+        if (entry->key == NULL) continue;
+        Value value = instance->slots[(int)AS_NUMBER(entry->value)];
+        gcOverwriteBarrier(value);
+        tableSet(dictionary, entry->key, value);
+        // The shape is dropped below, its names now live in the dictionary.
+        gcWriteBarrier((Obj*)instance, OBJ_VAL(entry->key));
+        gcWriteBarrier((Obj*)instance, value);
+    }
+
+    gcOverwriteBarrier(OBJ_VAL(shape));
+    PUBLISH(instance->shape, NULL);
+    if (instance->slots != instance->inlineSlots) {
+        FREE_ARRAY(Value, instance->slots, instance->slotCapacity);
+    }
+    instance->slots = instance->inlineSlots;
+    instance->slotCapacity = instance->inlineCapacity;
+}
+
+bool instanceGetField(ObjInstance* instance, ObjString* name, Value* value) {
+    if (instance->shape == NULL) {
+        return tableGet(instance->dictionary, name, value);
+    }
+
+    Value slot;
+    if (!tableGet(&instance->shape->slots, name, &slot)) return false;
+    *value = instance->slots[(int)AS_NUMBER(slot)];
+    return true;
+}
+
+static void setDictionaryField(ObjInstance* instance, ObjString* name,
+                               Value value) {
+    tableSet(instance->dictionary, name, value);
+    gcWriteBarrier((Obj*)instance, OBJ_VAL(name));
+    gcWriteBarrier((Obj*)instance, value);
+}
+
+void instanceSetField(ObjInstance* instance, ObjString* name, Value value) {
+    if (instance->shape == NULL) {
+        setDictionaryField(instance, name, value);
+        return;
+    }
+
+    Value slot;
+    if (tableGet(&instance->shape->slots, name, &slot)) {
+        gcOverwriteBarrier(instance->slots[(int)AS_NUMBER(slot)]);
+        instance->slots[(int)AS_NUMBER(slot)] = value;
+        gcWriteBarrier((Obj*)instance, value);
+        return;
+    }
+
+    if (instance->shape->slotCount == SHAPE_MAX_SLOTS) {
+        makeDictionary(instance);
+        setDictionaryField(instance, name, value);
+        return;
+    }
+
+    ObjShape* shape = shapeTransition(instance->shape, name);
+    ensureSlotCapacity(instance, shape->slotCount);
+    // Store the value before switching shapes, the GC only traces slots
+    // covered by the current shape.
+    instance->slots[shape->slotCount - 1] = value;
+    gcOverwriteBarrier(OBJ_VAL(instance->shape));
+    PUBLISH(instance->shape, shape);
+    gcWriteBarrier((Obj*)instance, value);
+    gcWriteBarrier((Obj*)instance, OBJ_VAL(shape));
+
+    // Later instances of the class reserve enough inline slots up front.
+    ObjClass* klass = instance->klass;
+    if (shape->slotCount > klass->inlineSlots &&
+        shape->slotCount <= INSTANCE_MAX_INLINE_SLOTS) {
+        klass->inlineSlots = shape->slotCount;
+    }
+}
+
+bool instanceDeleteField(ObjInstance* instance, ObjString* name) {
+    // Shapes only ever grow, so deleting has to go through a dictionary.
+    if (instance->shape != NULL) {
+        Value dummy;
+        if (!instanceGetField(instance, name, &dummy)) return false;
+        makeDictionary(instance);
+    }
+    return tableDelete(instance->dictionary, name);
+}
+
 ObjNative* newNative(NativeFn function) {
     ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
     native->function = function;
@@ -84,26 +288,21 @@ ObjNative* newNative(NativeFn function) {
 //     return string;
 // }
 
-// FNV-1a hash algorithm.
-uint32_t hashString(const char* key, int length) {
-    uint32_t hash = 2166136261u;
-    for (int i = 0; i < length; i++) {
-        hash ^= (uint8_t)key[i]; // xor
-        hash *= 16777619; // scatter data around
-    }
-}
-
 // Sort of like constructor
 ObjString* makeString(int length, uint32_t hash) {
     ObjString* string = (ObjString*)allocateObject(sizeof(ObjString) + length + 1, OBJ_STRING);
+    string->isInterned = false;
+    string->form = STRING_FLAT;
     string->length = length;
     string->hash = hash;
     return string;
 }
 
 ObjString* copyString(const char* chars, int length) {
-    uint32_t hash = hashString(chars, length);
+    return copyHashedString(chars, length, hashString(chars, length));
+}
 
+ObjString* copyHashedString(const char* chars, int length, uint32_t hash) {
     // When copying a string, if the exact string already exists somewhere,
     // just return that one and don't make a new one.
     ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
@@ -114,10 +313,230 @@ ObjString* copyString(const char* chars, int length) {
     // copy string
     memcpy(string->chars, chars, length);
     string->chars[length] = '\0';
+    string->isInterned = true;
+    push(OBJ_VAL(string)); // Growing the intern table can trigger a GC.
     tableSet(&vm.strings, string, NIL_VAL);
+    pop();
     return string;
 }
 
+// A rope that goes into a second rope gets flattened, otherwise flattening
+// each of them would walk all its pieces again.
+static ObjString* ropePiece(ObjString* string) {
+    if (string->form != STRING_ROPE) return string;
+    ObjRope* rope = (ObjRope*)string;
+    if (rope->right != NULL) {
+        if (!rope->isShared) {
+            rope->isShared = true;
+            return string;
+        }
+        flattenRope(rope);
+    }
+    return rope->left;
+}
+
+ObjString* newRope(ObjString* left, ObjString* right) {
+    left = ropePiece(left);
+    right = ropePiece(right);
+    ObjRope* rope = ALLOCATE_OBJ(ObjRope, OBJ_STRING);
+    rope->isInterned = false;
+    rope->form = STRING_ROPE;
+    rope->hash = 0;
+    rope->length = left->length + right->length;
+    rope->isShared = false;
+    rope->left = left;
+    rope->right = right;
+    return (ObjString*)rope;
+}
+
+ObjString* newSlice(ObjString* string, int start, int length) {
+    if (start == 0 && length == string->length) return string;
+
+    flattenString(string);
+    push(OBJ_VAL(string));
+    if (length < SLICE_MIN_LENGTH) {
+        ObjString* copy = makeString(length, 0);
+        pop();
+        memcpy(copy->chars, stringChars(string) + start, length);
+        copy->chars[length] = '\0';
+        return copy;
+    }
+    ObjSlice* slice = ALLOCATE_OBJ(ObjSlice, OBJ_STRING);
+    pop();
+    slice->isInterned = false;
+    slice->form = STRING_SLICE;
+    slice->hash = 0;
+    slice->length = length;
+
+    // Slices of slices and of flattened ropes share the flat string below.
+    // Allocating the slice may have given a slice parent a copy.
+    switch ((StringForm)string->form) {
+        case STRING_FLAT:
+            slice->start = start;
+            slice->parent = string;
+            break;
+        case STRING_ROPE:
+            slice->start = start;
+            slice->parent = ((ObjRope*)string)->left;
+            break;
+        case STRING_SLICE:
+            slice->start = ((ObjSlice*)string)->start + start;
+            slice->parent = ((ObjSlice*)string)->parent;
+            break;
+    }
+    return (ObjString*)slice;
+}
+
+// Pieces of ropes still to visit. The first few live in the struct itself.
+typedef struct {
+    ObjString** pieces;
+    int count;
+    int capacity;
+    ObjString* inlinePieces[32];
+} PieceStack;
+
+static void initPieceStack(PieceStack* stack) {
+    stack->pieces = stack->inlinePieces;
+    stack->count = 0;
+    stack->capacity = 32;
+}
+
+static void freePieceStack(PieceStack* stack) {
+    if (stack->pieces != stack->inlinePieces) free(stack->pieces);
+}
+
+static void pushPiece(PieceStack* stack, ObjString* piece) {
+    if (stack->count == stack->capacity) {
+        // Not the GC's memory, growing it must not start a collection.
+        stack->capacity *= 2;
+        if (stack->pieces == stack->inlinePieces) {
+            stack->pieces = malloc(sizeof(ObjString*) * stack->capacity);
+            if (stack->pieces != NULL) {
+                memcpy(stack->pieces, stack->inlinePieces,
+                       sizeof(stack->inlinePieces));
+            }
+        } else {
+            stack->pieces = realloc(stack->pieces,
+                                    sizeof(ObjString*) * stack->capacity);
+        }
+        if (stack->pieces == NULL) exit(1);
+    }
+    stack->pieces[stack->count++] = piece;
+}
+
+void flattenRope(ObjRope* rope) {
+    push(OBJ_VAL(rope));
+    ObjString* flat = makeString(rope->length, 0);
+    pop();
+
+    // Filled from the back, so the left child waits on the stack. Ropes
+    // built by appending lean left and keep the stack short.
+    PieceStack stack;
+    initPieceStack(&stack);
+    int end = rope->length;
+    ObjString* piece = (ObjString*)rope;
+    for (;;) {
+        const char* chars = stringChars(piece);
+        if (chars == NULL) {
+            pushPiece(&stack, ((ObjRope*)piece)->left);
+            piece = ((ObjRope*)piece)->right;
+            continue;
+        }
+        end -= piece->length;
+        memcpy(flat->chars + end, chars, piece->length);
+        if (stack.count == 0) break;
+        piece = stack.pieces[--stack.count];
+    }
+    freePieceStack(&stack);
+    flat->chars[rope->length] = '\0';
+
+    // The children may be garbage now.
+    gcOverwriteBarrier(OBJ_VAL(rope->left));
+    gcOverwriteBarrier(OBJ_VAL(rope->right));
+    PUBLISH(rope->right, NULL);
+    PUBLISH(rope->left, flat);
+    gcWriteBarrier((Obj*)rope, OBJ_VAL(flat));
+}
+
+// Points the slice at a copy of its characters.
+static void detachSlice(ObjSlice* slice) {
+    push(OBJ_VAL(slice));
+    ObjString* copy = makeString(slice->length, slice->hash);
+    pop();
+    memcpy(copy->chars, stringChars((ObjString*)slice), slice->length);
+    copy->chars[slice->length] = '\0';
+
+    gcOverwriteBarrier(OBJ_VAL(slice->parent));
+    slice->start = 0;
+    PUBLISH(slice->parent, copy);
+    gcWriteBarrier((Obj*)slice, OBJ_VAL(copy));
+}
+
+const char* terminatedChars(ObjString* string) {
+    const char* chars = flattenString(string);
+    if (string->form == STRING_SLICE) {
+        ObjSlice* slice = (ObjSlice*)string;
+        if (slice->start + slice->length == slice->parent->length) return chars;
+        detachSlice(slice);
+        chars = stringChars(string);
+    }
+    return chars;
+}
+
+ObjString* internString(ObjString* string) {
+    if (string->isInterned) return string;
+    flattenString(string);
+
+    // A flattened rope's characters are a flat string already.
+    ObjString* flat = NULL;
+    if (string->form == STRING_FLAT) {
+        flat = string;
+    } else if (string->form == STRING_ROPE) {
+        flat = ((ObjRope*)string)->left;
+        if (flat->isInterned) return flat;
+    }
+
+    if (string->hash == 0) {
+        string->hash = hashString(stringChars(string), string->length);
+    }
+    ObjString* interned = tableFindString(&vm.strings, stringChars(string),
+                                          string->length, string->hash);
+    if (interned != NULL) return interned;
+
+    if (flat == NULL) {
+        // Slices can't be keys, they get a copy.
+        push(OBJ_VAL(string));
+        flat = makeString(string->length, 0);
+        pop();
+        memcpy(flat->chars, stringChars(string), string->length);
+        flat->chars[string->length] = '\0';
+    }
+    flat->hash = string->hash;
+    flat->isInterned = true;
+    push(OBJ_VAL(flat)); // Growing the intern table can trigger a GC.
+    tableSet(&vm.strings, flat, NIL_VAL);
+    pop();
+    return flat;
+}
+
+bool stringsEqual(ObjString* a, ObjString* b) {
+    if (a == b) return true;
+    if (a->length != b->length) return false;
+    if (a->isInterned && b->isInterned) return false;
+    if (a->hash != 0 && b->hash != 0 && a->hash != b->hash) return false;
+
+    push(OBJ_VAL(a));
+    push(OBJ_VAL(b));
+    flattenString(a);
+    flattenString(b);
+    pop();
+    pop();
+    // Nothing allocates from here on.
+    const char* charsA = stringChars(a);
+    const char* charsB = stringChars(b);
+    return charsA == charsB || memcmp(charsA, charsB, a->length) == 0;
+}
+
 ObjUpvalue* newUpvalue(Value* slot) {
   ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
   upvalue->location = slot;
@@ -125,6 +544,26 @@ ObjUpvalue* newUpvalue(Value* slot) {
   return upvalue;
 }
 
+// Writes the pieces of a rope out in order rather than flattening it, the
+// GC prints objects while it collects when logging.
+static void printString(ObjString* string) {
+    PieceStack stack;
+    initPieceStack(&stack);
+    ObjString* piece = string;
+    for (;;) {
+        const char* chars = stringChars(piece);
+        if (chars == NULL) {
+            pushPiece(&stack, ((ObjRope*)piece)->right);
+            piece = ((ObjRope*)piece)->left;
+            continue;
+        }
+        fwrite(chars, 1, piece->length, stdout);
+        if (stack.count == 0) break;
+        piece = stack.pieces[--stack.count];
+    }
+    freePieceStack(&stack);
+}
+
 void printFunction(ObjFunction* function) {
     if (function->name == NULL) {
         printf("<script>");
@@ -145,8 +584,7 @@ void printObject(Value value) {
             printFunction(AS_CLOSURE(value)->function);
             break;
         case OBJ_STRING:
-            // Neat.
-            printf("%s", AS_CSTRING(value));
+            printString(AS_STRING(value));
             break;
         case OBJ_UPVALUE:
             printf("upvalue");
@@ -161,5 +599,8 @@ void printObject(Value value) {
         case OBJ_NATIVE:
             printf("<native fn>");
             break;
+        case OBJ_SHAPE:
+            printf("shape");
+            break;
     }
 }
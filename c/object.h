@@ -3,10 +3,11 @@
 
 #include "common.h"
 #include "chunk.h"
+#include "hash.h"
 #include "table.h"
 #include "value.h"
 
-#define OBJ_TYPE(value) (AS_OBJ(value)->type)
+#define OBJ_TYPE(value) ((ObjType)AS_OBJ(value)->type)
 
 #define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
 #define IS_CLASS(value) isObjType(value, OBJ_CLASS)
@@ -14,6 +15,7 @@
 #define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
 #define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
+#define IS_SHAPE(value) isObjType(value, OBJ_SHAPE)
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
 
 #define AS_BOUND_METHOD(value)  ((ObjBoundMethod*)AS_OBJ(value))
@@ -22,8 +24,9 @@
 #define AS_FUNCTION(value)  ((ObjFunction*)AS_OBJ(value))
 #define AS_INSTANCE(value)     ((ObjInstance*)AS_OBJ(value))
 #define AS_NATIVE(value)  (((ObjNative*)AS_OBJ(value))->function)
+#define AS_SHAPE(value)  ((ObjShape*)AS_OBJ(value))
 #define AS_STRING(value)  ((ObjString*)AS_OBJ(value))
-#define AS_CSTRING(value)  (((ObjString*)AS_OBJ(value))->chars)
+#define AS_CSTRING(value)  (terminatedChars(AS_STRING(value)))
 
 
 typedef enum {
@@ -33,22 +36,31 @@ typedef enum {
     OBJ_FUNCTION,
     OBJ_INSTANCE,
     OBJ_NATIVE,
+    OBJ_SHAPE,
     OBJ_STRING,
     OBJ_UPVALUE,
 } ObjType;
 
+#define OBJ_TYPE_COUNT (OBJ_UPVALUE + 1)
+
+// The header fits in a word. Objects aren't linked together, the heap
+// finds them through its allocation bitmaps, and the mark bits live there
+// too. With sticky marks a marked object is old, so that is the age as well.
 struct Obj {
-  ObjType type;
-  bool isMarked;
-  struct Obj* next; // Linkedlist of objects to simplify freeing memory.
+  uint8_t type; // An ObjType.
+  bool isRemembered; // In the remembered set.
 };
 
+_Static_assert(sizeof(Obj) <= sizeof(uint64_t), "Object header too big.");
+
 typedef struct {
     Obj obj;
     int arity; // number of parameters
     int upvalueCount;
     Chunk chunk; // bytecode
     ObjString* name;
+    int calls; // Counts calls until the function is hot enough to compile.
+    struct JitCode* jit; // Machine code for the chunk, NULL while interpreted.
 } ObjFunction;
 
 // bool indicates if function executed correctly, return value returned as args[0].
@@ -59,13 +71,63 @@ typedef struct {
     NativeFn function; // pointer to a c function
 } ObjNative;
 
+// How a string holds its characters. Only flat strings have chars, the
+// others are different structs that start out the same.
+typedef enum {
+    STRING_FLAT,
+    STRING_ROPE,
+    STRING_SLICE,
+} StringForm;
+
 struct ObjString {
     Obj obj; // The Obj struct will be inlined.
-    uint32_t hash;
+    bool isInterned; // In vm.strings, equal interned strings are the same object.
+    uint8_t form; // A StringForm.
+    uint32_t hash; // 0 while not computed yet, only interning needs it.
     int length;
     char chars[]; // Flexible array member to inline string in the struct.
 };
 
+// Concatenations shorter than this are copied right away.
+#define ROPE_MIN_LENGTH 64
+
+// A concatenation whose characters haven't been copied together yet,
+// flattenString() gets them. Once flattened left holds them all and right
+// is NULL.
+typedef struct {
+    Obj obj;
+    bool isInterned; // Always false, only flat strings get interned.
+    uint8_t form;
+    uint32_t hash;
+    int length;
+    bool isShared; // Went into a rope already.
+    ObjString* left;
+    ObjString* right;
+} ObjRope;
+
+// Substrings shorter than this are copied, the copy is about as big as a
+// slice.
+#define SLICE_MIN_LENGTH 16
+// A full collection gives a slice its own copy of its characters when it
+// is all that keeps a parent this many times longer alive.
+#define SLICE_RETAIN_FACTOR 4
+
+// Characters of a flat string, shared instead of copied. They aren't
+// followed by a '\0' unless the slice runs to the end of the parent.
+typedef struct {
+    Obj obj;
+    bool isInterned; // Always false, only flat strings get interned.
+    uint8_t form;
+    uint32_t hash;
+    int length;
+    int start; // Offset into the parent's chars.
+    ObjString* parent; // Always flat.
+} ObjSlice;
+
+_Static_assert(offsetof(ObjRope, length) == offsetof(ObjString, length) &&
+               offsetof(ObjSlice, length) == offsetof(ObjString, length),
+               "Ropes and slices have to start like strings.");
+
 typedef struct ObjUpvalue {
     Obj obj;
     Value* location; // Pointer to a Value, multiple closures can reference the same variable.
@@ -80,16 +142,40 @@ typedef struct {
     int upvalueCount;
 } ObjClosure;
 
+// Instances with more fields than this give up on shapes and use a hash table.
+#define SHAPE_MAX_SLOTS 64
+// Upper bound on how many field slots are allocated inline in a new instance.
+#define INSTANCE_MAX_INLINE_SLOTS 16
+
+// A hidden class. Describes which field lives in which slot of an instance.
+// Shapes form a tree: adding a field to an instance moves it to a child shape,
+// so instances whose fields were added in the same order share a shape.
+typedef struct ObjShape {
+    Obj obj;
+    struct ObjShape* parent;
+    ObjString* name; // Field added by the transition from parent, NULL for the root.
+    int slotCount;
+    Table slots; // field name -> slot index.
+    Table transitions; // field name -> child shape.
+} ObjShape;
+
 typedef struct {
     Obj obj;
     ObjString* name;
     Table methods;
+    ObjShape* rootShape; // Shape of fresh instances, created lazily.
+    int inlineSlots; // How many field slots new instances reserve inline.
 } ObjClass;
 
 typedef struct {
     Obj obj;
     ObjClass* klass;
-    Table fields;
+    ObjShape* shape; // NULL once the instance fell back to dictionary mode.
+    Table* dictionary; // Fields in dictionary mode, NULL otherwise.
+    Value* slots; // Points at inlineSlots until the instance outgrows them.
+    int slotCapacity;
+    int inlineCapacity;
+    Value inlineSlots[]; // Field values indexed by the shape's slot indices.
 } ObjInstance;
 
 typedef struct {
@@ -98,17 +184,39 @@ typedef struct {
     ObjClosure* method; // closure
 } ObjBoundMethod;
 
+// Bytes the object takes on the heap, not counting what it points to.
+size_t objectSize(Obj* object);
+// Lower camel case, for telemetry and snapshots.
+const char* objectTypeName(ObjType type);
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
 ObjInstance* newInstance(ObjClass* klass);
 ObjClass* newClass(ObjString* name);
 ObjClosure* newClosure(ObjFunction* function);
 ObjFunction* newFunction();
 ObjNative* newNative(NativeFn function);
-uint32_t hashString(const char* key, int length);
+bool instanceGetField(ObjInstance* instance, ObjString* name, Value* value);
+// value must be reachable by the GC, adding a field may allocate.
+void instanceSetField(ObjInstance* instance, ObjString* name, Value value);
+bool instanceDeleteField(ObjInstance* instance, ObjString* name);
 // Takes ownership of the passed in string.
 ObjString* makeString(int length, uint32_t hash);
 // Does not take ownership of chars it takes.
 ObjString* copyString(const char* chars, int length);
+// Same for chars whose hashString() is known already.
+ObjString* copyHashedString(const char* chars, int length, uint32_t hash);
+// Both must be reachable by the GC.
+ObjString* newRope(ObjString* left, ObjString* right);
+// Characters start to start + length of the string, which has to be
+// reachable by the GC. Shares them unless there are only a few.
+ObjString* newSlice(ObjString* string, int start, int length);
+void flattenRope(ObjRope* rope);
+// Makes the string's characters end in a '\0' and returns them. Slices get
+// a copy of their own for that, so this allocates like flattenString().
+const char* terminatedChars(ObjString* string);
+// The interned string equal to this one, which has to be reachable by the
+// GC. Table keys have to be interned, tables compare them by pointer.
+ObjString* internString(ObjString* string);
+bool stringsEqual(ObjString* a, ObjString* b);
 ObjUpvalue* newUpvalue(Value* slot);
 void printObject(Value value);
 
@@ -116,4 +224,31 @@ static inline bool isObjType(Value value, ObjType type) {
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+// The string's characters, NULL for a rope that hasn't been flattened yet.
+// Never allocates, but the pointer is only good until the next allocation:
+// a collection may give a slice a copy and free its parent.
+static inline const char* stringChars(ObjString* string) {
+    switch ((StringForm)string->form) {
+        case STRING_FLAT: return string->chars;
+        case STRING_ROPE: {
+            ObjRope* rope = (ObjRope*)string;
+            return rope->right == NULL ? rope->left->chars : NULL;
+        }
+        case STRING_SLICE: {
+            ObjSlice* slice = (ObjSlice*)string;
+            return slice->parent->chars + slice->start;
+        }
+    }
+    return NULL; // Unreachable.
+}
+
+// Same, flattening a rope first. Allocates then, and the string has to be
+// reachable by the GC.
+static inline const char* flattenString(ObjString* string) {
+    const char* chars = stringChars(string);
+    if (chars != NULL) return chars;
+    flattenRope((ObjRope*)string);
+    return stringChars(string);
+}
+
 #endif
\ No newline at end of file
@@ -2,6 +2,7 @@
 #include <string.h>
 
 #include "common.h"
+#include "hash.h"
 #include "scanner.h"
 
 typedef struct {
@@ -87,6 +88,7 @@ static Token makeToken(TokenType type) {
     token.start = scanner.start;
     token.length = (int)(scanner.current - scanner.start);
     token.line = scanner.line;
+    token.hash = 0;
     return token;
 }
 
@@ -96,6 +98,7 @@ static Token errorToken(const char* message) {
     token.start = message;
     token.length = (int)strlen(message);
     token.line = scanner.line;
+    token.hash = 0;
     return token;
 }
 
@@ -172,7 +175,13 @@ static Token number() {
 
 static Token identifier() {
     while (isAlpha(peek()) || isDigit(peek())) advance();
-    return makeToken(identifierType());
+    Token token = makeToken(identifierType());
+    // Hashed while the name is still in cache, the compiler interns and
+    // compares names by it.
+    if (token.type == TOKEN_IDENTIFIER || token.type == TOKEN_THIS) {
+        token.hash = hashString(token.start, token.length);
+    }
+    return token;
 }
 
 Token scanToken() {
@@ -1,6 +1,8 @@
 #ifndef clox_scanner_h
 #define clox_scanner_h
 
+#include "common.h"
+
 typedef enum {
   // Single-character tokens.
   TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
@@ -28,6 +30,7 @@ typedef struct {
     const char* start;
     int length;
     int line;
+    uint32_t hash; // hashString() of identifiers and this, 0 otherwise.
 } Token;
 
 void initScanner(const char* source);
@@ -0,0 +1,254 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "object.h"
+#include "snapshot.h"
+#include "vm.h"
+
+// Longest string start written as a node name or edge label.
+#define SNAPSHOT_NAME_LENGTH 40
+
+static FILE* out;
+
+static void writeName(const char* chars, int length) {
+    if (length > SNAPSHOT_NAME_LENGTH) length = SNAPSHOT_NAME_LENGTH;
+    for (int i = 0; i < length; i++) {
+        switch (chars[i]) {
+            case '\t': fputs("\\t", out); break;
+            case '\n': fputs("\\n", out); break;
+            case '\\': fputs("\\\\", out); break;
+            default: fputc(chars[i], out); break;
+        }
+    }
+}
+
+static void writeEdge(void* from, Obj* to, const char* kind,
+                      const char* label, int index) {
+    if (to == NULL) return;
+    fprintf(out, "E\t%" PRIxPTR "\t%" PRIxPTR "\t%s\t", (uintptr_t)from,
+            (uintptr_t)to, kind);
+    if (label != NULL) writeName(label, (int)strlen(label));
+    if (index >= 0) fprintf(out, "%d", index);
+    fputc('\n', out);
+}
+
+static void writeValueEdge(void* from, Value value, const char* kind,
+                           const char* label, int index) {
+    if (IS_OBJ(value)) writeEdge(from, AS_OBJ(value), kind, label, index);
+}
+
+// Keys and values, values are labeled by their key.
+static void writeTableEdges(void* from, Table* table, const char* kind) {
+    for (int i = 0; i < table->capacity; i++) {
+        Entry* entry = &table->entries[i];
+        if (entry->key == NULL) continue;
+        writeEdge(from, (Obj*)entry->key, "internal", "key", -1);
+        writeValueEdge(from, entry->value, kind, entry->key->chars, -1);
+    }
+}
+
+static size_t tableBytes(Table* table) {
+    return table->capacity == 0 ? 0 : TABLE_BLOCK_SIZE(table->capacity);
+}
+
+// The object plus what only it points to.
+static size_t ownedBytes(Obj* object) {
+    size_t bytes = objectSize(object);
+    switch ((ObjType)object->type) {
+        case OBJ_CLASS:
+            bytes += tableBytes(&((ObjClass*)object)->methods);
+            break;
+        case OBJ_CLOSURE:
+            bytes += sizeof(ObjUpvalue*) * ((ObjClosure*)object)->upvalueCount;
+            break;
+        case OBJ_FUNCTION: {
+            Chunk* chunk = &((ObjFunction*)object)->chunk;
+            bytes += chunk->capacity + sizeof(Value) * chunk->constants.capacity +
+                sizeof(LineStart) * chunk->lineCapacity +
+                sizeof(InlineCache) * chunk->cacheCapacity +
+                sizeof(LoopInfo) * chunk->loopCapacity;
+            break;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*)object;
+            if (instance->slots != instance->inlineSlots) {
+                bytes += sizeof(Value) * instance->slotCapacity;
+            }
+            if (instance->dictionary != NULL) {
+                bytes += sizeof(Table) + tableBytes(instance->dictionary);
+            }
+            break;
+        }
+        case OBJ_SHAPE:
+            bytes += tableBytes(&((ObjShape*)object)->slots) +
+                tableBytes(&((ObjShape*)object)->transitions);
+            break;
+        default:
+            break;
+    }
+    return bytes;
+}
+
+static void writeNode(Obj* object) {
+    fprintf(out, "N\t%" PRIxPTR "\t%s\t%zu\t", (uintptr_t)object,
+            objectTypeName((ObjType)object->type), ownedBytes(object));
+
+    ObjString* name = NULL;
+    switch ((ObjType)object->type) {
+        case OBJ_BOUND_METHOD:
+            name = ((ObjBoundMethod*)object)->method->function->name;
+            break;
+        case OBJ_CLASS: name = ((ObjClass*)object)->name; break;
+        case OBJ_CLOSURE: name = ((ObjClosure*)object)->function->name; break;
+        case OBJ_FUNCTION: name = ((ObjFunction*)object)->name; break;
+        case OBJ_INSTANCE: name = ((ObjInstance*)object)->klass->name; break;
+        case OBJ_STRING: {
+            // Unflattened ropes go without, writing one must not allocate.
+            const char* chars = stringChars((ObjString*)object);
+            if (chars != NULL) {
+                writeName(chars, ((ObjString*)object)->length);
+            }
+            break;
+        }
+        default: break;
+    }
+    if (name != NULL) writeName(name->chars, name->length);
+    fputc('\n', out);
+}
+
+// Same references blackenObject() follows.
+static void writeObject(void* pointer) {
+    Obj* object = (Obj*)pointer;
+    writeNode(object);
+
+    switch ((ObjType)object->type) {
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod* bound = (ObjBoundMethod*)object;
+            writeValueEdge(object, bound->receiver, "field", "receiver", -1);
+            writeEdge(object, (Obj*)bound->method, "field", "method", -1);
+            break;
+        }
+        case OBJ_CLASS: {
+            ObjClass* klass = (ObjClass*)object;
+            writeEdge(object, (Obj*)klass->name, "internal", "name", -1);
+            writeTableEdges(object, &klass->methods, "entry");
+            writeEdge(object, (Obj*)klass->rootShape, "internal", "rootShape", -1);
+            break;
+        }
+        case OBJ_CLOSURE: {
+            ObjClosure* closure = (ObjClosure*)object;
+            writeEdge(object, (Obj*)closure->function, "internal", "function", -1);
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                writeEdge(object, (Obj*)closure->upvalues[i], "upvalue", NULL, i);
+            }
+            break;
+        }
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*)object;
+            writeEdge(object, (Obj*)function->name, "internal", "name", -1);
+            for (int i = 0; i < function->chunk.constants.count; i++) {
+                writeValueEdge(object, function->chunk.constants.values[i],
+                               "constant", NULL, i);
+            }
+            for (int i = 0; i < function->chunk.cacheCount; i++) {
+                InlineCache* cache = &function->chunk.caches[i];
+                for (int j = 0; j < cache->count; j++) {
+                    writeEdge(object, (Obj*)cache->entries[j].shape,
+                              "internal", "cache", i);
+                    writeEdge(object, (Obj*)cache->entries[j].transition,
+                              "internal", "cache", i);
+                    writeValueEdge(object, cache->entries[j].method,
+                                   "internal", "cache", i);
+                }
+            }
+            break;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*)object;
+            writeEdge(object, (Obj*)instance->klass, "internal", "class", -1);
+            if (instance->shape != NULL) {
+                writeEdge(object, (Obj*)instance->shape, "internal", "shape", -1);
+                // Fields are labeled with the names the shape gives the slots.
+                Table* slots = &instance->shape->slots;
+                for (int i = 0; i < slots->capacity; i++) {
+                    Entry* entry = &slots->entries[i];
+                    if (entry->key == NULL) continue;
+                    writeValueEdge(object,
+                                   instance->slots[(int)AS_NUMBER(entry->value)],
+                                   "field", entry->key->chars, -1);
+                }
+            }
+            if (instance->dictionary != NULL) {
+                writeTableEdges(object, instance->dictionary, "field");
+            }
+            break;
+        }
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            writeEdge(object, (Obj*)shape->parent, "internal", "parent", -1);
+            writeEdge(object, (Obj*)shape->name, "internal", "name", -1);
+            writeTableEdges(object, &shape->slots, "internal");
+            writeTableEdges(object, &shape->transitions, "internal");
+            break;
+        }
+        case OBJ_UPVALUE:
+            writeValueEdge(object, ((ObjUpvalue*)object)->closed, "field",
+                           "closed", -1);
+            break;
+        case OBJ_STRING:
+            if (((ObjString*)object)->form == STRING_ROPE) {
+                ObjRope* rope = (ObjRope*)object;
+                writeEdge(object, (Obj*)rope->left, "field", "left", -1);
+                writeEdge(object, (Obj*)rope->right, "field", "right", -1);
+            } else if (((ObjString*)object)->form == STRING_SLICE) {
+                writeEdge(object, (Obj*)((ObjSlice*)object)->parent, "field",
+                          "parent", -1);
+            }
+            break;
+        case OBJ_NATIVE:
+            break;
+    }
+}
+
+// Same roots markRoots() marks. The intern table only holds on to its
+// strings weakly.
+static void writeRoots() {
+    fputs("N\t0\troot\t0\t\n", out);
+    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+        writeValueEdge(NULL, *slot, "root", "stack", (int)(slot - vm.stack));
+    }
+    for (int i = 0; i < vm.frameCount; i++) {
+        writeEdge(NULL, (Obj*)vm.frames[i].closure, "root", "frame", i);
+    }
+    for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL;
+         upvalue = upvalue->next) {
+        writeEdge(NULL, (Obj*)upvalue, "root", "openUpvalue", -1);
+    }
+    for (int i = 0; i < vm.globalValues.count; i++) {
+        const char* name = IS_STRING(vm.globalNames.values[i])
+            ? AS_CSTRING(vm.globalNames.values[i]) : "global";
+        writeValueEdge(NULL, vm.globalValues.values[i], "root", name, -1);
+        writeValueEdge(NULL, vm.globalNames.values[i], "internal", "globalName", i);
+    }
+    // vm.globalSlots maps the same names to numbers.
+    writeEdge(NULL, (Obj*)vm.initString, "internal", "initString", -1);
+}
+
+bool writeHeapSnapshot(const char* path) {
+    out = fopen(path, "w");
+    if (out == NULL) return false;
+    setvbuf(out, NULL, _IOFBF, 1 << 20);
+
+    collectGarbage();
+    fputs("clox heap snapshot 1\n", out);
+    writeRoots();
+    heapWalkObjects(&vm.heap, writeObject);
+
+    bool written = !ferror(out);
+    if (fclose(out) != 0) written = false;
+    out = NULL;
+    return written;
+}
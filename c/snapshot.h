@@ -0,0 +1,23 @@
+#ifndef clox_snapshot_h
+#define clox_snapshot_h
+
+#include "common.h"
+
+// Runs a full collection, so everything left on the heap is reachable,
+// and writes the object graph to path. The file is streamed while the
+// heap is walked, nothing is kept in memory. Returns false if the file
+// can't be written.
+//
+// The format is line based with tab separated fields:
+//   clox heap snapshot 1
+//   N <id> <type> <bytes> <name>
+//   E <from> <to> <kind> <label>
+// Ids are addresses in hex, 0 is the roots. Every node comes with its
+// outgoing edges right after it. bytes counts the object and the arrays
+// and tables only it points to. name is the class of an instance, the name
+// of a class or function, or the start of a string, with tabs, newlines
+// and backslashes escaped. Edge kinds are root, field, upvalue, constant,
+// entry and internal. tools/heapdom.c reads these files.
+bool writeHeapSnapshot(const char* path);
+
+#endif
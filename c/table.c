@@ -6,76 +6,140 @@
 #include "table.h"
 #include "value.h"
 
+#ifdef SIMD_TABLE
+#include <emmintrin.h>
+#endif
+
 #define TABLE_MAX_LOAD 0.75
+// Tables shrink when they get this much emptier than TABLE_MAX_LOAD.
+#define TABLE_SHRINK_FACTOR 8
+
+// Control byte of a full slot, never TABLE_EMPTY.
+#define HASH_TAG(hash) ((uint8_t)((hash) >> 25))
 
 void initTable(Table* table) {
     table->count = 0;
     table->capacity = 0;
     table->entries = NULL;
+    table->control = NULL;
 }
 
 void freeTable(Table* table) {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    if (table->capacity > 0) {
+        reallocate(table->entries, TABLE_BLOCK_SIZE(table->capacity), 0);
+    }
     initTable(table);
 }
 
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
-    // find index from hash
-    uint32_t index = key->hash % capacity;
-    Entry* tombstone = NULL;
+#ifndef SIMD_TABLE
+#define BYTES(byte) ((uint64_t)(byte) * 0x0101010101010101)
+
+// Top bits of the eight bytes packed into one byte, the first byte lowest.
+static inline uint32_t packTopBits(uint64_t word) {
+    return (uint32_t)((((word >> 7) & BYTES(1)) * 0x0102040810204080) >> 56);
+}
+
+// Top bit set in the bytes of the word that are zero.
+static inline uint64_t zeroBytes(uint64_t word) {
+    return ~(((word & BYTES(0x7f)) + BYTES(0x7f)) | word) & BYTES(0x80);
+}
+
+static inline uint64_t loadWord(const uint8_t* bytes) {
+    uint64_t word;
+    memcpy(&word, bytes, sizeof(word));
+    return word;
+}
+#endif
+
+// Bit i is set where control byte i of the group equals tag.
+static inline uint32_t matchTag(const uint8_t* group, uint8_t tag) {
+#ifdef SIMD_TABLE
+    __m128i bytes = _mm_loadu_si128((const __m128i*)group);
+    return (uint32_t)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(bytes, _mm_set1_epi8((char)tag)));
+#else
+    // Two words at a time, little endian.
+    uint64_t tags = BYTES(tag);
+    return packTopBits(zeroBytes(loadWord(group) ^ tags)) |
+           packTopBits(zeroBytes(loadWord(group + 8) ^ tags)) << 8;
+#endif
+}
+
+// Bit i is set where slot i of the group is empty.
+static inline uint32_t matchEmpty(const uint8_t* group) {
+    // Only TABLE_EMPTY has the top bit set.
+#ifdef SIMD_TABLE
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+#else
+    return packTopBits(loadWord(group)) | packTopBits(loadWord(group + 8)) << 8;
+#endif
+}
+
+// Also updates the copies of the first group's bytes. Tables smaller than
+// a group repeat their bytes more than once.
+static void setControl(Table* table, uint32_t slot, uint8_t byte) {
+    uint32_t end = (uint32_t)table->capacity + TABLE_GROUP - 1;
+    for (uint32_t i = slot; i < end; i += table->capacity) {
+        table->control[i] = byte;
+    }
+}
+
+// Slot holding the key, or the empty slot it goes in. Every key sits after
+// its home slot with no empty slot in between, so the first group with an
+// empty slot ends the search.
+static uint32_t findSlot(Table* table, ObjString* key) {
+    uint32_t mask = (uint32_t)table->capacity - 1;
+    uint8_t tag = HASH_TAG(key->hash);
+    uint32_t index = key->hash & mask;
 
     for (;;) {
-        Entry* entry = &entries[index];
-        // fix: Two different string objects might have the same key.
-        if (entry->key == NULL) { 
-            if (IS_NIL(entry->value)) {
-                // empty entry
-                return tombstone != NULL ? tombstone : entry;
-            } else {
-                // Found a tombstone.
-                if (tombstone == NULL) tombstone = entry;
-            }
-        } else if (entry->key == key) {
-            // found the key.
-            return entry;
+        const uint8_t* group = &table->control[index];
+        for (uint32_t matches = matchTag(group, tag); matches != 0;
+             matches &= matches - 1) {
+            uint32_t slot = (index + __builtin_ctz(matches)) & mask;
+            if (table->entries[slot].key == key) return slot;
         }
 
-        // try the next value, linear probing.
-        index = (index + 1) % capacity;
+        uint32_t empty = matchEmpty(group);
+        if (empty != 0) return (index + __builtin_ctz(empty)) & mask;
+        index = (index + TABLE_GROUP) & mask;
     }
 }
 
 static void adjustCapacity(Table* table, int capacity) {
-    Entry* entries = ALLOCATE(Entry, capacity);
+    Table resized;
+    resized.count = table->count;
+    resized.capacity = capacity;
+    resized.entries = (Entry*)reallocate(NULL, 0, TABLE_BLOCK_SIZE(capacity));
+    resized.control = (uint8_t*)(resized.entries + capacity);
     for (int i = 0; i < capacity; i++) {
-        entries[i].key = NULL;
-        entries[i].value = NIL_VAL;
+        resized.entries[i].key = NULL;
+        resized.entries[i].value = NIL_VAL;
     }
+    memset(resized.control, TABLE_EMPTY, capacity + TABLE_GROUP - 1);
 
-    // Rebuilding hash set when expanding
     // Simply reinsert every element again at a new location.
-    table->count = 0; // don't copy tombstones over.
     for (int i = 0; i < table->capacity; i++) {
         Entry* entry = &table->entries[i];
         if (entry->key == NULL) continue;
 
-        // find new location
-        Entry* dest = findEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
+        uint32_t slot = findSlot(&resized, entry->key);
+        resized.entries[slot] = *entry;
+        setControl(&resized, slot, HASH_TAG(entry->key->hash));
     }
 
-    FREE_ARRAY(Entry, table->entries, table->capacity);
-    table->entries = entries;
-    table->capacity = capacity;
+    if (table->capacity > 0) {
+        reallocate(table->entries, TABLE_BLOCK_SIZE(table->capacity), 0);
+    }
+    table->entries = resized.entries;
+    table->control = resized.control;
+    PUBLISH(table->capacity, capacity);
 }
 
 bool tableGet(Table* table, ObjString* key, Value* value) {
     if (table->count == 0) return false;
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-
+    Entry* entry = &table->entries[findSlot(table, key)];
     if (entry->key == NULL) return false;
 
     // way for caller to retrieve the value.
@@ -83,34 +147,79 @@ bool tableGet(Table* table, ObjString* key, Value* value) {
     return true;
 }
 
+// Capacity of a table that lost most of its keys, halved until it is half
+// as full as it may get.
+static int shrunkCapacity(Table* table) {
+    int capacity = table->capacity;
+    while (capacity > 8 && table->count + 1 <= capacity / 2 * TABLE_MAX_LOAD / 2) {
+        capacity /= 2;
+    }
+    return capacity;
+}
+
 bool tableSet(Table* table, ObjString* key, Value value) {
     // allocate memory if necessary
     if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
         int capacity = GROW_CAPACITY(table->capacity);
         adjustCapacity(table, capacity);
+    } else if (table->count <
+               table->capacity * TABLE_MAX_LOAD / TABLE_SHRINK_FACTOR &&
+               table->capacity > 8) {
+        // Deletions and collections only ever empty slots, tables give the
+        // memory back the next time they're written.
+        adjustCapacity(table, shrunkCapacity(table));
     }
-    
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    bool isNewKey = entry->key == NULL;
-    // Only increment if replacing an unused slot. 
-    // Tombstones are counted as used slots to prevent inf loops so we don't
-    // increment for those here.
-    if (isNewKey && IS_NIL(entry->value)) table->count++;
 
+    uint32_t slot = findSlot(table, key);
+    Entry* entry = &table->entries[slot];
+    bool isNewKey = entry->key == NULL;
+    if (isNewKey) {
+        table->count++;
+        setControl(table, slot, HASH_TAG(key->hash));
+    } else {
+        gcOverwriteBarrier(entry->value);
+    }
     entry->key = key;
     entry->value = value;
     return isNewKey;
 }
 
+// Empties the slot and moves the entries after it back into the hole as
+// long as that doesn't put them before their home slot, which keeps every
+// run from a home slot to its key free of empty slots.
+static void removeSlot(Table* table, uint32_t hole) {
+    uint32_t mask = (uint32_t)table->capacity - 1;
+    for (uint32_t slot = (hole + 1) & mask; table->entries[slot].key != NULL;
+         slot = (slot + 1) & mask) {
+        Entry* entry = &table->entries[slot];
+        uint32_t home = entry->key->hash & mask;
+        if (((slot - home) & mask) < ((slot - hole) & mask)) continue;
+
+        // The concurrent marker may look at the hole before the entry
+        // moves in and at the slot after it moved out.
+        gcOverwriteBarrier(OBJ_VAL(entry->key));
+        gcOverwriteBarrier(entry->value);
+        table->entries[hole] = *entry;
+        setControl(table, hole, table->control[slot]);
+        hole = slot;
+    }
+
+    table->entries[hole].key = NULL;
+    table->entries[hole].value = NIL_VAL;
+    setControl(table, hole, TABLE_EMPTY);
+    table->count--;
+}
+
 bool tableDelete(Table* table, ObjString* key) {
     if (table->count == 0) return false;
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
+    uint32_t slot = findSlot(table, key);
+    Entry* entry = &table->entries[slot];
     if (entry->key == NULL) return false;
 
-    // Place a tombstone to not leave probed entries orphaned.
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    gcOverwriteBarrier(OBJ_VAL(entry->key));
+    gcOverwriteBarrier(entry->value);
+    removeSlot(table, slot);
     return true;
 }
 
@@ -123,42 +232,114 @@ void tableAddAll(Table* from, Table* to) {
     }
 }
 
-ObjString* tableFindString(Table* table, const char* chars, 
+ObjString* tableFindString(Table* table, const char* chars,
                            int length, uint32_t hash) {
     if (table->count == 0) return NULL;
 
-    uint32_t index = hash % table->capacity;
+    uint32_t mask = (uint32_t)table->capacity - 1;
+    uint8_t tag = HASH_TAG(hash);
+    uint32_t index = hash & mask;
     for (;;) {
-        Entry* entry = &table->entries[index];
-        if (entry->key == NULL) {
-            // exit if we find empty non-tombstone entry.
-            if (IS_NIL(entry->value)) return NULL;
-        } else if (entry->key->length == length && 
-                   entry->key->hash == hash &&
-                   memcmp(entry->key->chars, chars, length) == 0) {
-            // found match.
-            return entry->key;
+        const uint8_t* group = &table->control[index];
+        for (uint32_t matches = matchTag(group, tag); matches != 0;
+             matches &= matches - 1) {
+            ObjString* key =
+                table->entries[(index + __builtin_ctz(matches)) & mask].key;
+            if (key->length == length && key->hash == hash &&
+                memcmp(key->chars, chars, length) == 0) {
+                // found match. It may be garbage the concurrent marker hasn't
+                // got to, handing it out again has to keep it.
+                gcOverwriteBarrier(OBJ_VAL(key));
+                return key;
+            }
         }
-        index = (index + 1) % table->capacity;
+
+        // exit at the first group with an empty slot.
+        if (matchEmpty(group) != 0) return NULL;
+        index = (index + TABLE_GROUP) & mask;
+    }
+}
+
+// First empty slot from the given one on.
+static uint32_t findEmpty(Table* table, uint32_t index) {
+    uint32_t mask = (uint32_t)table->capacity - 1;
+    for (;;) {
+        uint32_t empty = matchEmpty(&table->control[index]);
+        if (empty != 0) return (index + __builtin_ctz(empty)) & mask;
+        index = (index + TABLE_GROUP) & mask;
     }
 }
 
 // This removes strings from string table to prevent danging pointer references after sweep runs.
-void tableRemoveWhite(Table* table) {
-    for (int i = 0; i < table->capacity; i++) {
-        Entry* entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.isMarked) {
-            tableDelete(table, entry->key);
+// Instead of a removeSlot() per dead key, which moves the same entries over
+// and over when many die, one pass empties their slots and moves each live
+// entry to the first empty slot from its home on. It starts after an empty
+// slot, no entry's probe run crosses that, so the slots before the current
+// one are settled by the time it is looked at.
+int tableRemoveWhite(Table* table) {
+    if (table->count == 0) return 0;
+
+    uint32_t mask = (uint32_t)table->capacity - 1;
+    uint32_t start = findEmpty(table, 0);
+    int removed = 0;
+    for (uint32_t i = 1; i <= mask; i++) {
+        uint32_t slot = (start + i) & mask;
+        Entry* entry = &table->entries[slot];
+        if (entry->key == NULL) continue;
+
+        if (!IS_MARKED(&entry->key->obj)) {
+            entry->key = NULL;
+            entry->value = NIL_VAL;
+            setControl(table, slot, TABLE_EMPTY);
+            removed++;
+            continue;
+        }
+
+        uint32_t home = entry->key->hash & mask;
+        uint32_t empty = findEmpty(table, home);
+        if (((empty - home) & mask) < ((slot - home) & mask)) {
+            table->entries[empty] = *entry;
+            setControl(table, empty, table->control[slot]);
+            entry->key = NULL;
+            entry->value = NIL_VAL;
+            setControl(table, slot, TABLE_EMPTY);
         }
     }
+    table->count -= removed;
+    return removed;
 }
 
 // Loop over hash table and mark every key and object.
 void markTable(Table* table) {
-    for (int i = 0; i < table->capacity; i++) {
+    int capacity = OBSERVE(table->capacity);
+    for (int i = 0; i < capacity; i++) {
         Entry* entry = &table->entries[i];
         // String object keys are also managed by gc.
         markObject((Obj*)entry->key);
         markValue(entry->value);
     }
 }
+
+void tableStats(Table* table, TableStats* stats) {
+    stats->count = table->count;
+    stats->capacity = table->capacity;
+    stats->averageDistance = 0;
+    stats->maxDistance = 0;
+    stats->averageGroups = 0;
+    if (table->count == 0) return;
+
+    uint32_t mask = (uint32_t)table->capacity - 1;
+    double distances = 0;
+    double groups = 0;
+    for (uint32_t slot = 0; slot <= mask; slot++) {
+        ObjString* key = table->entries[slot].key;
+        if (key == NULL) continue;
+
+        int distance = (int)((slot - key->hash) & mask);
+        distances += distance;
+        groups += distance / TABLE_GROUP + 1;
+        if (distance > stats->maxDistance) stats->maxDistance = distance;
+    }
+    stats->averageDistance = distances / table->count;
+    stats->averageGroups = groups / table->count;
+}
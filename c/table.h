@@ -4,6 +4,19 @@
 #include "common.h"
 #include "value.h"
 
+// Open addressing with linear probing over a power of two capacity. Every
+// slot also has a control byte, TABLE_EMPTY or the top seven bits of its
+// key's hash, and probes compare a whole group of those at once before
+// looking at any entry. The first TABLE_GROUP - 1 control bytes repeat
+// after the last one so groups can start at any slot. Deleting moves later
+// entries back instead of leaving tombstones.
+#define TABLE_GROUP 16
+#define TABLE_EMPTY 0x80
+
+// Bytes of the block holding the entries and the control bytes after them.
+#define TABLE_BLOCK_SIZE(capacity) \
+    (sizeof(Entry) * (capacity) + (capacity) + TABLE_GROUP - 1)
+
 typedef struct {
     ObjString* key;
     Value value;
@@ -13,8 +26,18 @@ typedef struct {
     int count;
     int capacity;
     Entry* entries;
+    uint8_t* control;
 } Table;
 
+// How full a table is and how far lookups of its keys go, see tableStats().
+typedef struct {
+    int count;
+    int capacity;
+    double averageDistance; // Slots between a key's home slot and the key.
+    int maxDistance;
+    double averageGroups; // Groups of control bytes a lookup compares.
+} TableStats;
+
 void initTable(Table* table);
 void freeTable(Table* table);
 bool tableGet(Table* table, ObjString* key, Value* value);
@@ -22,7 +45,10 @@ bool tableSet(Table* table, ObjString* key, Value value);
 bool tableDelete(Table* table, ObjString* key);
 void tableAddAll(Table* from, Table* to);
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
-void tableRemoveWhite(Table* table);
+// The table holds on to its keys weakly: removes those that aren't marked
+// and returns how many there were.
+int tableRemoveWhite(Table* table);
 void markTable(Table* table);
+void tableStats(Table* table, TableStats* stats);
 
 #endif
\ No newline at end of file
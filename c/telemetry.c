@@ -0,0 +1,78 @@
+#include <stdio.h>
+
+#include "memory.h"
+#include "object.h"
+#include "telemetry.h"
+#include "vm.h"
+
+// Filled by countObject() during a heap walk.
+static struct {
+    size_t count;
+    size_t bytes;
+} byType[OBJ_TYPE_COUNT];
+
+static void countObject(void* object) {
+    ObjType type = (ObjType)((Obj*)object)->type;
+    byType[type].count++;
+    byType[type].bytes += objectSize((Obj*)object);
+}
+
+void gcWriteTelemetry(FILE* out) {
+    fprintf(out, "{\n");
+    fprintf(out, "  \"collections\": {\"minor\": %llu, \"major\": %llu, "
+                 "\"compactions\": %llu},\n",
+            (unsigned long long)vm.minorCollections,
+            (unsigned long long)vm.majorCollections,
+            (unsigned long long)vm.compactions);
+
+    fprintf(out, "  \"pauses\": {\"total\": %g, \"max\": %g, \"histogram\": [",
+            vm.gcPauseTotal, vm.gcMaxPause);
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        if (i < GC_PAUSE_BUCKETS - 1) {
+            fprintf(out, "{\"underMicros\": %d, ", 1 << i);
+        } else {
+            fprintf(out, "{\"underMicros\": null, ");
+        }
+        fprintf(out, "\"count\": %llu}%s", (unsigned long long)vm.gcPauses[i],
+                i < GC_PAUSE_BUCKETS - 1 ? ", " : "");
+    }
+    fprintf(out, "]},\n");
+    fprintf(out, "  \"bytesFreed\": %zu,\n", vm.bytesFreed);
+
+    fprintf(out, "  \"heap\": {\"allocated\": %zu, \"nextGC\": %zu, "
+                 "\"pageBytes\": %zu, \"fragmentation\": %g},\n",
+            vm.bytesAllocated, vm.nextGC, vm.heap.pageBytes,
+            heapFragmentation(&vm.heap));
+
+    TableStats strings;
+    tableStats(&vm.strings, &strings);
+    fprintf(out, "  \"strings\": {\"count\": %d, \"capacity\": %d, "
+                 "\"occupancy\": %g, \"averageDistance\": %g, "
+                 "\"maxDistance\": %d, \"averageGroups\": %g, "
+                 "\"cleared\": %llu, \"slicesCopied\": %llu},\n",
+            strings.count, strings.capacity,
+            strings.capacity == 0 ? 0 : (double)strings.count / strings.capacity,
+            strings.averageDistance, strings.maxDistance, strings.averageGroups,
+            (unsigned long long)vm.stringsCleared,
+            (unsigned long long)vm.slicesCopied);
+
+    // Garbage nobody swept yet counts too, the heap can't tell it apart.
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+        byType[i].count = 0;
+        byType[i].bytes = 0;
+    }
+    heapWalkObjects(&vm.heap, countObject);
+    fprintf(out, "  \"objects\": {");
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+        fprintf(out, "%s\n    \"%s\": {\"count\": %zu, \"bytes\": %zu}",
+                i > 0 ? "," : "", objectTypeName((ObjType)i), byType[i].count, byType[i].bytes);
+    }
+    fprintf(out, "\n  },\n");
+
+    GcConfig* config = &vm.gcConfig;
+    fprintf(out, "  \"config\": {\"initialHeap\": %zu, \"growFactor\": %g, "
+                 "\"maxHeap\": %zu, \"minInterval\": %zu}\n",
+            config->initialHeap, config->growFactor, config->maxHeap,
+            config->minInterval);
+    fprintf(out, "}\n");
+}
@@ -0,0 +1,13 @@
+#ifndef clox_telemetry_h
+#define clox_telemetry_h
+
+#include <stdio.h>
+
+#include "common.h"
+
+// Writes what the collector did so far as a JSON object: collection counts,
+// a histogram of the pauses, the bytes freed, the state of the heap and the
+// objects on it by type, and vm.gcConfig.
+void gcWriteTelemetry(FILE* out);
+
+#endif
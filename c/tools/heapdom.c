@@ -0,0 +1,565 @@
+// Reads a heap snapshot written by writeHeapSnapshot() and reports what
+// holds on to the memory: the objects with the biggest retained sizes, the
+// top of the dominator tree and the heap by type and class.
+//
+// Build and run from the c/ directory:
+//   cc -O2 -o heapdom tools/heapdom.c
+//   ./heapdom [-n count] [-d depth] [-p percent] snapshot
+//
+// An object dominates another if every path from the roots to the other
+// goes through it, and retains everything it dominates: the memory freed
+// if it became garbage. Dominators are computed with Lengauer-Tarjan.
+// The file is read twice instead of keeping edges around as text, and
+// everything is kept in flat arrays of 32-bit indices, so a snapshot of
+// tens of millions of objects needs well under a hundred bytes per object.
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NONE UINT32_MAX
+
+// Type names the VM writes, in no particular order. The root is node 0.
+static const char* typeNames[] = {
+    "root", "boundMethod", "class", "closure", "function", "instance",
+    "native", "shape", "string", "upvalue",
+};
+#define TYPE_COUNT (sizeof(typeNames) / sizeof(typeNames[0]))
+
+typedef struct {
+    uint32_t count;
+    uint64_t* ids; // Addresses from the snapshot.
+    uint64_t* sizes;
+    uint8_t* types;
+    uint32_t* names; // Index into names, NONE for strings and unnamed nodes.
+    uint32_t* byId; // Node indices sorted by id, for lookups.
+} Nodes;
+
+// Edges of node i are targets[edgeStart[i]] up to edgeStart[i + 1].
+typedef struct {
+    uint32_t count;
+    uint32_t* edgeStart;
+    uint32_t* targets;
+} Graph;
+
+// Names of classes and functions, each kept once.
+static struct {
+    char** strings;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t* slots; // Open addressing into strings.
+    uint32_t slotCount; // Power of two.
+} names;
+
+static void* allocate(size_t size) {
+    void* block = malloc(size == 0 ? 1 : size);
+    if (block == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    return block;
+}
+
+static void* grow(void* block, size_t size) {
+    block = realloc(block, size);
+    if (block == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    return block;
+}
+
+static uint32_t hashName(const char* chars) {
+    uint32_t hash = 2166136261u;
+    for (; *chars != '\0'; chars++) {
+        hash ^= (uint8_t)*chars;
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static uint32_t internName(const char* chars) {
+    if (names.count * 2 >= names.slotCount) {
+        uint32_t slotCount = names.slotCount == 0 ? 256 : names.slotCount * 2;
+        free(names.slots);
+        names.slots = allocate(sizeof(uint32_t) * slotCount);
+        for (uint32_t i = 0; i < slotCount; i++) names.slots[i] = NONE;
+        names.slotCount = slotCount;
+        for (uint32_t i = 0; i < names.count; i++) {
+            uint32_t slot = hashName(names.strings[i]) & (slotCount - 1);
+            while (names.slots[slot] != NONE) slot = (slot + 1) & (slotCount - 1);
+            names.slots[slot] = i;
+        }
+    }
+
+    uint32_t slot = hashName(chars) & (names.slotCount - 1);
+    while (names.slots[slot] != NONE) {
+        if (strcmp(names.strings[names.slots[slot]], chars) == 0) {
+            return names.slots[slot];
+        }
+        slot = (slot + 1) & (names.slotCount - 1);
+    }
+
+    if (names.count == names.capacity) {
+        names.capacity = names.capacity == 0 ? 256 : names.capacity * 2;
+        names.strings = grow(names.strings, sizeof(char*) * names.capacity);
+    }
+    names.strings[names.count] = strdup(chars);
+    names.slots[slot] = names.count;
+    return names.count++;
+}
+
+// Splits a line into its tab separated fields, in place.
+static int splitFields(char* line, char** fields, int max) {
+    int count = 0;
+    line[strcspn(line, "\n")] = '\0';
+    while (count < max) {
+        fields[count++] = line;
+        char* tab = strchr(line, '\t');
+        if (tab == NULL) break;
+        *tab = '\0';
+        line = tab + 1;
+    }
+    return count;
+}
+
+static uint8_t typeOf(const char* name) {
+    for (size_t i = 0; i < TYPE_COUNT; i++) {
+        if (strcmp(typeNames[i], name) == 0) return (uint8_t)i;
+    }
+    fprintf(stderr, "Unknown object type '%s'.\n", name);
+    exit(65);
+}
+
+static const uint64_t* sortIds;
+
+static int compareIds(const void* a, const void* b) {
+    uint64_t left = sortIds[*(const uint32_t*)a];
+    uint64_t right = sortIds[*(const uint32_t*)b];
+    return left < right ? -1 : left > right;
+}
+
+static uint32_t findNode(Nodes* nodes, uint64_t id) {
+    uint32_t low = 0;
+    uint32_t high = nodes->count;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        uint64_t found = nodes->ids[nodes->byId[middle]];
+        if (found == id) return nodes->byId[middle];
+        if (found < id) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return NONE;
+}
+
+static FILE* openSnapshot(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        exit(74);
+    }
+    char* line = NULL;
+    size_t capacity = 0;
+    if (getline(&line, &capacity, file) < 0 ||
+        strcmp(line, "clox heap snapshot 1\n") != 0) {
+        fprintf(stderr, "\"%s\" is not a clox heap snapshot.\n", path);
+        exit(65);
+    }
+    free(line);
+    return file;
+}
+
+// First pass: the nodes, and how many edges each one has. Edges follow the
+// node they start at.
+static void readNodes(const char* path, Nodes* nodes, Graph* graph) {
+    FILE* file = openSnapshot(path);
+    uint32_t capacity = 0;
+    uint32_t edges = 0;
+    char* line = NULL;
+    size_t lineCapacity = 0;
+    char* fields[5];
+
+    nodes->count = 0;
+    graph->edgeStart = NULL;
+    while (getline(&line, &lineCapacity, file) >= 0) {
+        if (line[0] == 'E') {
+            edges++;
+            continue;
+        }
+        if (line[0] != 'N') continue;
+        if (splitFields(line, fields, 5) < 5) continue;
+
+        if (nodes->count == capacity) {
+            capacity = capacity == 0 ? 1024 : capacity * 2;
+            nodes->ids = grow(nodes->ids, sizeof(uint64_t) * capacity);
+            nodes->sizes = grow(nodes->sizes, sizeof(uint64_t) * capacity);
+            nodes->types = grow(nodes->types, sizeof(uint8_t) * capacity);
+            nodes->names = grow(nodes->names, sizeof(uint32_t) * capacity);
+            graph->edgeStart = grow(graph->edgeStart,
+                                    sizeof(uint32_t) * (capacity + 1));
+        }
+        uint32_t node = nodes->count++;
+        nodes->ids[node] = strtoull(fields[1], NULL, 16);
+        nodes->types[node] = typeOf(fields[2]);
+        nodes->sizes[node] = strtoull(fields[3], NULL, 10);
+        // String contents are mostly unique, only their type is kept.
+        bool named = fields[4][0] != '\0' && strcmp(fields[2], "string") != 0;
+        nodes->names[node] = named ? internName(fields[4]) : NONE;
+        graph->edgeStart[node] = edges;
+    }
+    free(line);
+    fclose(file);
+
+    if (nodes->count == 0 || nodes->types[0] != 0) {
+        fprintf(stderr, "The snapshot doesn't start with the roots.\n");
+        exit(65);
+    }
+    graph->count = nodes->count;
+    graph->edgeStart[nodes->count] = edges;
+
+    nodes->byId = allocate(sizeof(uint32_t) * nodes->count);
+    for (uint32_t i = 0; i < nodes->count; i++) nodes->byId[i] = i;
+    sortIds = nodes->ids;
+    qsort(nodes->byId, nodes->count, sizeof(uint32_t), compareIds);
+}
+
+// Second pass: where the edges go. Edges to objects the snapshot doesn't
+// have point back at their own node, which changes no dominators.
+static void readEdges(const char* path, Nodes* nodes, Graph* graph) {
+    FILE* file = openSnapshot(path);
+    graph->targets = allocate(sizeof(uint32_t) * graph->edgeStart[graph->count]);
+    uint32_t node = NONE;
+    uint32_t edge = 0;
+    char* line = NULL;
+    size_t lineCapacity = 0;
+    char* fields[5];
+
+    while (getline(&line, &lineCapacity, file) >= 0) {
+        if (line[0] == 'N') {
+            node = node == NONE ? 0 : node + 1;
+            continue;
+        }
+        if (line[0] != 'E' || node == NONE) continue;
+
+        uint32_t target = NONE;
+        if (splitFields(line, fields, 5) >= 3) {
+            target = findNode(nodes, strtoull(fields[2], NULL, 16));
+        }
+        graph->targets[edge++] = target == NONE ? node : target;
+    }
+    free(line);
+    fclose(file);
+}
+
+// The same edges, reversed.
+static void reverseGraph(Graph* graph, Graph* reversed) {
+    uint32_t count = graph->count;
+    uint32_t edges = graph->edgeStart[count];
+    reversed->count = count;
+    reversed->edgeStart = calloc(count + 1, sizeof(uint32_t));
+    reversed->targets = allocate(sizeof(uint32_t) * edges);
+    if (reversed->edgeStart == NULL) exit(1);
+
+    for (uint32_t i = 0; i < edges; i++) reversed->edgeStart[graph->targets[i] + 1]++;
+    for (uint32_t i = 0; i < count; i++) {
+        reversed->edgeStart[i + 1] += reversed->edgeStart[i];
+    }
+    uint32_t* fill = allocate(sizeof(uint32_t) * count);
+    memcpy(fill, reversed->edgeStart, sizeof(uint32_t) * count);
+    for (uint32_t from = 0; from < count; from++) {
+        for (uint32_t i = graph->edgeStart[from]; i < graph->edgeStart[from + 1]; i++) {
+            reversed->targets[fill[graph->targets[i]]++] = from;
+        }
+    }
+    free(fill);
+}
+
+// Lengauer-Tarjan state, indexed by node except vertex, which goes by
+// preorder number.
+static struct {
+    uint32_t* preorder; // NONE until visited.
+    uint32_t* vertex;
+    uint32_t* parent;
+    uint32_t* semi; // A preorder number.
+    uint32_t* label;
+    uint32_t* ancestor;
+    uint32_t* bucket; // First node whose semidominator this is.
+    uint32_t* nextInBucket;
+    uint32_t* stack;
+} lt;
+
+static void compress(uint32_t node) {
+    uint32_t depth = 0;
+    while (lt.ancestor[lt.ancestor[node]] != NONE) {
+        lt.stack[depth++] = node;
+        node = lt.ancestor[node];
+    }
+    // From the top down, so each node sees its ancestor's final label.
+    while (depth > 0) {
+        node = lt.stack[--depth];
+        uint32_t ancestor = lt.ancestor[node];
+        if (lt.semi[lt.label[ancestor]] < lt.semi[lt.label[node]]) {
+            lt.label[node] = lt.label[ancestor];
+        }
+        lt.ancestor[node] = lt.ancestor[ancestor];
+    }
+}
+
+static uint32_t eval(uint32_t node) {
+    if (lt.ancestor[node] == NONE) return node;
+    compress(node);
+    return lt.label[node];
+}
+
+// Preorder numbers from a depth first search, without recursion: the
+// stack holds nodes, their next edge is kept in nextEdge.
+static uint32_t numberNodes(Graph* graph) {
+    uint32_t count = graph->count;
+    uint32_t* nextEdge = allocate(sizeof(uint32_t) * count);
+    uint32_t visited = 0;
+    uint32_t depth = 0;
+
+    lt.preorder[0] = visited;
+    lt.vertex[visited++] = 0;
+    lt.parent[0] = NONE;
+    nextEdge[0] = graph->edgeStart[0];
+    lt.stack[depth++] = 0;
+    while (depth > 0) {
+        uint32_t node = lt.stack[depth - 1];
+        if (nextEdge[node] == graph->edgeStart[node + 1]) {
+            depth--;
+            continue;
+        }
+        uint32_t target = graph->targets[nextEdge[node]++];
+        if (lt.preorder[target] != NONE) continue;
+
+        lt.preorder[target] = visited;
+        lt.vertex[visited++] = target;
+        lt.parent[target] = node;
+        nextEdge[target] = graph->edgeStart[target];
+        lt.stack[depth++] = target;
+    }
+    free(nextEdge);
+    return visited;
+}
+
+// Returns the immediate dominator of every node, NONE for the root and
+// the nodes it can't reach. Sets *reachable to how many it can and fills
+// order with them in preorder.
+static uint32_t* dominators(Graph* graph, uint32_t* reachable, uint32_t** order) {
+    uint32_t count = graph->count;
+    uint32_t* idom = allocate(sizeof(uint32_t) * count);
+    lt.preorder = allocate(sizeof(uint32_t) * count);
+    lt.vertex = allocate(sizeof(uint32_t) * count);
+    lt.parent = allocate(sizeof(uint32_t) * count);
+    lt.semi = allocate(sizeof(uint32_t) * count);
+    lt.label = allocate(sizeof(uint32_t) * count);
+    lt.ancestor = allocate(sizeof(uint32_t) * count);
+    lt.bucket = allocate(sizeof(uint32_t) * count);
+    lt.nextInBucket = allocate(sizeof(uint32_t) * count);
+    lt.stack = allocate(sizeof(uint32_t) * count);
+    for (uint32_t i = 0; i < count; i++) {
+        lt.preorder[i] = NONE;
+        lt.semi[i] = NONE;
+        lt.label[i] = i;
+        lt.ancestor[i] = NONE;
+        lt.bucket[i] = NONE;
+        idom[i] = NONE;
+    }
+
+    uint32_t visited = numberNodes(graph);
+    for (uint32_t i = 0; i < visited; i++) lt.semi[lt.vertex[i]] = i;
+
+    Graph reversed;
+    reverseGraph(graph, &reversed);
+    for (uint32_t i = visited - 1; i > 0; i--) {
+        uint32_t node = lt.vertex[i];
+        for (uint32_t e = reversed.edgeStart[node]; e < reversed.edgeStart[node + 1]; e++) {
+            uint32_t from = reversed.targets[e];
+            if (lt.preorder[from] == NONE) continue;
+            uint32_t u = eval(from);
+            if (lt.semi[u] < lt.semi[node]) lt.semi[node] = lt.semi[u];
+        }
+        uint32_t semi = lt.vertex[lt.semi[node]];
+        lt.nextInBucket[node] = lt.bucket[semi];
+        lt.bucket[semi] = node;
+
+        uint32_t parent = lt.parent[node];
+        lt.ancestor[node] = parent;
+        for (uint32_t v = lt.bucket[parent]; v != NONE; v = lt.nextInBucket[v]) {
+            uint32_t u = eval(v);
+            idom[v] = lt.semi[u] < lt.semi[v] ? u : parent;
+        }
+        lt.bucket[parent] = NONE;
+    }
+    for (uint32_t i = 1; i < visited; i++) {
+        uint32_t node = lt.vertex[i];
+        if (idom[node] != lt.vertex[lt.semi[node]]) idom[node] = idom[idom[node]];
+    }
+
+    free(reversed.edgeStart);
+    free(reversed.targets);
+    free(lt.preorder);
+    free(lt.parent);
+    free(lt.semi);
+    free(lt.label);
+    free(lt.ancestor);
+    free(lt.bucket);
+    free(lt.nextInBucket);
+    free(lt.stack);
+    *reachable = visited;
+    *order = lt.vertex;
+    return idom;
+}
+
+static const char* nameOf(Nodes* nodes, uint32_t node) {
+    return nodes->names[node] == NONE ? "" : names.strings[nodes->names[node]];
+}
+
+static void printNode(Nodes* nodes, uint64_t* retained, uint32_t node,
+                      int indent) {
+    printf("%14" PRIu64 " %12" PRIu64 "  %*s%-12s %-24s %" PRIx64 "\n",
+           retained[node], nodes->sizes[node], indent * 2, "",
+           typeNames[nodes->types[node]], nameOf(nodes, node), nodes->ids[node]);
+}
+
+// Children in the dominator tree, biggest first.
+static uint64_t* sortRetained;
+
+static int compareRetained(const void* a, const void* b) {
+    uint64_t left = sortRetained[*(const uint32_t*)a];
+    uint64_t right = sortRetained[*(const uint32_t*)b];
+    return left > right ? -1 : left < right;
+}
+
+static void printTree(Nodes* nodes, uint64_t* retained, uint32_t* childStart,
+                      uint32_t* children, uint32_t node, int depth,
+                      int maxDepth, uint64_t minimum) {
+    printNode(nodes, retained, node, depth);
+    if (depth == maxDepth) return;
+    for (uint32_t i = childStart[node]; i < childStart[node + 1]; i++) {
+        if (retained[children[i]] < minimum) break;
+        printTree(nodes, retained, childStart, children, children[i], depth + 1,
+                  maxDepth, minimum);
+    }
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: heapdom [-n count] [-d depth] [-p percent] snapshot\n");
+    exit(64);
+}
+
+int main(int argc, char* argv[]) {
+    int top = 20;
+    int maxDepth = 4;
+    double percent = 1;
+    const char* path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            top = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            maxDepth = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            percent = atof(argv[++i]);
+        } else if (argv[i][0] != '-' && path == NULL) {
+            path = argv[i];
+        } else {
+            usage();
+        }
+    }
+    if (path == NULL) usage();
+
+    Nodes nodes = {0};
+    Graph graph;
+    readNodes(path, &nodes, &graph);
+    readEdges(path, &nodes, &graph);
+    free(nodes.byId);
+
+    uint32_t reachable;
+    uint32_t* order;
+    uint32_t* idom = dominators(&graph, &reachable, &order);
+    free(graph.edgeStart);
+    free(graph.targets);
+
+    // Dominators come before what they dominate in preorder, so going
+    // backwards every node is done before it's added to its dominator.
+    uint64_t* retained = calloc(nodes.count, sizeof(uint64_t));
+    if (retained == NULL) exit(1);
+    for (uint32_t i = reachable; i-- > 0;) {
+        uint32_t node = order[i];
+        retained[node] += nodes.sizes[node];
+        if (idom[node] != NONE) retained[idom[node]] += retained[node];
+    }
+
+    printf("%" PRIu32 " objects, %" PRIu32 " reachable, %" PRIu64 " bytes retained "
+           "by the roots\n", nodes.count - 1, reachable - 1, retained[0]);
+
+    // The dominator tree, children grouped by node and sorted.
+    uint32_t* childStart = calloc(nodes.count + 1, sizeof(uint32_t));
+    uint32_t* children = allocate(sizeof(uint32_t) * reachable);
+    if (childStart == NULL) exit(1);
+    for (uint32_t i = 0; i < nodes.count; i++) {
+        if (idom[i] != NONE) childStart[idom[i] + 1]++;
+    }
+    for (uint32_t i = 0; i < nodes.count; i++) childStart[i + 1] += childStart[i];
+    uint32_t* fill = allocate(sizeof(uint32_t) * nodes.count);
+    memcpy(fill, childStart, sizeof(uint32_t) * nodes.count);
+    for (uint32_t i = 0; i < nodes.count; i++) {
+        if (idom[i] != NONE) children[fill[idom[i]]++] = i;
+    }
+    free(fill);
+    sortRetained = retained;
+    for (uint32_t i = 0; i < nodes.count; i++) {
+        qsort(&children[childStart[i]], childStart[i + 1] - childStart[i],
+              sizeof(uint32_t), compareRetained);
+    }
+
+    printf("\nLargest retained sizes:\n");
+    printf("%14s %12s  %-12s %-24s %s\n", "retained", "self", "type", "name", "id");
+    // order is free to reuse, sort the reachable objects by retained size.
+    qsort(order, reachable, sizeof(uint32_t), compareRetained);
+    int shown = 0;
+    for (uint32_t i = 0; i < reachable && shown < top; i++) {
+        if (order[i] == 0) continue;
+        printNode(&nodes, retained, order[i], 0);
+        shown++;
+    }
+
+    printf("\nDominator tree, %g%% of the heap or more:\n", percent);
+    printf("%14s %12s  %-12s %-24s %s\n", "retained", "self", "type", "name", "id");
+    printTree(&nodes, retained, childStart, children, 0, 0, maxDepth,
+              (uint64_t)(retained[0] * percent / 100));
+
+    // Shallow sizes by type and name, instances are named by their class.
+    printf("\nBy type and name:\n");
+    printf("%14s %12s  %-12s %s\n", "bytes", "objects", "type", "name");
+    uint32_t groupCount = (uint32_t)TYPE_COUNT * (names.count + 1);
+    uint64_t* groupBytes = calloc(groupCount, sizeof(uint64_t));
+    uint64_t* groupObjects = calloc(groupCount, sizeof(uint64_t));
+    if (groupBytes == NULL || groupObjects == NULL) exit(1);
+    for (uint32_t i = 1; i < nodes.count; i++) {
+        if (idom[i] == NONE) continue;
+        uint32_t name = nodes.names[i] == NONE ? names.count : nodes.names[i];
+        uint32_t group = nodes.types[i] * (names.count + 1) + name;
+        groupBytes[group] += nodes.sizes[i];
+        groupObjects[group]++;
+    }
+    uint32_t* groups = allocate(sizeof(uint32_t) * groupCount);
+    for (uint32_t i = 0; i < groupCount; i++) groups[i] = i;
+    sortRetained = groupBytes;
+    qsort(groups, groupCount, sizeof(uint32_t), compareRetained);
+    for (uint32_t i = 0; i < groupCount && i < (uint32_t)top; i++) {
+        uint32_t group = groups[i];
+        if (groupObjects[group] == 0) break;
+        uint32_t name = group % (names.count + 1);
+        printf("%14" PRIu64 " %12" PRIu64 "  %-12s %s\n", groupBytes[group],
+               groupObjects[group], typeNames[group / (names.count + 1)],
+               name == names.count ? "" : names.strings[name]);
+    }
+    return 0;
+}
@@ -0,0 +1,850 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "assembler.h"
+#include "memory.h"
+#include "trace.h"
+
+#ifdef TRACE_JIT
+
+// A tracing JIT for loops over numbers. Once a loop is hot, the recorder
+// runs one iteration itself and writes down what it did as a linear list of
+// register operations, turning each branch it took into a guard. Constant
+// operands are folded on the spot. The list is compiled with every variable
+// the loop touches pinned to an xmm register while the trace runs, so an
+// iteration never touches memory. A failing guard is a side exit: it writes
+// the variables back, pushes what the interpreter expects on the stack and
+// returns to run() at the other side of the branch.
+//
+// Anything but number arithmetic, comparisons, jumps, locals and globals
+// aborts the recording, the loop then stays interpreted.
+
+// Longest iteration that is recorded, in instructions.
+#define TRACE_MAX_INSTRUCTIONS 256
+// OP_LOOPs one iteration may pass. Taking one twice means an inner loop,
+// which gets its own trace.
+#define TRACE_MAX_LOOPS 4
+
+// xmm0 and xmm1 are scratch. Values on the stack above the loop's locals
+// live in xmm2-xmm7 by depth, each variable gets one of xmm8-xmm15.
+#define TEMP_FIRST 2
+#define TEMP_COUNT 6
+#define VARIABLE_FIRST 8
+#define VARIABLE_COUNT 8
+
+#define SSE_MOVE 0x28 // movapd, with the 0x66 prefix.
+#define SSE_XOR 0x57 // xorpd, with the 0x66 prefix.
+#define SSE_COMPARE 0x2E // ucomisd, with the 0x66 prefix.
+
+#define SHORT(bytes) ((uint16_t)(((bytes)[0] << 8) | (bytes)[1]))
+
+// A number, either the register holding it or a constant folded while
+// recording.
+typedef struct {
+    bool constant;
+    int reg;
+    double number;
+} Operand;
+
+typedef enum {
+    VALUE_NUMBER,
+    VALUE_BOOL, // Known while recording.
+    VALUE_COMPARE, // Only known at run time, consumed by a jump or a pop.
+} ValueKind;
+
+// A value on the stack above the loop's locals.
+typedef struct {
+    ValueKind kind;
+    Operand a;
+    Operand b; // Right operand of a comparison.
+    OpCode compare; // OP_LESS, OP_GREATER or OP_EQUAL.
+    bool boolean; // A bool's value, or whether a comparison was negated.
+} TraceValue;
+
+// A local below the trace's part of the stack or a global, kept in one
+// register for as long as the trace runs.
+typedef struct {
+    bool global;
+    int index;
+    bool loaded; // Read before written, the trace checks it's a number on entry.
+    bool written; // Written back on every exit.
+} Variable;
+
+typedef enum {
+    IR_MOVE, // dst = a
+    IR_ARITHMETIC, // dst = a op b
+    IR_NEGATE, // dst = -a
+    IR_GUARD, // Leaves through exit unless (a op b) == expect.
+} IrOp;
+
+typedef struct {
+    IrOp op;
+    OpCode arithmetic; // The binary instruction this stands for.
+    int dst;
+    Operand a;
+    Operand b;
+    bool expect;
+    int exit;
+} Ir;
+
+// What the stack above the locals holds when a guard fails.
+typedef struct {
+    uint8_t* ip;
+    int stackCount;
+    TraceValue stack[TEMP_COUNT];
+} Exit;
+
+typedef struct {
+    CallFrame* frame;
+    Chunk* chunk;
+    int base; // Stack depth at the loop header, the slots below are variables.
+    TraceValue stack[TEMP_COUNT];
+    int stackCount;
+    Variable variables[VARIABLE_COUNT];
+    int variableCount;
+    int loops[TRACE_MAX_LOOPS];
+    int loopCount;
+    Ir* ir;
+    int irCount;
+    int irCapacity;
+    Exit* exits;
+    int exitCount;
+    int exitCapacity;
+} Recorder;
+
+typedef int (*TraceEntry)(Value* slots, Value* globals);
+
+static Operand inRegister(int reg) {
+    return (Operand){false, reg, 0};
+}
+
+static Operand constant(double number) {
+    return (Operand){true, 0, number};
+}
+
+static TraceValue numberValue(Operand operand) {
+    return (TraceValue){.kind = VALUE_NUMBER, .a = operand};
+}
+
+static TraceValue boolValue(bool boolean) {
+    return (TraceValue){.kind = VALUE_BOOL, .boolean = boolean};
+}
+
+static int temp(int depth) {
+    return TEMP_FIRST + depth;
+}
+
+static bool sameOperand(Operand a, Operand b) {
+    return a.constant == b.constant &&
+           (a.constant ? a.number == b.number : a.reg == b.reg);
+}
+
+static bool readsRegister(Operand operand, int reg) {
+    return !operand.constant && operand.reg == reg;
+}
+
+static void emitIr(Recorder* r, Ir ir) {
+    if (r->irCapacity < r->irCount + 1) {
+        r->irCapacity = GROW_CAPACITY(r->irCapacity);
+        r->ir = realloc(r->ir, sizeof(Ir) * r->irCapacity);
+        if (r->ir == NULL) exit(1);
+    }
+    r->ir[r->irCount++] = ir;
+}
+
+// Snapshots the stack for an exit to ip.
+static int addExit(Recorder* r, uint8_t* ip) {
+    if (r->exitCapacity < r->exitCount + 1) {
+        r->exitCapacity = GROW_CAPACITY(r->exitCapacity);
+        r->exits = realloc(r->exits, sizeof(Exit) * r->exitCapacity);
+        if (r->exits == NULL) exit(1);
+    }
+    Exit* exit = &r->exits[r->exitCount];
+    exit->ip = ip;
+    exit->stackCount = r->stackCount;
+    memcpy(exit->stack, r->stack, sizeof(TraceValue) * r->stackCount);
+    return r->exitCount++;
+}
+
+// Recording executes each instruction for real. An instruction that can't
+// be recorded must be rejected before it changed anything, so run() can
+// pick up right there.
+
+// Only one comparison can be in flight, nothing may be pushed on top of it.
+static bool canPush(Recorder* r, int count) {
+    if (r->stackCount + count > TEMP_COUNT) return false;
+    return r->stackCount == 0 ||
+           r->stack[r->stackCount - 1].kind != VALUE_COMPARE;
+}
+
+static void pushValue(Recorder* r, TraceValue entry, Value value) {
+    r->stack[r->stackCount++] = entry;
+    push(value);
+}
+
+static Variable* findVariable(Recorder* r, bool global, int index) {
+    for (int i = 0; i < r->variableCount; i++) {
+        Variable* variable = &r->variables[i];
+        if (variable->global == global && variable->index == index) return variable;
+    }
+    if (r->variableCount == VARIABLE_COUNT) return NULL;
+
+    Variable* variable = &r->variables[r->variableCount++];
+    *variable = (Variable){global, index, false, false};
+    return variable;
+}
+
+static int variableRegister(Recorder* r, Variable* variable) {
+    return VARIABLE_FIRST + (int)(variable - r->variables);
+}
+
+static bool readVariable(Recorder* r, bool global, int index, Operand* operand) {
+    Variable* variable = findVariable(r, global, index);
+    if (variable == NULL) return false;
+    if (!variable->written) variable->loaded = true;
+    *operand = inRegister(variableRegister(r, variable));
+    return true;
+}
+
+static bool readLocal(Recorder* r, int slot, Operand* operand) {
+    if (!IS_NUMBER(r->frame->slots[slot])) return false;
+    if (slot >= r->base) {
+        *operand = r->stack[slot - r->base].a;
+        return true;
+    }
+    return readVariable(r, false, slot, operand);
+}
+
+// Gives stack values from 'from' up that still read 'reg' a copy in their
+// own register, reg is about to be overwritten.
+static bool detach(Recorder* r, int reg, int from) {
+    for (int i = from; i < r->stackCount; i++) {
+        TraceValue* entry = &r->stack[i];
+        if (entry->kind == VALUE_COMPARE) {
+            if (readsRegister(entry->a, reg) || readsRegister(entry->b, reg)) {
+                return false;
+            }
+        } else if (entry->kind == VALUE_NUMBER && readsRegister(entry->a, reg) &&
+                   reg != temp(i)) {
+            emitIr(r, (Ir){.op = IR_MOVE, .dst = temp(i), .a = entry->a});
+            entry->a = inRegister(temp(i));
+        }
+    }
+    return true;
+}
+
+static bool writeVariable(Recorder* r, bool global, int index, Operand value) {
+    Variable* variable = findVariable(r, global, index);
+    if (variable == NULL) return false;
+    int reg = variableRegister(r, variable);
+    if (!detach(r, reg, 0)) return false;
+
+    variable->written = true;
+    if (!readsRegister(value, reg)) {
+        emitIr(r, (Ir){.op = IR_MOVE, .dst = reg, .a = value});
+    }
+    return true;
+}
+
+static bool writeLocal(Recorder* r, int slot, Operand value) {
+    if (slot < r->base) return writeVariable(r, false, slot, value);
+
+    int depth = slot - r->base;
+    int reg = temp(depth);
+    if (!detach(r, reg, depth + 1)) return false;
+    if (value.constant) {
+        r->stack[depth] = numberValue(value);
+        return true;
+    }
+    if (value.reg != reg) emitIr(r, (Ir){.op = IR_MOVE, .dst = reg, .a = value});
+    r->stack[depth] = numberValue(inRegister(reg));
+    return true;
+}
+
+static double arithmetic(OpCode op, double a, double b) {
+    switch (op) {
+        case OP_SUBTRACT: return a - b;
+        case OP_MULTIPLY: return a * b;
+        case OP_DIVIDE: return a / b;
+        default: return a + b;
+    }
+}
+
+static bool compare(OpCode op, double a, double b) {
+    switch (op) {
+        case OP_LESS: return a < b;
+        case OP_GREATER: return a > b;
+        default: return a == b;
+    }
+}
+
+// dst = a op b, folded if both are constants.
+static Operand recordArithmetic(Recorder* r, OpCode op, Operand a, Operand b,
+                                int dst) {
+    if (a.constant && b.constant) {
+        return constant(arithmetic(op, a.number, b.number));
+    }
+    emitIr(r, (Ir){.op = IR_ARITHMETIC, .arithmetic = op, .dst = dst,
+                   .a = a, .b = b});
+    return inRegister(dst);
+}
+
+// Stack arithmetic and comparisons. Quickened forms pass their generic op.
+static bool recordBinary(Recorder* r, OpCode op) {
+    if (r->stackCount < 2) return false;
+    Value left = vm.stackTop[-2];
+    Value right = vm.stackTop[-1];
+    if (!IS_NUMBER(left) || !IS_NUMBER(right)) return false;
+
+    double x = AS_NUMBER(left);
+    double y = AS_NUMBER(right);
+    Operand a = r->stack[r->stackCount - 2].a;
+    Operand b = r->stack[r->stackCount - 1].a;
+    TraceValue entry;
+    Value value;
+    if (op == OP_LESS || op == OP_GREATER || op == OP_EQUAL) {
+        value = BOOL_VAL(compare(op, x, y));
+        if (a.constant && b.constant) {
+            entry = boolValue(AS_BOOL(value));
+        } else {
+            entry = (TraceValue){.kind = VALUE_COMPARE, .a = a, .b = b, .compare = op};
+        }
+    } else {
+        value = NUMBER_VAL(arithmetic(op, x, y));
+        entry = numberValue(recordArithmetic(r, op, a, b, temp(r->stackCount - 2)));
+    }
+
+    r->stackCount--;
+    r->stack[r->stackCount - 1] = entry;
+    vm.stackTop--;
+    vm.stackTop[-1] = value;
+    return true;
+}
+
+static bool recordNegate(Recorder* r) {
+    if (r->stackCount == 0 || !IS_NUMBER(vm.stackTop[-1])) return false;
+    TraceValue* entry = &r->stack[r->stackCount - 1];
+    if (entry->a.constant) {
+        entry->a.number = -entry->a.number;
+    } else {
+        int dst = temp(r->stackCount - 1);
+        emitIr(r, (Ir){.op = IR_NEGATE, .dst = dst, .a = entry->a});
+        entry->a = inRegister(dst);
+    }
+    vm.stackTop[-1] = NUMBER_VAL(-AS_NUMBER(vm.stackTop[-1]));
+    return true;
+}
+
+static bool recordNot(Recorder* r) {
+    if (r->stackCount == 0) return false;
+    TraceValue* entry = &r->stack[r->stackCount - 1];
+    if (entry->kind == VALUE_NUMBER) {
+        *entry = boolValue(false);
+    } else {
+        entry->boolean = !entry->boolean;
+    }
+    vm.stackTop[-1] = BOOL_VAL(isFalsey(vm.stackTop[-1]));
+    return true;
+}
+
+// The condition stays on the stack. A comparison becomes a guard that
+// leaves for the branch not taken while recording.
+static uint8_t* recordJumpIfFalse(Recorder* r, uint8_t* next, uint16_t offset) {
+    if (r->stackCount == 0) return NULL;
+    TraceValue* entry = &r->stack[r->stackCount - 1];
+    bool taken = isFalsey(vm.stackTop[-1]);
+    if (entry->kind == VALUE_COMPARE) {
+        TraceValue condition = *entry;
+        // On the other branch the condition has the opposite value.
+        *entry = boolValue(taken);
+        int exit = addExit(r, taken ? next : next + offset);
+        emitIr(r, (Ir){.op = IR_GUARD, .arithmetic = condition.compare,
+                       .a = condition.a, .b = condition.b,
+                       .expect = !taken != condition.boolean, .exit = exit});
+        *entry = boolValue(!taken);
+    }
+    return taken ? next + offset : next;
+}
+
+static bool recordGetLocal(Recorder* r, int slot) {
+    Operand operand;
+    if (!canPush(r, 1) || !readLocal(r, slot, &operand)) return false;
+    pushValue(r, numberValue(operand), r->frame->slots[slot]);
+    return true;
+}
+
+static bool recordSetLocal(Recorder* r, int slot) {
+    if (r->stackCount == 0 || !IS_NUMBER(vm.stackTop[-1])) return false;
+    if (!writeLocal(r, slot, r->stack[r->stackCount - 1].a)) return false;
+    r->frame->slots[slot] = vm.stackTop[-1];
+    return true;
+}
+
+// Register instructions compute into the next free temporary, then move the
+// result into the destination.
+static bool recordRegisterOp(Recorder* r, uint8_t* ip) {
+    Value* constants = r->chunk->constants.values;
+    Value* slots = r->frame->slots;
+    if (!canPush(r, 1)) return false;
+
+    Operand result;
+    Value value;
+    if (ip[0] == OP_MOVE) {
+        if (!readLocal(r, ip[2], &result)) return false;
+        value = slots[ip[2]];
+    } else if (ip[0] == OP_LOAD_CONSTANT) {
+        value = constants[ip[2]];
+        if (!IS_NUMBER(value)) return false;
+        result = constant(AS_NUMBER(value));
+    } else {
+        static const OpCode ops[] = {OP_ADD, OP_SUBTRACT, OP_MULTIPLY, OP_DIVIDE};
+        OpCode op = ops[(ip[0] - OP_ADD_RR) / 3];
+        int form = (ip[0] - OP_ADD_RR) % 3;
+        Value left = form == 2 ? constants[ip[2]] : slots[ip[2]];
+        Value right = form == 1 ? constants[ip[3]] : slots[ip[3]];
+        if (!IS_NUMBER(left) || !IS_NUMBER(right)) return false;
+
+        Operand a = constant(AS_NUMBER(left));
+        Operand b = constant(AS_NUMBER(right));
+        if (form != 2 && !readLocal(r, ip[2], &a)) return false;
+        if (form != 1 && !readLocal(r, ip[3], &b)) return false;
+        result = recordArithmetic(r, op, a, b, temp(r->stackCount));
+        value = NUMBER_VAL(arithmetic(op, AS_NUMBER(left), AS_NUMBER(right)));
+    }
+
+    if (!writeLocal(r, ip[1], result)) return false;
+    slots[ip[1]] = value;
+    return true;
+}
+
+// Records and executes the instruction at ip. Returns the next instruction,
+// or NULL if it can't be recorded.
+static uint8_t* recordInstruction(Recorder* r, uint8_t* ip, uint8_t* header) {
+    Value* constants = r->chunk->constants.values;
+    Value* slots = r->frame->slots;
+    switch (ip[0]) {
+        case OP_CONSTANT: {
+            Value value = constants[ip[1]];
+            if (!IS_NUMBER(value) || !canPush(r, 1)) return NULL;
+            pushValue(r, numberValue(constant(AS_NUMBER(value))), value);
+            return ip + 2;
+        }
+        case OP_TRUE:
+        case OP_FALSE: {
+            if (!canPush(r, 1)) return NULL;
+            bool boolean = ip[0] == OP_TRUE;
+            pushValue(r, boolValue(boolean), BOOL_VAL(boolean));
+            return ip + 1;
+        }
+        case OP_POP:
+            if (r->stackCount == 0) return NULL;
+            r->stackCount--;
+            pop();
+            return ip + 1;
+        case OP_GET_LOCAL:
+            return recordGetLocal(r, ip[1]) ? ip + 2 : NULL;
+        case OP_SET_LOCAL:
+            return recordSetLocal(r, ip[1]) ? ip + 2 : NULL;
+        case OP_SET_LOCAL_POP:
+            if (!recordSetLocal(r, ip[1])) return NULL;
+            r->stackCount--;
+            pop();
+            return ip + 2;
+        case OP_GET_LOCAL_GET_LOCAL: {
+            Operand a, b;
+            if (!canPush(r, 2) || !readLocal(r, ip[1], &a) ||
+                !readLocal(r, ip[2], &b)) {
+                return NULL;
+            }
+            pushValue(r, numberValue(a), slots[ip[1]]);
+            pushValue(r, numberValue(b), slots[ip[2]]);
+            return ip + 3;
+        }
+        case OP_ADD_LOCAL_CONST: {
+            Value value = constants[ip[2]];
+            Operand a;
+            if (!IS_NUMBER(value) || !canPush(r, 1) || !readLocal(r, ip[1], &a)) {
+                return NULL;
+            }
+            Operand result = recordArithmetic(r, OP_ADD, a, constant(AS_NUMBER(value)),
+                                              temp(r->stackCount));
+            pushValue(r, numberValue(result),
+                      NUMBER_VAL(AS_NUMBER(slots[ip[1]]) + AS_NUMBER(value)));
+            return ip + 3;
+        }
+        case OP_GET_GLOBAL: {
+            int slot = SHORT(ip + 1);
+            Value value = vm.globalValues.values[slot];
+            Operand operand;
+            if (!IS_NUMBER(value) || !canPush(r, 1) ||
+                !readVariable(r, true, slot, &operand)) {
+                return NULL;
+            }
+            pushValue(r, numberValue(operand), value);
+            return ip + 3;
+        }
+        case OP_SET_GLOBAL: {
+            int slot = SHORT(ip + 1);
+            // Assigning an undefined global is an error, run() reports it.
+            if (IS_UNDEFINED(vm.globalValues.values[slot]) || r->stackCount == 0 ||
+                !IS_NUMBER(vm.stackTop[-1]) ||
+                !writeVariable(r, true, slot, r->stack[r->stackCount - 1].a)) {
+                return NULL;
+            }
+            vm.globalValues.values[slot] = vm.stackTop[-1];
+            return ip + 3;
+        }
+        case OP_ADD:
+        case OP_ADD_NUM:
+            return recordBinary(r, OP_ADD) ? ip + 1 : NULL;
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_LESS:
+        case OP_GREATER:
+            return recordBinary(r, ip[0]) ? ip + 1 : NULL;
+        case OP_EQUAL:
+        case OP_EQUAL_NUM:
+            return recordBinary(r, OP_EQUAL) ? ip + 1 : NULL;
+        case OP_NEGATE:
+            return recordNegate(r) ? ip + 1 : NULL;
+        case OP_NOT:
+            return recordNot(r) ? ip + 1 : NULL;
+        case OP_JUMP_IF_FALSE:
+            return recordJumpIfFalse(r, ip + 3, SHORT(ip + 1));
+        case OP_LESS_JUMP_IF_FALSE:
+            if (!recordBinary(r, OP_LESS)) return NULL;
+            return recordJumpIfFalse(r, ip + 3, SHORT(ip + 1));
+        case OP_JUMP:
+            return ip + 3 + SHORT(ip + 1);
+        case OP_LOOP: {
+            uint8_t* target = ip + 5 - SHORT(ip + 1);
+            if (target == header) return target;
+
+            int loop = SHORT(ip + 3);
+            if (r->chunk->loops[loop].trace != NULL) return NULL;
+            for (int i = 0; i < r->loopCount; i++) {
+                if (r->loops[i] == loop) return NULL;
+            }
+            if (r->loopCount == TRACE_MAX_LOOPS) return NULL;
+            r->loops[r->loopCount++] = loop;
+            return target;
+        }
+        case OP_MOVE:
+        case OP_LOAD_CONSTANT:
+            return recordRegisterOp(r, ip) ? ip + 3 : NULL;
+        case OP_ADD_RR:
+        case OP_ADD_RK:
+        case OP_ADD_KR:
+        case OP_SUBTRACT_RR:
+        case OP_SUBTRACT_RK:
+        case OP_SUBTRACT_KR:
+        case OP_MULTIPLY_RR:
+        case OP_MULTIPLY_RK:
+        case OP_MULTIPLY_KR:
+        case OP_DIVIDE_RR:
+        case OP_DIVIDE_RK:
+        case OP_DIVIDE_KR:
+            return recordRegisterOp(r, ip) ? ip + 4 : NULL;
+        default:
+            return NULL;
+    }
+}
+
+// Optimizations over the recorded list.
+
+static bool writesRegister(Ir* ir, int reg) {
+    return ir->op != IR_GUARD && ir->dst == reg;
+}
+
+// A guard that repeats an earlier one can't fail if neither operand was
+// written in between.
+static bool redundantGuard(Ir* ir, int count, Ir* guard) {
+    for (int i = count - 1; i >= 0; i--) {
+        if ((!guard->a.constant && writesRegister(&ir[i], guard->a.reg)) ||
+            (!guard->b.constant && writesRegister(&ir[i], guard->b.reg))) {
+            return false;
+        }
+        if (ir[i].op == IR_GUARD && ir[i].arithmetic == guard->arithmetic &&
+            ir[i].expect == guard->expect && sameOperand(ir[i].a, guard->a) &&
+            sameOperand(ir[i].b, guard->b)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void eliminateGuards(Recorder* r) {
+    int count = 0;
+    for (int i = 0; i < r->irCount; i++) {
+        if (r->ir[i].op == IR_GUARD && redundantGuard(r->ir, count, &r->ir[i])) {
+            continue;
+        }
+        r->ir[count++] = r->ir[i];
+    }
+    r->irCount = count;
+}
+
+// Whether reg is read, directly or by an exit, before it is written again.
+// Temporaries are dead at the end of an iteration.
+static bool isRead(Recorder* r, int from, int reg) {
+    for (int i = from; i < r->irCount; i++) {
+        Ir* ir = &r->ir[i];
+        if (readsRegister(ir->a, reg)) return true;
+        if (ir->op == IR_ARITHMETIC || ir->op == IR_GUARD) {
+            if (readsRegister(ir->b, reg)) return true;
+        }
+        if (ir->op == IR_GUARD) {
+            Exit* exit = &r->exits[ir->exit];
+            for (int j = 0; j < exit->stackCount; j++) {
+                if (exit->stack[j].kind == VALUE_NUMBER &&
+                    readsRegister(exit->stack[j].a, reg)) {
+                    return true;
+                }
+            }
+        }
+        if (writesRegister(ir, reg)) return false;
+    }
+    return false;
+}
+
+// Computing into a temporary only to move it into a variable, as in
+// i = i + 1, computes into the variable instead.
+static void coalesceMoves(Recorder* r) {
+    int count = 0;
+    for (int i = 0; i < r->irCount; i++) {
+        Ir* ir = &r->ir[i];
+        if (count > 0 && ir->op == IR_MOVE && !ir->a.constant &&
+            ir->a.reg < VARIABLE_FIRST) {
+            Ir* previous = &r->ir[count - 1];
+            if (writesRegister(previous, ir->a.reg) && !isRead(r, i + 1, ir->a.reg)) {
+                previous->dst = ir->dst;
+                continue;
+            }
+        }
+        r->ir[count++] = *ir;
+    }
+    r->irCount = count;
+}
+
+// Code generation.
+
+// Returns a register holding the operand, constants are loaded into scratch.
+static int loadOperand(Assembler* as, Operand operand, int scratch) {
+    if (!operand.constant) return operand.reg;
+    emitMoveImmediate(as, RAX, NUMBER_VAL(operand.number));
+    emitToXmm(as, scratch, RAX);
+    return scratch;
+}
+
+// movapd rather than movsd, which would wait for the register's old value.
+static void moveXmm(Assembler* as, int dst, int src) {
+    if (dst != src) emitSseRegisters(as, 0x66, SSE_MOVE, dst, src);
+}
+
+static void emitGuard(Assembler* as, Ir* ir) {
+    int a = loadOperand(as, ir->a, 0);
+    int b = loadOperand(as, ir->b, 1);
+    if (ir->arithmetic == OP_EQUAL) {
+        // Unordered operands set ZF and PF, NaN never equals anything.
+        emitSseRegisters(as, 0x66, SSE_COMPARE, a, b);
+        if (ir->expect) {
+            emitJumpTo(as, X86_JP, ir->exit);
+            emitJumpTo(as, X86_JNE, ir->exit);
+        } else {
+            int unordered = emitJump(as, X86_JP);
+            emitJumpTo(as, X86_JE, ir->exit);
+            patchJump(as, unordered, as->count);
+        }
+        return;
+    }
+
+    // 'above' is only set for ordered operands. a < b is tested as b > a.
+    if (ir->arithmetic == OP_LESS) {
+        emitSseRegisters(as, 0x66, SSE_COMPARE, b, a);
+    } else {
+        emitSseRegisters(as, 0x66, SSE_COMPARE, a, b);
+    }
+    emitJumpTo(as, ir->expect ? X86_JBE : X86_JA, ir->exit);
+}
+
+static void emitIrInstruction(Assembler* as, Ir* ir) {
+    switch (ir->op) {
+        case IR_MOVE:
+            if (ir->a.constant) {
+                loadOperand(as, ir->a, ir->dst);
+            } else {
+                moveXmm(as, ir->dst, ir->a.reg);
+            }
+            break;
+        case IR_ARITHMETIC: {
+            uint8_t op = ir->arithmetic == OP_SUBTRACT ? SSE_SUB :
+                         ir->arithmetic == OP_MULTIPLY ? SSE_MUL :
+                         ir->arithmetic == OP_DIVIDE ? SSE_DIV : SSE_ADD;
+            int b = loadOperand(as, ir->b, 1);
+            if (readsRegister(ir->a, ir->dst) && b != ir->dst) {
+                emitSseRegisters(as, 0xF2, op, ir->dst, b);
+            } else {
+                moveXmm(as, 0, loadOperand(as, ir->a, 0));
+                emitSseRegisters(as, 0xF2, op, 0, b);
+                moveXmm(as, ir->dst, 0);
+            }
+            break;
+        }
+        case IR_NEGATE:
+            // Flips the sign bit, 0 - x would turn 0 into 0 instead of -0.
+            moveXmm(as, 0, ir->a.reg);
+            emitMoveImmediate(as, RAX, SIGN_BIT);
+            emitToXmm(as, 1, RAX);
+            emitSseRegisters(as, 0x66, SSE_XOR, 0, 1);
+            moveXmm(as, ir->dst, 0);
+            break;
+        case IR_GUARD:
+            emitGuard(as, ir);
+            break;
+    }
+}
+
+// Writes the variables back, pushes the exit's stack values and returns the
+// exit's index.
+static void emitExit(Assembler* as, Recorder* r, int index) {
+    Exit* exit = &r->exits[index];
+    if (index > 0) {
+        for (int i = 0; i < r->variableCount; i++) {
+            Variable* variable = &r->variables[i];
+            if (!variable->written) continue;
+            emitFromXmm(as, RAX, VARIABLE_FIRST + i);
+            emitMemory(as, X86_STORE, RAX, variable->global ? RSI : RDI,
+                       variable->index * (int)sizeof(Value));
+        }
+    }
+
+    if (exit->stackCount > 0) {
+        emitMoveImmediate(as, RDX, (uint64_t)(uintptr_t)&vm.stackTop);
+        emitMemory(as, X86_LOAD, RCX, RDX, 0);
+        for (int i = 0; i < exit->stackCount; i++) {
+            TraceValue* entry = &exit->stack[i];
+            if (entry->kind == VALUE_BOOL) {
+                emitMoveImmediate(as, RAX, BOOL_VAL(entry->boolean));
+            } else if (entry->a.constant) {
+                emitMoveImmediate(as, RAX, NUMBER_VAL(entry->a.number));
+            } else {
+                emitFromXmm(as, RAX, entry->a.reg);
+            }
+            emitMemory(as, X86_STORE, RAX, RCX, i * (int)sizeof(Value));
+        }
+        emitMemory(as, X86_LEA, RCX, RCX, exit->stackCount * (int)sizeof(Value));
+        emitMemory(as, X86_STORE, RCX, RDX, 0);
+    }
+
+    emitByte(as, 0xB8); // mov eax, index
+    emit32(as, (uint32_t)index);
+    emitByte(as, 0xC3); // ret
+}
+
+// Native code is called as exit = entry(frame->slots, vm.globalValues.values)
+// and only uses caller-saved registers.
+static Trace* compileTrace(Recorder* r) {
+    eliminateGuards(r);
+    coalesceMoves(r);
+
+    Assembler as = {0};
+    // Load every variable, the exits write back whatever is in the register.
+    emitMoveImmediate(&as, RCX, QNAN);
+    for (int i = 0; i < r->variableCount; i++) {
+        Variable* variable = &r->variables[i];
+        emitMemory(&as, X86_LOAD, RAX, variable->global ? RSI : RDI,
+                   variable->index * (int)sizeof(Value));
+        if (variable->loaded) {
+            emitRegisters(&as, X86_STORE, RDX, RAX);
+            emitRegisters(&as, X86_AND, RDX, RCX);
+            emitRegisters(&as, X86_CMP, RDX, RCX);
+            emitJumpTo(&as, X86_JE, 0);
+        }
+        emitToXmm(&as, VARIABLE_FIRST + i, RAX);
+    }
+
+    int loop = as.count;
+    for (int i = 0; i < r->irCount; i++) {
+        emitIrInstruction(&as, &r->ir[i]);
+    }
+    patchJump(&as, emitJump(&as, 0), loop);
+
+    uint32_t* labels = malloc(sizeof(uint32_t) * r->exitCount);
+    uint8_t** exits = malloc(sizeof(uint8_t*) * r->exitCount);
+    if (labels == NULL || exits == NULL) exit(1);
+    for (int i = 0; i < r->exitCount; i++) {
+        labels[i] = as.count;
+        exits[i] = r->exits[i].ip;
+        emitExit(&as, r, i);
+    }
+    patchLabels(&as, labels);
+    free(labels);
+
+    size_t size;
+    uint8_t* code = finishAssembler(&as, &size);
+    freeAssembler(&as);
+    if (code == NULL) {
+        free(exits);
+        return NULL;
+    }
+
+    Trace* trace = malloc(sizeof(Trace));
+    if (trace == NULL) exit(1);
+    trace->code = code;
+    trace->size = size;
+    trace->exits = exits;
+    trace->exitCount = r->exitCount;
+    return trace;
+}
+
+uint8_t* traceRecord(CallFrame* frame, uint8_t* ip, LoopInfo* loop) {
+    Recorder r = {0};
+    r.frame = frame;
+    r.chunk = &frame->closure->function->chunk;
+    r.base = (int)(vm.stackTop - frame->slots);
+    uint8_t* header = ip;
+    addExit(&r, header);
+
+    bool closed = false;
+    for (int i = 0; i < TRACE_MAX_INSTRUCTIONS; i++) {
+        uint8_t* next = recordInstruction(&r, ip, header);
+        if (next == NULL) break;
+        ip = next;
+        if (ip == header) {
+            closed = r.stackCount == 0;
+            break;
+        }
+    }
+
+    Trace* trace = closed ? compileTrace(&r) : NULL;
+    free(r.ir);
+    free(r.exits);
+    if (trace == NULL) {
+        loop->hotness = ++loop->failures < TRACE_MAX_FAILURES ? 0 : INT_MIN;
+        return ip;
+    }
+    loop->trace = trace;
+    vm.tracedLoops++;
+    return ip;
+}
+
+uint8_t* traceRun(Trace* trace, CallFrame* frame) {
+    TraceEntry entry = (TraceEntry)(void*)trace->code;
+    return trace->exits[entry(frame->slots, vm.globalValues.values)];
+}
+
+void traceFree(Chunk* chunk) {
+    for (int i = 0; i < chunk->loopCount; i++) {
+        Trace* trace = chunk->loops[i].trace;
+        if (trace == NULL) continue;
+        munmap(trace->code, trace->size);
+        free(trace->exits);
+        free(trace);
+        chunk->loops[i].trace = NULL;
+    }
+}
+
+#endif
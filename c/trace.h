@@ -0,0 +1,37 @@
+#ifndef clox_trace_h
+#define clox_trace_h
+
+#include "common.h"
+#include "chunk.h"
+#include "vm.h"
+
+#ifdef TRACE_JIT
+
+// Back edges the interpreter takes to a loop before it is recorded.
+#define TRACE_HOT_LOOP 50
+// Aborted recordings after which a loop is left to the interpreter for good.
+#define TRACE_MAX_FAILURES 3
+
+typedef struct Trace {
+    uint8_t* code; // Executable mapping.
+    size_t size;
+    // Where run() resumes after each exit. Exit 0 is the loop header, taken
+    // when a variable isn't a number on entry.
+    uint8_t** exits;
+    int exitCount;
+} Trace;
+
+// Records one iteration of the loop whose header ip is, executing it along
+// the way, and compiles it if the iteration only did number work. Returns
+// where run() continues: the header again, or the instruction that stopped
+// the recording.
+uint8_t* traceRecord(CallFrame* frame, uint8_t* ip, LoopInfo* loop);
+// Runs a compiled loop until it leaves the trace. Returns where run()
+// continues.
+uint8_t* traceRun(Trace* trace, CallFrame* frame);
+// Frees the traces of all loops in the chunk.
+void traceFree(Chunk* chunk);
+
+#endif
+
+#endif
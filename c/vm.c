@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdarg.h>
+#include <limits.h>
 #include <string.h>
 #include <time.h>
 
@@ -8,7 +9,12 @@
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "jit.h"
+#include "mark.h"
 #include "memory.h"
+#include "snapshot.h"
+#include "telemetry.h"
+#include "trace.h"
 #include "vm.h"
 #include "value.h"
 
@@ -39,9 +45,10 @@ static bool hasFieldNative(int argCount, Value* args) {
     if (!IS_INSTANCE(args[0])) return false;
     if (!IS_STRING(args[1])) return false;
 
+    ObjString* name = internString(AS_STRING(args[1]));
     ObjInstance* instance = AS_INSTANCE(args[0]);
     Value dummy;
-    args[-1] = BOOL_VAL(tableGet(&instance->fields, AS_STRING(args[1]), &dummy));
+    args[-1] = BOOL_VAL(instanceGetField(instance, name, &dummy));
     return true;
 }
 
@@ -51,10 +58,257 @@ static bool deleteFieldNative(int argCount, Value* args) {
     if (!IS_INSTANCE(args[0])) return false;
     if (!IS_STRING(args[1])) return false;
 
+    ObjString* name = internString(AS_STRING(args[1]));
     ObjInstance* instance = AS_INSTANCE(args[0]);
-    return tableDelete(&instance->fields, AS_STRING(args[1]));
+    return instanceDeleteField(instance, name);
+}
+static bool cacheHitsNative(int argCount, Value* args) {
+    if (argCount != 0) {
+        args[-1] = OBJ_VAL(copyString("Expected 0 arguments.", 22));
+        return false;
+    }
+    args[-1] = NUMBER_VAL((double)vm.cacheHits);
+    return true;
+}
+
+static bool cacheMissesNative(int argCount, Value* args) {
+    if (argCount != 0) {
+        args[-1] = OBJ_VAL(copyString("Expected 0 arguments.", 22));
+        return false;
+    }
+    args[-1] = NUMBER_VAL((double)vm.cacheMisses);
+    return true;
+}
+
+static bool tracedLoopsNative(int argCount, Value* args) {
+    if (argCount != 0) {
+        args[-1] = OBJ_VAL(copyString("Expected 0 arguments.", 22));
+        return false;
+    }
+    args[-1] = NUMBER_VAL((double)vm.tracedLoops);
+    return true;
+}
+
+static bool minorCollectionsNative(int argCount, Value* args) {
+    if (argCount != 0) {
+        args[-1] = OBJ_VAL(copyString("Expected 0 arguments.", 22));
+        return false;
+    }
+    args[-1] = NUMBER_VAL((double)vm.minorCollections);
+    return true;
+}
+
+static bool majorCollectionsNative(int argCount, Value* args) {
+    if (argCount != 0) {
+        args[-1] = OBJ_VAL(copyString("Expected 0 arguments.", 22));
+        return false;
+    }
+    args[-1] = NUMBER_VAL((double)vm.majorCollections);
+    return true;
+}
+
+static bool compactionsNative(int argCount, Value* args) {
+    if (argCount != 0) {
+        args[-1] = OBJ_VAL(copyString("Expected 0 arguments.", 22));
+        return false;
+    }
+    args[-1] = NUMBER_VAL((double)vm.compactions);
+    return true;
+}
+
+static bool gcMaxPauseNative(int argCount, Value* args) {
+    if (argCount != 0) {
+        args[-1] = OBJ_VAL(copyString("Expected 0 arguments.", 22));
+        return false;
+    }
+    args[-1] = NUMBER_VAL(vm.gcMaxPause);
+    return true;
+}
+
+// Share of the time since the VM started that the program itself ran, as
+// opposed to the collector.
+static bool mutatorUtilizationNative(int argCount, Value* args) {
+    if (argCount != 0) {
+        args[-1] = OBJ_VAL(copyString("Expected 0 arguments.", 22));
+        return false;
+    }
+    double elapsed = gcClock() - vm.startTime;
+    args[-1] = NUMBER_VAL(elapsed > 0 ? 1 - vm.gcPauseTotal / elapsed : 1);
+    return true;
+}
+
+static bool setGcSliceWorkNative(int argCount, Value* args) {
+    if (argCount != 1 || !IS_NUMBER(args[0]) || AS_NUMBER(args[0]) < 1) {
+        args[-1] = OBJ_VAL(copyString("Expected a positive number.", 27));
+        return false;
+    }
+    vm.gcSliceWork = (int)AS_NUMBER(args[0]);
+    args[-1] = NIL_VAL;
+    return true;
 }
 
+static bool setGcThreadsNative(int argCount, Value* args) {
+    if (argCount != 1 || !IS_NUMBER(args[0]) || AS_NUMBER(args[0]) < 1) {
+        args[-1] = OBJ_VAL(copyString("Expected a positive number.", 27));
+        return false;
+    }
+#ifdef PARALLEL_MARK
+    vm.gcThreads = (int)AS_NUMBER(args[0]);
+#endif
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+// Share of the memory the allocator holds that objects don't use.
+static bool heapFragmentationNative(int argCount, Value* args) {
+    if (argCount != 0) {
+        args[-1] = OBJ_VAL(copyString("Expected 0 arguments.", 22));
+        return false;
+    }
+    args[-1] = NUMBER_VAL(heapFragmentation(&vm.heap));
+    return true;
+}
+
+static bool printHeapStatsNative(int argCount, Value* args) {
+    if (argCount != 0) {
+        args[-1] = OBJ_VAL(copyString("Expected 0 arguments.", 22));
+        return false;
+    }
+    printHeapStats(&vm.heap);
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+static bool setGcParameterNative(int argCount, Value* args) {
+    if (argCount != 2 || !IS_STRING(args[0]) || !IS_NUMBER(args[1]) ||
+        !gcSetParameter(AS_CSTRING(args[0]), AS_NUMBER(args[1]))) {
+        args[-1] = OBJ_VAL(copyString("Expected a GC parameter and its value.", 38));
+        return false;
+    }
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+static bool dumpGcTelemetryNative(int argCount, Value* args) {
+    if (argCount != 0) {
+        args[-1] = OBJ_VAL(copyString("Expected 0 arguments.", 22));
+        return false;
+    }
+    gcWriteTelemetry(stdout);
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+static bool heapSnapshotNative(int argCount, Value* args) {
+    if (argCount != 1 || !IS_STRING(args[0])) {
+        args[-1] = OBJ_VAL(copyString("Expected a file name.", 21));
+        return false;
+    }
+    if (!writeHeapSnapshot(AS_CSTRING(args[0]))) {
+        args[-1] = OBJ_VAL(copyString("Could not write the heap snapshot.", 34));
+        return false;
+    }
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+// A whole number from 0 to max, for positions in strings.
+static bool isStringIndex(Value value, int max) {
+    if (!IS_NUMBER(value)) return false;
+    double number = AS_NUMBER(value);
+    return number >= 0 && number <= max && number == (int)number;
+}
+
+// substring(string, start, end) with the characters from start up to end,
+// or to the end of the string without one. Shares them with the string.
+static bool substringNative(int argCount, Value* args) {
+    if ((argCount != 2 && argCount != 3) || !IS_STRING(args[0])) {
+        args[-1] = OBJ_VAL(copyString("Expected a string, a start and an end.", 38));
+        return false;
+    }
+    ObjString* string = AS_STRING(args[0]);
+    int end = string->length;
+    if (argCount == 3) {
+        if (!isStringIndex(args[2], string->length)) {
+            args[-1] = OBJ_VAL(copyString("End out of range.", 17));
+            return false;
+        }
+        end = (int)AS_NUMBER(args[2]);
+    }
+    if (!isStringIndex(args[1], end)) {
+        args[-1] = OBJ_VAL(copyString("Start out of range.", 19));
+        return false;
+    }
+    int start = (int)AS_NUMBER(args[1]);
+    args[-1] = OBJ_VAL(newSlice(string, start, end - start));
+    return true;
+}
+
+// Where the next separator starts, length if there is none.
+static int findSeparator(const char* chars, int from, int length,
+                         const char* separator, int separatorLength) {
+    int last = length - separatorLength;
+    for (int i = from; i <= last; i++) {
+        const char* next = memchr(chars + i, separator[0], last - i + 1);
+        if (next == NULL) break;
+        i = (int)(next - chars);
+        if (memcmp(next, separator, separatorLength) == 0) return i;
+    }
+    return length;
+}
+
+// split(string, separator, index) with field number index of the string cut
+// up at the separator, nil if there are fewer fields. Shares the characters
+// with the string.
+static bool splitNative(int argCount, Value* args) {
+    if (argCount != 3 || !IS_STRING(args[0]) || !IS_STRING(args[1]) ||
+        AS_STRING(args[1])->length == 0 || !isStringIndex(args[2], INT_MAX)) {
+        args[-1] = OBJ_VAL(copyString("Expected a string, a separator and an index.", 44));
+        return false;
+    }
+    ObjString* string = AS_STRING(args[0]);
+    ObjString* separator = AS_STRING(args[1]);
+    flattenString(string);
+    flattenString(separator);
+    const char* chars = stringChars(string);
+    const char* separatorChars = stringChars(separator);
+
+    int start = 0;
+    for (int field = (int)AS_NUMBER(args[2]); field > 0; field--) {
+        int end = findSeparator(chars, start, string->length,
+                                separatorChars, separator->length);
+        if (end == string->length) {
+            args[-1] = NIL_VAL;
+            return true;
+        }
+        start = end + separator->length;
+    }
+    int end = findSeparator(chars, start, string->length,
+                            separatorChars, separator->length);
+    args[-1] = OBJ_VAL(newSlice(string, start, end - start));
+    return true;
+}
+
+static bool isSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// trim(string) without the whitespace at either end. Shares the characters
+// with the string.
+static bool trimNative(int argCount, Value* args) {
+    if (argCount != 1 || !IS_STRING(args[0])) {
+        args[-1] = OBJ_VAL(copyString("Expected a string.", 18));
+        return false;
+    }
+    ObjString* string = AS_STRING(args[0]);
+    const char* chars = flattenString(string);
+    int start = 0;
+    int end = string->length;
+    while (start < end && isSpace(chars[start])) start++;
+    while (end > start && isSpace(chars[end - 1])) end--;
+    args[-1] = OBJ_VAL(newSlice(string, start, end - start));
+    return true;
+}
 
 static void resetStack() {
     // simply point to the start of the stack. It doesn't matter if the rest of the stack is dirty.
@@ -64,7 +318,7 @@ static void resetStack() {
 }
 
 // Let's us specify variable number of args.
-static void runtimeError(const char* format, ...) {
+void runtimeError(const char* format, ...) {
     va_list args;
     va_start(args, format);
     vfprintf(stderr, format, args);
@@ -91,22 +345,65 @@ static void defineNative(const char* name, NativeFn function) {
     // pushing to the stack to indicate to GC that we aren't done with the values.
     push(OBJ_VAL(copyString(name, (int)strlen(name))));
     push(OBJ_VAL(newNative(function)));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    int slot = globalSlot(AS_STRING(vm.stack[0]));
+    vm.globalValues.values[slot] = vm.stack[1];
     pop();
     pop();
 }
 
 void initVM() {
     resetStack();
-    vm.objects = NULL;
+    initHeap(&vm.heap);
     vm.bytesAllocated = 0;
-    vm.nextGC = 1024 * 1024; // 1MB
+    vm.gcConfig = (GcConfig){GC_INITIAL_HEAP, GC_GROW_FACTOR, 0,
+                             GC_MIN_INTERVAL};
+    vm.nextGC = vm.gcConfig.initialHeap;
+    vm.nextMinorGC = GC_NURSERY_SIZE;
+    vm.nextSliceGC = SIZE_MAX;
+    vm.gcPhase = GC_IDLE;
+    vm.gcSliceWork = GC_SLICE_WORK;
+    vm.gcMaxPause = 0;
+#ifdef PARALLEL_MARK
+    vm.gcThreads = defaultMarkThreads();
+#else
+    vm.gcThreads = 1;
+#endif
+    vm.gcPauseTotal = 0;
+    memset(vm.gcPauses, 0, sizeof(vm.gcPauses));
+    vm.bytesFreed = 0;
+    vm.stringsCleared = 0;
+    vm.slicesCopied = 0;
+    vm.slicesDeferred = false;
+    vm.startTime = gcClock();
+#ifdef CONCURRENT_GC
+    vm.overwriteCount = 0;
+    vm.overwriteCapacity = 0;
+    vm.overwriteLog = NULL;
+    vm.deferredCount = 0;
+    vm.deferredCapacity = 0;
+    vm.deferredFrees = NULL;
+#endif
 
     vm.grayCount = 0;
     vm.grayCapacity = 0;
     vm.grayStack = NULL;
+    vm.rememberedCount = 0;
+    vm.rememberedCapacity = 0;
+    vm.rememberedSet = NULL;
+    vm.minorCollections = 0;
+    vm.majorCollections = 0;
+    vm.compactions = 0;
+#ifdef COMPACTING_GC
+    vm.compactPending = false;
+#endif
 
-    initTable(&vm.globals);
+    vm.cacheHits = 0;
+    vm.cacheMisses = 0;
+    vm.tracedLoops = 0;
+
+    initTable(&vm.globalSlots);
+    initValueArray(&vm.globalValues);
+    initValueArray(&vm.globalNames);
     initTable(&vm.strings);
 
     vm.initString = NULL;
@@ -116,15 +413,39 @@ void initVM() {
     defineNative("err", errNative);
     defineNative("hasField", hasFieldNative);
     defineNative("deleteField", deleteFieldNative);
+    defineNative("cacheHits", cacheHitsNative);
+    defineNative("cacheMisses", cacheMissesNative);
+    defineNative("tracedLoops", tracedLoopsNative);
+    defineNative("minorCollections", minorCollectionsNative);
+    defineNative("majorCollections", majorCollectionsNative);
+    defineNative("compactions", compactionsNative);
+    defineNative("gcMaxPause", gcMaxPauseNative);
+    defineNative("setGcSliceWork", setGcSliceWorkNative);
+    defineNative("mutatorUtilization", mutatorUtilizationNative);
+    defineNative("setGcThreads", setGcThreadsNative);
+    defineNative("heapFragmentation", heapFragmentationNative);
+    defineNative("printHeapStats", printHeapStatsNative);
+    defineNative("setGcParameter", setGcParameterNative);
+    defineNative("dumpGcTelemetry", dumpGcTelemetryNative);
+    defineNative("heapSnapshot", heapSnapshotNative);
+    defineNative("substring", substringNative);
+    defineNative("split", splitNative);
+    defineNative("trim", trimNative);
 }
 
 
 
 void freeVM() {
-    initTable(&vm.globals);
+#ifdef DEBUG_PROFILE_OPCODES
+    printInstructionProfile();
+#endif
+    freeTable(&vm.globalSlots);
+    freeValueArray(&vm.globalValues);
+    freeValueArray(&vm.globalNames);
     freeTable(&vm.strings);
     vm.initString = NULL;
     freeObjects();
+    freeHeap(&vm.heap);
 }
 
 void push(Value value) {
@@ -138,6 +459,21 @@ Value pop() {
     return *vm.stackTop;
 }
 
+// Returns the index of the global variable called name, adding an undefined
+// slot the first time the name is seen. Slots are never removed, so indices
+// stay valid across REPL lines and for code compiled before the definition.
+int globalSlot(ObjString* name) {
+    Value index;
+    if (tableGet(&vm.globalSlots, name, &index)) return (int)AS_NUMBER(index);
+
+    push(OBJ_VAL(name));
+    writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+    writeValueArray(&vm.globalNames, OBJ_VAL(name));
+    tableSet(&vm.globalSlots, name, NUMBER_VAL(vm.globalValues.count - 1));
+    pop();
+    return vm.globalValues.count - 1;
+}
+
 static Value peek(int distance) {
     return vm.stackTop[-1 - distance];
 }
@@ -153,6 +489,13 @@ static bool call(ObjClosure* closure, int argCount) {
         return false;
     }
     
+#ifdef JIT
+    ObjFunction* function = closure->function;
+    if (function->jit == NULL && ++function->calls == JIT_CALL_THRESHOLD) {
+        jitCompile(function);
+    }
+#endif
+
     CallFrame* frame = &vm.frames[vm.frameCount++];
     frame->closure = closure;
     frame->ip = closure->function->chunk.code;
@@ -161,7 +504,30 @@ static bool call(ObjClosure* closure, int argCount) {
     return true;
 }
 
-static bool callValue(Value callee, int argCount) {
+static bool callClass(ObjClass* klass, int argCount) {
+    vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
+
+    // After runtime makes a new instance, we look for init method.
+    Value initializer;
+    if (tableGet(&klass->methods, vm.initString, &initializer)) {
+        return call(AS_CLOSURE(initializer), argCount);
+    } else if (argCount != 0) {
+        runtimeError("Expected 0 arguments but got %d.", argCount);
+        return false;
+    }
+    return true;
+}
+
+static bool callNative(NativeFn native, int argCount) {
+    if (native(argCount, vm.stackTop - argCount)) {
+        vm.stackTop -= argCount;
+        return true;
+    }
+    runtimeError(AS_STRING(vm.stackTop[-argCount-1])->chars);
+    return false;
+}
+
+bool callValue(Value callee, int argCount) {
     if (IS_OBJ(callee)) {
         switch(OBJ_TYPE(callee)) {
             case OBJ_BOUND_METHOD: {
@@ -170,31 +536,12 @@ static bool callValue(Value callee, int argCount) {
                 vm.stackTop[-argCount - 1] = bound->receiver;
                 return call(bound->method, argCount);
             }
-            case OBJ_CLASS: {
-                ObjClass* klass = AS_CLASS(callee);
-                vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
-
-                // After runtime makes a new instance, we look for init method.
-                Value initializer;
-                if (tableGet(&klass->methods, vm.initString, &initializer)) {
-                    return call(AS_CLOSURE(initializer), argCount);
-                } else if (argCount != 0) {
-                    runtimeError("Expected 0 arguments but got %d.", argCount);
-                    return false;
-                }
-                return true;
-            }
+            case OBJ_CLASS:
+                return callClass(AS_CLASS(callee), argCount);
             case OBJ_CLOSURE:
                 return call(AS_CLOSURE(callee), argCount);
             case OBJ_NATIVE:
-                NativeFn native = AS_NATIVE(callee);
-                if (native(argCount, vm.stackTop - argCount)) {
-                    vm.stackTop -= argCount;
-                    return true;
-                } else {
-                    runtimeError(AS_STRING(vm.stackTop[-argCount-1])->chars);
-                    return false;
-                }
+                return callNative(AS_NATIVE(callee), argCount);
             default:
                 break; // non-callable object type.
         }
@@ -213,7 +560,67 @@ static bool invokeFromClass(ObjClass* klass, ObjString* name,
     return call(AS_CLOSURE(method), argCount);
 }
 
-static bool invoke(ObjString* name, int argCount) {
+static CacheEntry* findCacheEntry(InlineCache* cache, ObjShape* shape) {
+    for (int i = 0; i < cache->count; i++) {
+        if (cache->entries[i].shape == shape) {
+            vm.cacheHits++;
+            return &cache->entries[i];
+        }
+    }
+    vm.cacheMisses++;
+    return NULL;
+}
+
+// Caches belong to the chunk of the function that is running.
+static void cacheWriteBarrier(Value value) {
+    gcWriteBarrier((Obj*)vm.frames[vm.frameCount - 1].closure->function, value);
+}
+
+static CacheEntry* addCacheEntry(InlineCache* cache, ObjShape* shape) {
+    // Instances in dictionary mode have no shape to key on.
+    if (shape == NULL || cache->megamorphic) return NULL;
+    if (cache->count == INLINE_CACHE_ENTRIES) {
+        cache->megamorphic = true;
+        return NULL;
+    }
+
+    CacheEntry* entry = &cache->entries[cache->count];
+    entry->shape = shape;
+    entry->slot = -1;
+    entry->method = NIL_VAL;
+    entry->transition = NULL;
+    PUBLISH(cache->count, cache->count + 1);
+    cacheWriteBarrier(OBJ_VAL(shape));
+    return entry;
+}
+
+// Resolves 'name' on the instance's shape and class and remembers the result.
+// Returns NULL if the access can't be cached or the property doesn't exist.
+static CacheEntry* cacheProperty(InlineCache* cache, ObjInstance* instance,
+                                 ObjString* name) {
+    if (instance->shape == NULL) return NULL;
+
+    Value slot;
+    Value method;
+    bool isField = tableGet(&instance->shape->slots, name, &slot);
+    if (!isField && !tableGet(&instance->klass->methods, name, &method)) {
+        return NULL;
+    }
+
+    // Each class has its own root shape, so the shape also pins down the
+    // class and with it the method.
+    CacheEntry* entry = addCacheEntry(cache, instance->shape);
+    if (entry == NULL) return NULL;
+    if (isField) {
+        entry->slot = (int)AS_NUMBER(slot);
+    } else {
+        entry->method = method;
+        cacheWriteBarrier(method);
+    }
+    return entry;
+}
+
+bool invoke(ObjString* name, int argCount, InlineCache* cache) {
     Value receiver = peek(argCount);
     if (!IS_INSTANCE(receiver)) {
 
@@ -223,9 +630,20 @@ static bool invoke(ObjString* name, int argCount) {
 
     ObjInstance* instance = AS_INSTANCE(receiver);
 
+    CacheEntry* entry = findCacheEntry(cache, instance->shape);
+    if (entry == NULL) entry = cacheProperty(cache, instance, name);
+    if (entry != NULL) {
+        if (entry->slot >= 0) {
+            Value value = instance->slots[entry->slot];
+            vm.stackTop[-argCount - 1] = value;
+            return callValue(value, argCount);
+        }
+        return call(AS_CLOSURE(entry->method), argCount);
+    }
+
     // Might be a getter for a field.
     Value value;
-    if (tableGet(&instance->fields, name, &value)) {
+    if (instanceGetField(instance, name, &value)) {
         vm.stackTop[-argCount - 1] = value;
         return callValue(value, argCount);
     }
@@ -233,6 +651,13 @@ static bool invoke(ObjString* name, int argCount) {
     return invokeFromClass(instance->klass, name, argCount);
 }
 
+// Replaces the receiver on top of the stack with method bound to it.
+static void bindClosure(ObjClosure* method) {
+    ObjBoundMethod* bound = newBoundMethod(peek(0), method);
+    pop();
+    push(OBJ_VAL(bound));
+}
+
 static bool bindMethod(ObjClass* klass, ObjString* name) {
     Value method;
     if (!tableGet(&klass->methods, name, &method)) {
@@ -240,13 +665,69 @@ static bool bindMethod(ObjClass* klass, ObjString* name) {
         return false;
     }
 
-    ObjBoundMethod* bound = newBoundMethod(peek(0), AS_CLOSURE(method));
-    pop();
-    push(OBJ_VAL(bound));
+    bindClosure(AS_CLOSURE(method));
     return true;
 }
 
-static ObjUpvalue* captureUpvalue(Value* local) {
+// Replaces the instance on top of the stack with the value of its property.
+bool getProperty(ObjInstance* instance, ObjString* name,
+                 InlineCache* cache) {
+    CacheEntry* entry = findCacheEntry(cache, instance->shape);
+    if (entry == NULL) entry = cacheProperty(cache, instance, name);
+    if (entry != NULL) {
+        if (entry->slot >= 0) {
+            vm.stackTop[-1] = instance->slots[entry->slot];
+        } else {
+            bindClosure(AS_CLOSURE(entry->method));
+        }
+        return true;
+    }
+
+    Value value;
+    if (instanceGetField(instance, name, &value)) {
+        vm.stackTop[-1] = value;
+        return true;
+    }
+    return bindMethod(instance->klass, name);
+}
+
+// Stores value into the instance's field. value must be on the stack.
+void setProperty(ObjInstance* instance, ObjString* name, Value value,
+                 InlineCache* cache) {
+    ObjShape* shape = instance->shape;
+    CacheEntry* entry = findCacheEntry(cache, shape);
+    if (entry != NULL) {
+        if (entry->transition == NULL) {
+            gcOverwriteBarrier(instance->slots[entry->slot]);
+            instance->slots[entry->slot] = value;
+            gcWriteBarrier((Obj*)instance, value);
+            return;
+        }
+        // Adding the field only needs a shape switch if the slot is there.
+        if (entry->slot < instance->slotCapacity) {
+            instance->slots[entry->slot] = value;
+            gcOverwriteBarrier(OBJ_VAL(instance->shape));
+            PUBLISH(instance->shape, entry->transition);
+            gcWriteBarrier((Obj*)instance, value);
+            gcWriteBarrier((Obj*)instance, OBJ_VAL(instance->shape));
+            return;
+        }
+    }
+
+    instanceSetField(instance, name, value);
+    if (entry != NULL || instance->shape == NULL) return;
+
+    // Remember where the field ended up, and which shape the store led to.
+    entry = addCacheEntry(cache, shape);
+    if (entry == NULL) return;
+    Value slot;
+    tableGet(&instance->shape->slots, name, &slot);
+    entry->slot = (int)AS_NUMBER(slot);
+    entry->transition = instance->shape != shape ? instance->shape : NULL;
+    if (entry->transition != NULL) cacheWriteBarrier(OBJ_VAL(entry->transition));
+}
+
+ObjUpvalue* captureUpvalue(Value* local) {
     ObjUpvalue* prevUpvalue = NULL;
     ObjUpvalue* upvalue = vm.openUpvalues;
     while (upvalue != NULL && upvalue->location > local) {
@@ -273,10 +754,11 @@ static ObjUpvalue* captureUpvalue(Value* local) {
     return createdUpvalue;
 }
 
-static void closeUpvalues(Value* last) {
+void closeUpvalues(Value* last) {
     while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
         ObjUpvalue* upvalue = vm.openUpvalues;
         upvalue->closed = *upvalue->location;
+        gcWriteBarrier((Obj*)upvalue, upvalue->closed);
         // Simply points to its own field. 
         // This lets us reuse the same OP_GET/SET_UPVALUE without change.
         upvalue->location = &upvalue->closed; 
@@ -289,6 +771,8 @@ static void defineMethod(ObjString* name) {
     Value method = peek(0); // Closure.
     ObjClass* klass = AS_CLASS(peek(1));
     tableSet(&klass->methods, name, method);
+    gcWriteBarrier((Obj*)klass, OBJ_VAL(name));
+    gcWriteBarrier((Obj*)klass, method);
     pop();
 }
 
@@ -296,36 +780,69 @@ static void defineMethod(ObjString* name) {
     Value is "falsey" if its null or false, otherwise true
     This makes 0 also true, which feels odd.
 */
-static bool isFalsey(Value value) {
+bool isFalsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
+// Strings made at runtime aren't interned until they're used as a key.
 static void concatenate() {
     ObjString* b = AS_STRING(peek(0));
     ObjString* a = AS_STRING(peek(1));
 
     int length = a->length + b->length;
-
-    ObjString* result = makeString(length, 0);
+    ObjString* result;
+    if (length < ROPE_MIN_LENGTH) {
+        // Ropes are longer than that, neither is one. Slices may have got
+        // copies of their characters while allocating.
+        result = makeString(length, 0);
+        memcpy(result->chars, stringChars(a), a->length);
+        memcpy(result->chars + a->length, stringChars(b), b->length);
+        result->chars[length] = '\0';
+    } else {
+        result = newRope(a, b);
+    }
     pop();
     pop();
-    memcpy(result->chars, a->chars, a->length);
-    memcpy(result->chars + a->length, b->chars, b->length);
-    result->chars[length] = '\0';
-    
-    // Check if the concated string is already interned, if so, just return that.
-    uint32_t hash = hashString(result->chars, result->length);
-    ObjString* interned = tableFindString(&vm.strings, result->chars, length, hash);
-    if (interned != NULL) {
-        push(OBJ_VAL(interned));
-        return;
+    push(OBJ_VAL(result));
+}
+
+#ifdef DEBUG_TRACE_EXECUTION
+static void traceInstruction(CallFrame* frame, uint8_t* ip) {
+    printf("          ");
+    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+        printf("[ ");
+        // dereference to access the value at the pointer.
+        printValue(*slot);
+        printf (" ]");
     }
-    
-    // otherwise set the hash and add the string to vm.strings table.
-    result->hash = hash; 
-    tableSet(&vm.strings, result, NIL_VAL);
+    printf("\n");
+    disassambleInstruction(&frame->closure->function->chunk, 
+        (int)(ip - frame->closure->function->chunk.code));
+#ifdef DEBUG_PROFILE_OPCODES
+    profileInstruction(*ip);
+#endif
+}
+#endif
 
-    push(OBJ_VAL(result));
+// OP_ADD for anything but two numbers.
+bool addNonNumbers() {
+    if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+        concatenate();
+        return true;
+    }
+    runtimeError("Operands must be two numbers or two strings.");
+    return false;
+}
+
+// The quickened form of OP_CALL for a callee, or OP_CALL if there is none.
+static uint8_t quickenCall(Value callee) {
+    if (!IS_OBJ(callee)) return OP_CALL;
+    switch (OBJ_TYPE(callee)) {
+        case OBJ_CLOSURE: return OP_CALL_CLOSURE;
+        case OBJ_NATIVE: return OP_CALL_NATIVE;
+        case OBJ_CLASS: return OP_CALL_CLASS;
+        default: return OP_CALL;
+    }
 }
 
 static InterpretResult run() {
@@ -338,6 +855,8 @@ static InterpretResult run() {
     (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
 
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_CACHE() \
+    (&frame->closure->function->chunk.caches[READ_SHORT()])
 // do while macro ensures the expanded statements are in the same scope.
 #define BINARY_OP(valueType, op) \
     do { \
@@ -351,259 +870,601 @@ static InterpretResult run() {
         push(valueType(a op b)); \
     } while (false)
 
-    // read, decode, and dispatch bytecode
-    for (;;) {
-#ifdef DEBUG_TRACE_EXECUTION
-        printf("          ");
-        for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-            printf("[ ");
-            // dereference to access the value at the pointer.
-            printValue(*slot);
-            printf (" ]");
-        }
-        printf("\n");
-        disassambleInstruction(&frame->closure->function->chunk, 
-            (int)(ip - frame->closure->function->chunk.code));
+#define READ_REGISTER() (frame->slots[READ_BYTE()])
+// Three-address arithmetic, the destination register comes first.
+#define REGISTER_OP(readA, readB, op) \
+    do { \
+        uint8_t dest = READ_BYTE(); \
+        Value a = readA; \
+        Value b = readB; \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+            frame->ip = ip; \
+            runtimeError("Operands must be numbers."); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } \
+        frame->slots[dest] = NUMBER_VAL(AS_NUMBER(a) op AS_NUMBER(b)); \
+    } while (false)
+#define REGISTER_ADD(readA, readB) \
+    do { \
+        uint8_t dest = READ_BYTE(); \
+        Value a = readA; \
+        Value b = readB; \
+        if (IS_NUMBER(a) && IS_NUMBER(b)) { \
+            frame->slots[dest] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)); \
+        } else { \
+            push(a); \
+            push(b); \
+            frame->ip = ip; \
+            if (!addNonNumbers()) return INTERPRET_RUNTIME_ERROR; \
+            frame->slots[dest] = pop(); \
+        } \
+    } while (false)
+
+// Rewrites the instruction being executed. Only valid before its operands
+// are read, while ip[-1] is still the opcode.
+#define QUICKEN(op) (ip[-1] = (op))
+// Turns a quickened instruction whose guard failed back into the generic
+// one and runs that instead. Nothing may have been read or popped yet.
+#define DEQUICKEN(op) \
+    do { \
+        ip[-1] = (op); \
+        ip--; \
+        DISPATCH(); \
+    } while (false)
+
+#ifdef JIT
+// Called whenever the frame on top changes. Compiled functions continue in
+// machine code, starting at frame->ip.
+#define ENTER_JIT() \
+    do { \
+        if (frame->closure->function->jit != NULL) goto enterJit; \
+    } while (false)
+#else
+#define ENTER_JIT() do { } while (false)
 #endif
 
-        uint8_t instruction;
-        switch (instruction = READ_BYTE()) {
-            case OP_CONSTANT: {
-                Value constant = READ_CONSTANT();
-                push(constant);
-                break;
-            }
-            case OP_NIL: push(NIL_VAL); break;
-            case OP_TRUE: push(BOOL_VAL(true)); break;
-            case OP_FALSE: push(BOOL_VAL(false)); break;
-            case OP_POP: pop(); break;
-            case OP_GET_LOCAL: {
-                // Reads the value from the stack and then pushes it to the top to make
-                // it accessible by other instructions.
-                uint8_t slot = READ_BYTE();
-                push(frame->slots[slot]);
-                break;
-            }
-            case OP_SET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                frame->slots[slot] = peek(0);
-                break;
-            }
-            case OP_GET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                push(*frame->closure->upvalues[slot]->location);
-                break;
-            }
-            case OP_SET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
-                break;
-            }
-            case OP_GET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                Value value;
-                if (!tableGet(&vm.globals, name, &value)) {
-                    frame->ip = ip;
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(value);
-                break;
+#if defined(DEBUG_TRACE_EXECUTION)
+#define TRACE_INSTRUCTION() traceInstruction(frame, ip)
+#elif defined(DEBUG_PROFILE_OPCODES)
+#define TRACE_INSTRUCTION() profileInstruction(*ip)
+#else
+#define TRACE_INSTRUCTION() do { } while (false)
+#endif
+
+#ifdef COMPUTED_GOTO
+    // Handler address for every opcode.
+    static void* dispatchTable[] = {
+        [OP_CONSTANT_LONG] = &&L_OP_CONSTANT_LONG,
+        [OP_CONSTANT] = &&L_OP_CONSTANT,
+        [OP_NIL] = &&L_OP_NIL,
+        [OP_TRUE] = &&L_OP_TRUE,
+        [OP_FALSE] = &&L_OP_FALSE,
+        [OP_POP] = &&L_OP_POP,
+        [OP_GET_LOCAL] = &&L_OP_GET_LOCAL,
+        [OP_SET_LOCAL] = &&L_OP_SET_LOCAL,
+        [OP_GET_UPVALUE] = &&L_OP_GET_UPVALUE,
+        [OP_SET_UPVALUE] = &&L_OP_SET_UPVALUE,
+        [OP_GET_GLOBAL] = &&L_OP_GET_GLOBAL,
+        [OP_DEFINE_GLOBAL] = &&L_OP_DEFINE_GLOBAL,
+        [OP_SET_GLOBAL] = &&L_OP_SET_GLOBAL,
+        [OP_SET_PROPERTY] = &&L_OP_SET_PROPERTY,
+        [OP_GET_PROPERTY] = &&L_OP_GET_PROPERTY,
+        [OP_EQUAL] = &&L_OP_EQUAL,
+        [OP_GREATER] = &&L_OP_GREATER,
+        [OP_LESS] = &&L_OP_LESS,
+        [OP_ADD] = &&L_OP_ADD,
+        [OP_SUBTRACT] = &&L_OP_SUBTRACT,
+        [OP_MULTIPLY] = &&L_OP_MULTIPLY,
+        [OP_DIVIDE] = &&L_OP_DIVIDE,
+        [OP_NOT] = &&L_OP_NOT,
+        [OP_NEGATE] = &&L_OP_NEGATE,
+        [OP_PRINT] = &&L_OP_PRINT,
+        [OP_JUMP_IF_FALSE] = &&L_OP_JUMP_IF_FALSE,
+        [OP_JUMP] = &&L_OP_JUMP,
+        [OP_LOOP] = &&L_OP_LOOP,
+        [OP_CALL] = &&L_OP_CALL,
+        [OP_INVOKE] = &&L_OP_INVOKE,
+        [OP_CLOSURE] = &&L_OP_CLOSURE,
+        [OP_CLOSE_UPVALUE] = &&L_OP_CLOSE_UPVALUE,
+        [OP_RETURN] = &&L_OP_RETURN,
+        [OP_CLASS] = &&L_OP_CLASS,
+        [OP_METHOD] = &&L_OP_METHOD,
+        [OP_GET_LOCAL_GET_LOCAL] = &&L_OP_GET_LOCAL_GET_LOCAL,
+        [OP_ADD_LOCAL_CONST] = &&L_OP_ADD_LOCAL_CONST,
+        [OP_LESS_JUMP_IF_FALSE] = &&L_OP_LESS_JUMP_IF_FALSE,
+        [OP_SET_LOCAL_POP] = &&L_OP_SET_LOCAL_POP,
+        [OP_ADD_NUM] = &&L_OP_ADD_NUM,
+        [OP_ADD_STR] = &&L_OP_ADD_STR,
+        [OP_EQUAL_NUM] = &&L_OP_EQUAL_NUM,
+        [OP_EQUAL_STR] = &&L_OP_EQUAL_STR,
+        [OP_GET_PROPERTY_FIELD] = &&L_OP_GET_PROPERTY_FIELD,
+        [OP_CALL_CLOSURE] = &&L_OP_CALL_CLOSURE,
+        [OP_CALL_NATIVE] = &&L_OP_CALL_NATIVE,
+        [OP_CALL_CLASS] = &&L_OP_CALL_CLASS,
+        [OP_MOVE] = &&L_OP_MOVE,
+        [OP_LOAD_CONSTANT] = &&L_OP_LOAD_CONSTANT,
+        [OP_ADD_RR] = &&L_OP_ADD_RR,
+        [OP_ADD_RK] = &&L_OP_ADD_RK,
+        [OP_ADD_KR] = &&L_OP_ADD_KR,
+        [OP_SUBTRACT_RR] = &&L_OP_SUBTRACT_RR,
+        [OP_SUBTRACT_RK] = &&L_OP_SUBTRACT_RK,
+        [OP_SUBTRACT_KR] = &&L_OP_SUBTRACT_KR,
+        [OP_MULTIPLY_RR] = &&L_OP_MULTIPLY_RR,
+        [OP_MULTIPLY_RK] = &&L_OP_MULTIPLY_RK,
+        [OP_MULTIPLY_KR] = &&L_OP_MULTIPLY_KR,
+        [OP_DIVIDE_RR] = &&L_OP_DIVIDE_RR,
+        [OP_DIVIDE_RK] = &&L_OP_DIVIDE_RK,
+        [OP_DIVIDE_KR] = &&L_OP_DIVIDE_KR,
+    };
+
+// Every handler jumps straight to the next instruction's handler. That gives
+// each opcode its own indirect branch, which predicts far better than the
+// single shared branch of a switch.
+#define DISPATCH() \
+    do { \
+        TRACE_INSTRUCTION(); \
+        goto *dispatchTable[instruction = READ_BYTE()]; \
+    } while (false)
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(op) L_##op
+#else
+#define DISPATCH() goto loop
+#define INTERPRET_LOOP \
+    loop: \
+        TRACE_INSTRUCTION(); \
+        switch (instruction = READ_BYTE())
+#define CASE(op) case op
+#endif
+
+    // read, decode, and dispatch bytecode
+    uint8_t instruction;
+    INTERPRET_LOOP
+    {
+        CASE(OP_CONSTANT): {
+            Value constant = READ_CONSTANT();
+            push(constant);
+            DISPATCH();
+        }
+        CASE(OP_CONSTANT_LONG): {
+            // 3 byte little-endian constant index.
+            uint32_t index = ip[0] | (ip[1] << 8) | (ip[2] << 16);
+            ip += 3;
+            push(frame->closure->function->chunk.constants.values[index]);
+            DISPATCH();
+        }
+        CASE(OP_NIL): push(NIL_VAL); DISPATCH();
+        CASE(OP_TRUE): push(BOOL_VAL(true)); DISPATCH();
+        CASE(OP_FALSE): push(BOOL_VAL(false)); DISPATCH();
+        CASE(OP_POP): pop(); DISPATCH();
+        CASE(OP_GET_LOCAL): {
+            // Reads the value from the stack and then pushes it to the top to make
+            // it accessible by other instructions.
+            uint8_t slot = READ_BYTE();
+            push(frame->slots[slot]);
+            DISPATCH();
+        }
+        CASE(OP_SET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            frame->slots[slot] = peek(0);
+            DISPATCH();
+        }
+        CASE(OP_GET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            push(*frame->closure->upvalues[slot]->location);
+            DISPATCH();
+        }
+        CASE(OP_SET_UPVALUE): {
+            ObjUpvalue* upvalue = frame->closure->upvalues[READ_BYTE()];
+            gcOverwriteBarrier(*upvalue->location);
+            *upvalue->location = peek(0);
+            gcWriteBarrier((Obj*)upvalue, peek(0));
+            DISPATCH();
+        }
+        CASE(OP_GET_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            Value value = vm.globalValues.values[slot];
+            if (IS_UNDEFINED(value)) {
+                frame->ip = ip;
+                runtimeError("Undefined variable '%s'.", 
+                    AS_CSTRING(vm.globalNames.values[slot]));
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_DEFINE_GLOBAL: {
-                // Get variable name from constant table.
-                ObjString* name = READ_STRING();
-                // Get value from top of stack and store in hash table.
-                tableSet(&vm.globals, name, peek(0));
-                // Only pop after value is added to hash set, otherwise it might
-                // get garbage collected. Wild.
-                pop();
-                break;
+            push(value);
+            DISPATCH();
+        }
+        CASE(OP_DEFINE_GLOBAL): {
+            // Store value from top of stack in the variable's slot.
+            vm.globalValues.values[READ_SHORT()] = peek(0);
+            // Only pop after value is stored, otherwise it might
+            // get garbage collected. Wild.
+            pop();
+            DISPATCH();
+        }
+        CASE(OP_SET_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            // Var has to be defined already, otherwise asignment is invalid. 
+            if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+                frame->ip = ip;
+                runtimeError("Undefined variable '%s'.", 
+                    AS_CSTRING(vm.globalNames.values[slot]));
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_SET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                // Var has to be in hashset already, otherwise asignment is invalid. 
-                // If key exists doesn't exist, tableSet returns true.
-                // If it exists, we simply overwrite it.
-                if (tableSet(&vm.globals, name, peek(0))) {
-                    tableDelete(&vm.globals, name); // undo setting.
-                    frame->ip = ip;
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+            vm.globalValues.values[slot] = peek(0);
+            DISPATCH();
+        }
+        CASE(OP_SET_PROPERTY): {
+            if (!IS_INSTANCE(peek(1))) {
+                frame->ip = ip;
+                runtimeError("Only instances have fields.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_SET_PROPERTY: {
-                if (!IS_INSTANCE(peek(1))) {
-                    runtimeError("Only instances have fields.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
 
-                ObjInstance* instance = AS_INSTANCE(peek(1));
-                tableSet(&instance->fields, READ_STRING(), peek(0));
-                Value value = pop();
-                pop();
-                push(value);
-                break;
+            ObjInstance* instance = AS_INSTANCE(peek(1));
+            ObjString* name = READ_STRING();
+            setProperty(instance, name, peek(0), READ_CACHE());
+            Value value = pop();
+            pop();
+            push(value);
+            DISPATCH();
+        }
+        CASE(OP_GET_PROPERTY): {
+            if (!IS_INSTANCE(peek(0))) {
+                frame->ip = ip;
+                runtimeError("Only instances have properties.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_GET_PROPERTY: {
-                if (!IS_INSTANCE(peek(0))) {
-                    runtimeError("Only instances have properties.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
 
-                ObjInstance* instance = AS_INSTANCE(peek(0));
-                ObjString* name = READ_STRING();
+            uint8_t* start = ip - 1;
+            ObjInstance* instance = AS_INSTANCE(peek(0));
+            ObjString* name = READ_STRING();
+            InlineCache* cache = READ_CACHE();
 
-                Value value;
-                if (tableGet(&instance->fields, name, &value)) {
-                    pop(); // pops the instance.
-                    push(value);
-                    break;
-                }
-
-                if (!bindMethod(instance->klass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+            frame->ip = ip;
+            if (!getProperty(instance, name, cache)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
-                break;
+            // A site that has only ever seen one shape, and found a field
+            // there, can skip the cache walk.
+            if (cache->count == 1 && !cache->megamorphic &&
+                    cache->entries[0].shape == instance->shape &&
+                    cache->entries[0].slot >= 0) {
+                *start = OP_GET_PROPERTY_FIELD;
             }
-            case OP_GREATER: BINARY_OP(BOOL_VAL, >); break;
-            case OP_LESS: BINARY_OP(BOOL_VAL, <); break;
-            case OP_ADD: {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    concatenate();
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a+b));
-                } else {
-                    frame->ip = ip;
-                    runtimeError("Operands must be two numbers or two strings.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+            DISPATCH();
+        }
+        CASE(OP_EQUAL): {
+            Value b = peek(0);
+            Value a = peek(1);
+            if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                QUICKEN(OP_EQUAL_NUM);
+            } else if (IS_STRING(a) && IS_STRING(b)) {
+                QUICKEN(OP_EQUAL_STR);
             }
-            case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-            case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-            case OP_DIVIDE: BINARY_OP(NUMBER_VAL, /); break;
-            case OP_NOT: 
-                // We define falsiness of a value.
-                push(BOOL_VAL(isFalsey(pop())));
-                break;
-            case OP_NEGATE: {
-                if (!IS_NUMBER(peek(0))) {
-                    frame->ip = ip;
-                    runtimeError("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
+            pop();
+            pop();
+            push(BOOL_VAL(valuesEqual(a, b)));
+            DISPATCH();
+        }
+        CASE(OP_GREATER): BINARY_OP(BOOL_VAL, >); DISPATCH();
+        CASE(OP_LESS): BINARY_OP(BOOL_VAL, <); DISPATCH();
+        CASE(OP_ADD): {
+            if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+                QUICKEN(OP_ADD_NUM);
+                double b = AS_NUMBER(pop());
+                double a = AS_NUMBER(pop());
+                push(NUMBER_VAL(a+b));
+            } else {
+                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+                    QUICKEN(OP_ADD_STR);
                 }
-                // Modifies value in place.
-                *(vm.stackTop - 1) = NUMBER_VAL(-AS_NUMBER(*(vm.stackTop - 1)));
-                break;
+                frame->ip = ip;
+                if (!addNonNumbers()) return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_PRINT: {
-                printValue(pop());
-                printf("\n");
-                break;
+            DISPATCH();
+        }
+        CASE(OP_SUBTRACT): BINARY_OP(NUMBER_VAL, -); DISPATCH();
+        CASE(OP_MULTIPLY): BINARY_OP(NUMBER_VAL, *); DISPATCH();
+        CASE(OP_DIVIDE): BINARY_OP(NUMBER_VAL, /); DISPATCH();
+        CASE(OP_NOT): 
+            // We define falsiness of a value.
+            push(BOOL_VAL(isFalsey(pop())));
+            DISPATCH();
+        CASE(OP_NEGATE): {
+            if (!IS_NUMBER(peek(0))) {
+                frame->ip = ip;
+                runtimeError("Operand must be a number.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_JUMP_IF_FALSE: {
-                uint16_t offset = READ_SHORT();
-                if (isFalsey(peek(0))) ip += offset;
-                break;
+            // Modifies value in place.
+            *(vm.stackTop - 1) = NUMBER_VAL(-AS_NUMBER(*(vm.stackTop - 1)));
+            DISPATCH();
+        }
+        CASE(OP_PRINT): {
+            printValue(pop());
+            printf("\n");
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            if (isFalsey(peek(0))) ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP): {
+            uint16_t offset = READ_SHORT();
+            ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_LOOP): {
+            uint16_t offset = READ_SHORT();
+#ifdef TRACE_JIT
+            LoopInfo* info = &frame->closure->function->chunk.loops[READ_SHORT()];
+            ip -= offset;
+            GC_SAFEPOINT();
+            if (info->trace != NULL) {
+                ip = traceRun(info->trace, frame);
+            } else if (++info->hotness >= TRACE_HOT_LOOP) {
+                ip = traceRecord(frame, ip, info);
             }
-            case OP_JUMP: {
-                uint16_t offset = READ_SHORT();
-                ip += offset;
-                break;
+#else
+            ip += 2 - offset; // The loop index is only read by the tracing JIT.
+            GC_SAFEPOINT();
+#endif
+            DISPATCH();
+        }
+        CASE(OP_CALL): {
+            QUICKEN(quickenCall(peek(*ip)));
+            int argCount = READ_BYTE();
+            frame->ip = ip; // Store back into frame.
+            if (!callValue(peek(argCount), argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_LOOP: {
-                uint16_t offset = READ_SHORT();
-                ip -= offset;
-                break;
+            frame = &vm.frames[vm.frameCount - 1];
+            ip = frame->ip; // Update after function call finishes.
+            ENTER_JIT();
+            DISPATCH();
+        }
+        CASE(OP_INVOKE): {
+            ObjString* method = READ_STRING();
+            int argCount = READ_BYTE();
+            InlineCache* cache = READ_CACHE();
+            frame->ip = ip;
+            if (!invoke(method, argCount, cache)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_CALL: {
-                int argCount = READ_BYTE();
-                frame->ip = ip; // Store back into frame.
-                if (!callValue(peek(argCount), argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
+            // pop the stack frame after call.
+            frame = &vm.frames[vm.frameCount - 1];
+            ip = frame->ip;
+            ENTER_JIT();
+            DISPATCH();
+        }
+        CASE(OP_CLOSURE): {
+            // read function and wrap it in a closure, push it on stack.
+            ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+            ObjClosure* closure = newClosure(function);
+            push(OBJ_VAL(closure));
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                uint8_t isLocal = READ_BYTE();
+                uint8_t index = READ_BYTE();
+                if (isLocal) {
+                    // Stores local in upvalue
+                    closure->upvalues[i] =
+                        captureUpvalue(frame->slots + index);
+                } else {
+                    // Stores upvalue from enclosing in current's upvalues.
+                    // Frame referes to enclosing function here.
+                    closure->upvalues[i] = frame->closure->upvalues[index];
                 }
-                frame = &vm.frames[vm.frameCount - 1];
-                ip = frame->ip; // Update after function call finishes.
-                break;
+                // Capturing allocates, the closure may be old by now.
+                gcWriteBarrier((Obj*)closure, OBJ_VAL(closure->upvalues[i]));
+            }
+            DISPATCH();
+        }
+        CASE(OP_CLOSE_UPVALUE): {
+            closeUpvalues(vm.stackTop - 1);
+            pop();
+            DISPATCH();
+        }
+        CASE(OP_RETURN): {
+            Value result = pop();
+            // When function returns we may need to hoist some variables.
+            closeUpvalues(frame->slots);
+            vm.frameCount--;
+            // Return in top-level code. 
+            if (vm.frameCount == 0) {
+                pop();
+                return INTERPRET_OK;
             }
-            case OP_INVOKE: {
-                ObjString* method = READ_STRING();
-                int argCount = READ_BYTE();
+
+            vm.stackTop = frame->slots; // pops function's frame from the stack.
+            push(result);
+            frame = &vm.frames[vm.frameCount-1];    
+            ip = frame->ip;
+            GC_SAFEPOINT();
+            ENTER_JIT();
+            DISPATCH();
+        }
+        CASE(OP_CLASS):
+            push(OBJ_VAL(newClass(READ_STRING())));
+            DISPATCH();
+        CASE(OP_METHOD):
+            defineMethod(READ_STRING());
+            DISPATCH();
+        CASE(OP_GET_LOCAL_GET_LOCAL): {
+            uint8_t first = READ_BYTE();
+            uint8_t second = READ_BYTE();
+            push(frame->slots[first]);
+            push(frame->slots[second]);
+            DISPATCH();
+        }
+        CASE(OP_ADD_LOCAL_CONST): {
+            Value a = frame->slots[READ_BYTE()];
+            Value b = READ_CONSTANT();
+            if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                push(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+            } else {
+                push(a);
+                push(b);
                 frame->ip = ip;
-                if (!invoke(method, argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                // pop the stack frame after call.
-                frame = &vm.frames[vm.frameCount - 1];
-                ip = frame->ip;
-                break;
+                if (!addNonNumbers()) return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_CLOSURE: {
-                // read function and wrap it in a closure, push it on stack.
-                ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-                ObjClosure* closure = newClosure(function);
-                push(OBJ_VAL(closure));
-                for (int i = 0; i < closure->upvalueCount; i++) {
-                    uint8_t isLocal = READ_BYTE();
-                    uint8_t index = READ_BYTE();
-                    if (isLocal) {
-                        // Stores local in upvalue
-                        closure->upvalues[i] =
-                            captureUpvalue(frame->slots + index);
-                    } else {
-                        // Stores upvalue from enclosing in current's upvalues.
-                        // Frame referes to enclosing function here.
-                        closure->upvalues[i] = frame->closure->upvalues[index];
-                    }
-                }
-                break;
+            DISPATCH();
+        }
+        CASE(OP_LESS_JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+                frame->ip = ip;
+                runtimeError("Operands must be numbers.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_CLOSE_UPVALUE: {
-                closeUpvalues(vm.stackTop - 1);
-                pop();
-                break;
+            double b = AS_NUMBER(pop());
+            double a = AS_NUMBER(pop());
+            // The condition stays on the stack, like with OP_JUMP_IF_FALSE.
+            push(BOOL_VAL(a < b));
+            if (!(a < b)) ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_SET_LOCAL_POP):
+            frame->slots[READ_BYTE()] = pop();
+            DISPATCH();
+        CASE(OP_ADD_NUM): {
+            if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) DEQUICKEN(OP_ADD);
+            double b = AS_NUMBER(pop());
+            double a = AS_NUMBER(pop());
+            push(NUMBER_VAL(a + b));
+            DISPATCH();
+        }
+        CASE(OP_ADD_STR): {
+            if (!IS_STRING(peek(0)) || !IS_STRING(peek(1))) DEQUICKEN(OP_ADD);
+            concatenate();
+            DISPATCH();
+        }
+        CASE(OP_EQUAL_NUM): {
+            if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) DEQUICKEN(OP_EQUAL);
+            double b = AS_NUMBER(pop());
+            double a = AS_NUMBER(pop());
+            push(BOOL_VAL(a == b));
+            DISPATCH();
+        }
+        CASE(OP_EQUAL_STR): {
+            if (!IS_STRING(peek(0)) || !IS_STRING(peek(1))) DEQUICKEN(OP_EQUAL);
+            // Interned strings are equal only to themselves, others may need
+            // comparing.
+            ObjString* b = AS_STRING(peek(0));
+            ObjString* a = AS_STRING(peek(1));
+            bool equal = a == b || stringsEqual(a, b);
+            pop();
+            pop();
+            push(BOOL_VAL(equal));
+            DISPATCH();
+        }
+        CASE(OP_GET_PROPERTY_FIELD): {
+            // Operands are read in place so a failed guard leaves them for
+            // OP_GET_PROPERTY.
+            InlineCache* cache = &frame->closure->function->chunk.caches[
+                (uint16_t)((ip[1] << 8) | ip[2])];
+            Value receiver = peek(0);
+            if (!IS_INSTANCE(receiver) ||
+                    AS_INSTANCE(receiver)->shape != cache->entries[0].shape) {
+                DEQUICKEN(OP_GET_PROPERTY);
             }
-            case OP_RETURN: {
-                Value result = pop();
-                // When function returns we may need to hoist some variables.
-                closeUpvalues(frame->slots);
-                vm.frameCount--;
-                // Return in top-level code. 
-                if (vm.frameCount == 0) {
-                    pop();
-                    return INTERPRET_OK;
-                }
-
-                vm.stackTop = frame->slots; // pops function's frame from the stack.
-                push(result);
-                frame = &vm.frames[vm.frameCount-1];    
-                ip = frame->ip;
-                break;
+            ip += 3;
+            vm.cacheHits++;
+            vm.stackTop[-1] = AS_INSTANCE(receiver)->slots[cache->entries[0].slot];
+            DISPATCH();
+        }
+        CASE(OP_CALL_CLOSURE): {
+            int argCount = *ip;
+            Value callee = peek(argCount);
+            if (!IS_CLOSURE(callee)) DEQUICKEN(OP_CALL);
+            frame->ip = ++ip;
+            if (!call(AS_CLOSURE(callee), argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            frame = &vm.frames[vm.frameCount - 1];
+            ip = frame->ip;
+            ENTER_JIT();
+            DISPATCH();
+        }
+        CASE(OP_CALL_NATIVE): {
+            int argCount = *ip;
+            Value callee = peek(argCount);
+            if (!IS_NATIVE(callee)) DEQUICKEN(OP_CALL);
+            frame->ip = ++ip;
+            if (!callNative(AS_NATIVE(callee), argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_CLASS:
-                push(OBJ_VAL(newClass(READ_STRING())));
-                break;
-            case OP_METHOD:
-                defineMethod(READ_STRING());
-                break;
+            DISPATCH();
         }
+        CASE(OP_CALL_CLASS): {
+            int argCount = *ip;
+            Value callee = peek(argCount);
+            if (!IS_CLASS(callee)) DEQUICKEN(OP_CALL);
+            frame->ip = ++ip;
+            if (!callClass(AS_CLASS(callee), argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            frame = &vm.frames[vm.frameCount - 1];
+            ip = frame->ip;
+            ENTER_JIT();
+            DISPATCH();
+        }
+        CASE(OP_MOVE): {
+            uint8_t dest = READ_BYTE();
+            frame->slots[dest] = READ_REGISTER();
+            DISPATCH();
+        }
+        CASE(OP_LOAD_CONSTANT): {
+            uint8_t dest = READ_BYTE();
+            frame->slots[dest] = READ_CONSTANT();
+            DISPATCH();
+        }
+        CASE(OP_ADD_RR): REGISTER_ADD(READ_REGISTER(), READ_REGISTER()); DISPATCH();
+        CASE(OP_ADD_RK): REGISTER_ADD(READ_REGISTER(), READ_CONSTANT()); DISPATCH();
+        CASE(OP_ADD_KR): REGISTER_ADD(READ_CONSTANT(), READ_REGISTER()); DISPATCH();
+        CASE(OP_SUBTRACT_RR): REGISTER_OP(READ_REGISTER(), READ_REGISTER(), -); DISPATCH();
+        CASE(OP_SUBTRACT_RK): REGISTER_OP(READ_REGISTER(), READ_CONSTANT(), -); DISPATCH();
+        CASE(OP_SUBTRACT_KR): REGISTER_OP(READ_CONSTANT(), READ_REGISTER(), -); DISPATCH();
+        CASE(OP_MULTIPLY_RR): REGISTER_OP(READ_REGISTER(), READ_REGISTER(), *); DISPATCH();
+        CASE(OP_MULTIPLY_RK): REGISTER_OP(READ_REGISTER(), READ_CONSTANT(), *); DISPATCH();
+        CASE(OP_MULTIPLY_KR): REGISTER_OP(READ_CONSTANT(), READ_REGISTER(), *); DISPATCH();
+        CASE(OP_DIVIDE_RR): REGISTER_OP(READ_REGISTER(), READ_REGISTER(), /); DISPATCH();
+        CASE(OP_DIVIDE_RK): REGISTER_OP(READ_REGISTER(), READ_CONSTANT(), /); DISPATCH();
+        CASE(OP_DIVIDE_KR): REGISTER_OP(READ_CONSTANT(), READ_REGISTER(), /); DISPATCH();
     }
 
+    // Only reachable when the switch sees an unknown opcode.
+    return INTERPRET_RUNTIME_ERROR;
+
+#ifdef JIT
+enterJit:
+    for (;;) {
+        JitStatus status = jitRun(frame);
+        if (status == JIT_ERROR) return INTERPRET_RUNTIME_ERROR;
+        if (status == JIT_DONE) return INTERPRET_OK;
+        GC_SAFEPOINT();
+        frame = &vm.frames[vm.frameCount - 1];
+        if (frame->closure->function->jit == NULL) break;
+    }
+    ip = frame->ip;
+    DISPATCH();
+#endif
+
 #undef READ_BYTE
 #undef READ_SHORT
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef READ_CACHE
 #undef BINARY_OP
+#undef READ_REGISTER
+#undef REGISTER_OP
+#undef REGISTER_ADD
+#undef QUICKEN
+#undef DEQUICKEN
+#undef TRACE_INSTRUCTION
+#undef ENTER_JIT
+#undef DISPATCH
+#undef INTERPRET_LOOP
+#undef CASE
 }
 
 InterpretResult interpret(const char* source) {
@@ -1,8 +1,13 @@
 #ifndef clox_vm_h
 #define clox_vm_h
 
+#ifdef CONCURRENT_GC
+#include <pthread.h>
+#endif
+
 #include "object.h"
 #include "chunk.h"
+#include "heap.h"
 #include "table.h"
 #include "value.h"
 
@@ -16,20 +21,93 @@ typedef struct {
     Value* slots;
 } CallFrame;
 
+// Where an incremental full collection stands.
+typedef enum {
+    GC_IDLE,
+    GC_MARKING,
+    GC_SWEEPING
+} GcPhase;
+
+#ifdef CONCURRENT_GC
+typedef struct {
+    void* pointer;
+    size_t size;
+} DeferredFree;
+#endif
+
+// Collector policy, set with gcSetParameter().
+typedef struct {
+    size_t initialHeap; // First full collection once the heap gets this big.
+    double growFactor; // Next full collection at the heap left times this.
+    size_t maxHeap; // The program runs out of memory past this, 0 for no limit.
+    size_t minInterval; // Bytes allocated between two full collections at least.
+} GcConfig;
+
+// Pauses are counted in buckets of powers of two microseconds, the last
+// one takes everything longer.
+#define GC_PAUSE_BUCKETS 20
+
 typedef struct {
     CallFrame frames[FRAMES_MAX];
     int frameCount;
 
     Value stack[STACK_MAX]; // defined inline, i.e. contiguously within the struct! 
     Value* stackTop;
-    Table globals; // hashmap of global variables.
+    // Global variables live in an array, the compiler resolves names to indices.
+    Table globalSlots; // name -> index into globalValues.
+    ValueArray globalValues; // UNDEFINED_VAL until the variable is defined.
+    ValueArray globalNames; // index -> name, for error messages.
     Table strings; // hashmap of strings, used to map "equal" strings.
     ObjString* initString;
     ObjUpvalue* openUpvalues;
+
+    // Inline cache effectiveness, exposed to scripts through natives.
+    uint64_t cacheHits;
+    uint64_t cacheMisses;
+    // Loops compiled by the tracing JIT, stays 0 without it.
+    uint64_t tracedLoops;
     
+    Heap heap; // Where reallocate() gets its memory.
     size_t bytesAllocated;
-    size_t nextGC;
-    Obj* objects; // LinkedList of heap-allocated objets.
+    size_t nextGC; // Full collection once the heap grows past this.
+    size_t nextMinorGC; // Minor collection once the heap grows past this.
+    size_t nextSliceGC; // Next slice of a full collection once past this.
+    GcPhase gcPhase;
+    GcConfig gcConfig;
+    int gcSliceWork; // Objects a slice blackens or sweeps.
+    int gcThreads; // Workers of a parallel mark.
+    double gcMaxPause; // Longest time spent in the collector at once, seconds.
+    double gcPauseTotal; // Time the program spent in the collector, seconds.
+    uint64_t gcPauses[GC_PAUSE_BUCKETS]; // Bucket i: under 2^i microseconds.
+    size_t bytesFreed; // By collections, since the VM started.
+    uint64_t stringsCleared; // Dead strings dropped from the intern table.
+    uint64_t slicesCopied; // Slices full collections gave their own characters.
+    bool slicesDeferred; // Marking left the parent of a short slice alone.
+    double startTime; // When the VM started, for mutator utilization.
+#ifdef CONCURRENT_GC
+    pthread_t marker;
+    bool markerDone;
+    // References overwritten while the marker runs, see gcOverwriteBarrier().
+    int overwriteCount;
+    int overwriteCapacity;
+    Obj** overwriteLog;
+    // Blocks freed while the marker runs. It may still be reading them.
+    int deferredCount;
+    int deferredCapacity;
+    DeferredFree* deferredFrees;
+#endif
+    // Old objects that may point at young ones, see gcWriteBarrier().
+    int rememberedCount;
+    int rememberedCapacity;
+    Obj** rememberedSet;
+    // Collection counts, exposed to scripts through natives.
+    uint64_t minorCollections;
+    uint64_t majorCollections;
+    uint64_t compactions; // Stays 0 without COMPACTING_GC.
+#ifdef COMPACTING_GC
+    // The heap got fragmented, compact it at the next GC_SAFEPOINT().
+    bool compactPending;
+#endif
     int grayCount;
     int grayCapacity;
     Obj** grayStack;
@@ -49,5 +127,18 @@ void freeVM();
 InterpretResult interpret(const char* source);
 void push(Value value);
 Value pop();
+int globalSlot(ObjString* name);
+
+// Runtime operations shared between run() and the JIT's native code.
+void runtimeError(const char* format, ...);
+bool isFalsey(Value value);
+bool addNonNumbers();
+bool callValue(Value callee, int argCount);
+bool invoke(ObjString* name, int argCount, InlineCache* cache);
+bool getProperty(ObjInstance* instance, ObjString* name, InlineCache* cache);
+void setProperty(ObjInstance* instance, ObjString* name, Value value,
+                 InlineCache* cache);
+ObjUpvalue* captureUpvalue(Value* local);
+void closeUpvalues(Value* last);
 
 #endif
\ No newline at end of file